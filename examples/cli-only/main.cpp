@@ -16,36 +16,49 @@
 #define ON     1
 
 ESBConfig config;
-CommandParser cmdP(&Serial);
-ESBCLI cmd(config, cmdP);
+ESBCLI cmd(config);
 
-// MQTT message handling
+// ledOff turns the LED off some time after a message blinked it on.
+void ledOff(void *) {
+    digitalWrite(LED, 1-ON);
+}
+ESBTimer ledTimer(ledOff);
+
+// printInfo prints wifi/mqtt info every now and then and right after WiFi events.
+void printInfo(void *) {
+    printf("* Wifi:%s MQTT:%s\n",
+            WiFi.isConnected() ? WiFi.SSID().c_str() : "---",
+            mqttClient.connected() ? config.mqtt_server : "---");
+}
+ESBTimer infoTimer(printInfo);
+
+void onWiFiEvent(WiFiEvent_t event) {
+    esbTimers.start(infoTimer, 0, 20000);
+}
+
+// MQTT message handling, the network task passes messages and connection changes to these
+// handlers through mqttLoop, so they run in the loop task like the rest of the application.
 
-uint32_t ledAt = 0;
+ESBTopic otaTopic = ESB_TOPIC_NONE; // <topic>/ota
 
-void onMqttMessage(char* topic, char* payload, MqttProps properties,
-    size_t len, size_t index, size_t total)
-{
+void onMessage(const char *topic, const char *payload, size_t len, MqttProps props) {
     // Handle over-the-air update messages
-    if (strlen(topic) == mqTopicLen+4 && len == total &&
-            strncmp(topic, mqTopic, mqTopicLen) == 0 &&
-            strcmp(topic+mqTopicLen, "/ota") == 0)
-    {
-        ESBOTA::begin(payload, len);
+    if (mqttTopicIs(otaTopic, topic)) {
+        ESBOTA::begin((char *)payload, len);
     }
 
     digitalWrite(LED, ON);
-    ledAt = millis();
+    esbTimers.start(ledTimer, 100);
 }
 
-void onMqttConnect(bool sessionPresent) {
+void onConnection(bool connected, bool sessionPresent) {
+    if (!connected) return;
     printf("Connected to MQTT, session %spresent\n", sessionPresent?"":"not ");
-    char topic[64];
+}
 
-    strncpy(topic, mqTopic, 32);
-    strcat(topic, "/ota");
-    uint16_t packetIdSub = mqttClient.subscribe(topic, 1);
-    printf("Subscribed at QoS 1, packetId: %d\n", packetIdSub);
+// onReady is called once the subscriptions registered in setup() are confirmed.
+void onReady(uint32_t ms) {
+    printf("MQTT ready after %ums\n", ms);
 }
 
 //===== Setup
@@ -61,8 +74,17 @@ void setup() {
     config.read(); // read config file from flash
     cmd.init(); // init CLI
     mqttSetup(config);
-    mqttClient.onConnect(onMqttConnect);
-    mqttClient.onMessage(onMqttMessage);
+    otaTopic = mqttTopic("/ota");
+    mqttAddSubscription(otaTopic, 1); // subscribed on every connect
+    netStart(); // run MQTT on the network core
+    mqttEnableBulk(true); // log, metrics, etc. on their own session so they don't delay pings
+    mqttEnableCLI(true); // accept commands on <topic>/cli/in
+    mqttEnableConfigPush(config); // apply config deltas retained on <topic>/config
+    mqttOnConnection(onConnection);
+    mqttOnReady(onReady);
+    mqttOnMessage(onMessage);
+    WiFi.onEvent(onWiFiEvent);
+    esbTimers.start(infoTimer, 0, 20000);
     WiFi.mode(WIFI_STA); // start getting wifi to connect
     WiFi.begin();
 
@@ -70,28 +92,7 @@ void setup() {
     printf("===== Setup complete\n");
 }
 
-uint32_t lastInfo = -1000000;
-bool wifiConn = false;
-
 void loop() {
-    // print wifi/mqtt info every now and then
-    bool conn = WiFi.isConnected();
-    if (conn != wifiConn || millis() - lastInfo > 20000) {
-        //WiFi.printDiag(Serial);
-        printf("* Wifi:%s MQTT:%s\n",
-                conn ? WiFi.SSID().c_str() : "---",
-                mqttClient.connected() ? config.mqtt_server : "---");
-        lastInfo = millis();
-        wifiConn = conn;
-    }
-
     mqttLoop();
-    cmd.loop();
-
-    if (ledAt != 0 && millis() - ledAt > 100) {
-	digitalWrite(LED, 1-ON);
-	ledAt = 0;
-    }
-
-    delay(10);
+    esbTimers.wait(); // sleep until a timer is due
 }
@@ -0,0 +1,71 @@
+// ESP32 Secure Base - test of compressed messages that arrive in pieces
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// Feeds a compressed message larger than one TCP segment to mqttReceive in the pieces
+// AsyncMqttClient hands over and checks that the application's handler gets it decompressed.
+// Runs on the board, no network needed:
+//   ../piorun && pio test -e usb -f test_zip
+
+#include <Arduino.h>
+#include <unity.h>
+#include <ESPSecureBase.h>
+
+#define SEGMENT 1436 // TCP payload of a 1500-byte MTU with TLS overhead
+#define TEXT 1600    // random letters compress to more than one segment
+
+static char text[TEXT];
+static uint8_t packed[ESB_NET_MSG_MAX];
+static char got[TEXT+1];
+static size_t gotLen;
+static int gotCount;
+
+static void onMessage(const char *topic, const char *payload, size_t len, MqttProps props) {
+    gotCount++;
+    gotLen = len;
+    if (len <= sizeof(got)) memcpy(got, payload, len);
+}
+
+static void deliver(const uint8_t *msg, size_t len) {
+    MqttProps props = {};
+    for (size_t i=0; i<len; i+=SEGMENT) {
+        size_t n = len-i < SEGMENT ? len-i : SEGMENT;
+        mqttReceive("test/zip", (const char *)msg+i, props, n, i, len);
+    }
+    netLoop();
+}
+
+static void test_zip_pieces() {
+    uint32_t seed = 1;
+    for (int i=0; i<TEXT; i++) {
+        seed = seed*1103515245 + 12345;
+        text[i] = 'a' + (seed>>16) % 26;
+    }
+    size_t len = esbZip((const uint8_t *)text, TEXT, packed, sizeof(packed));
+    TEST_ASSERT_GREATER_THAN(SEGMENT, len);
+
+    gotCount = 0;
+    deliver(packed, len);
+    TEST_ASSERT_EQUAL(1, gotCount);
+    TEST_ASSERT_EQUAL(TEXT, gotLen);
+    TEST_ASSERT_EQUAL_MEMORY(text, got, TEXT);
+}
+
+static void test_plain_pieces() {
+    gotCount = 0;
+    deliver((const uint8_t *)text, TEXT);
+    TEST_ASSERT_EQUAL(1, gotCount);
+    TEST_ASSERT_EQUAL(TEXT, gotLen);
+    TEST_ASSERT_EQUAL_MEMORY(text, got, TEXT);
+}
+
+void setup() {
+    delay(2000); // the serial monitor needs to connect
+    mqttOnMessage(onMessage);
+    mqttEnableZip(true);
+    UNITY_BEGIN();
+    RUN_TEST(test_zip_pieces);
+    RUN_TEST(test_plain_pieces);
+    UNITY_END();
+}
+
+void loop() {}
@@ -3,6 +3,8 @@
 
 // Example application to demo Wifi and MQTT configuration using a Wifi access point and/or a serial
 // commandline.
+// The configuration portal runs in the background whenever WiFi is down for a while, the
+// application keeps sampling its sensor and buffers the readings until MQTT is connected.
 // It also supports OTA flash updates.
 
 #include <Arduino.h>
@@ -15,31 +17,74 @@
 #ifndef LED
 #define LED    1
 #endif
+#define SENSOR 36
 
 #undef cli
 ESBConfig config;
-ESBWifiConfig *wifiConfig; // allocated on-demand when portal is active
-CommandParser cmdP(&Serial);
-ESBCLI cli(config, cmdP);
-ESBDebug dbg(cmdP);
+ESBCLI cli(config);
 
 // configuration portal timing
 
-#define CONF_CONN_TIMEOUT   10     // seconds to try to connect to AP before setting up config portal
-#define CONF_PORTAL_TIMEOUT (5*60) // seconds before config portal stops and device resets
-#define CONF_RESET_TIMEOUT  (20*60) // seconds before we reset if MQTT remains disconnected
+#define CONF_OFFLINE 10 // seconds without WiFi before the config portal starts
+
+//===== Sensor
+
+// The sensor is sampled regardless of the WiFi state, readings queue up in a small ring while
+// MQTT is down and are published as soon as it's up again.
+
+#define SAMPLE_MS  10000 // sampling period
+#define SAMPLE_BUF 64    // readings kept while disconnected, the oldest are dropped
+
+struct Sample { uint32_t at; uint16_t value; };
+static Sample samples[SAMPLE_BUF];
+static uint32_t sampleHead = 0, sampleTail = 0; // free-running, index with % SAMPLE_BUF
+static uint32_t sampleDropped = 0;
+DV(sampleHead); DV(sampleTail); DVC(sampleDropped);
+
+ESBTopic sensorTopic = ESB_TOPIC_NONE; // <topic>/sensor
+
+void sample(void *) {
+    if (sampleHead - sampleTail == SAMPLE_BUF) {
+        sampleTail++;
+        sampleDropped++;
+    }
+    Sample &s = samples[sampleHead++ % SAMPLE_BUF];
+    s.at = millis();
+    s.value = analogRead(SENSOR);
+
+    // publish what's queued, oldest first, stopping at the first failure
+    while (sampleTail != sampleHead && mqttClient.connected()) {
+        Sample &q = samples[sampleTail % SAMPLE_BUF];
+        char msg[48];
+        int len = snprintf(msg, sizeof(msg), "{\"age_ms\":%lu,\"value\":%u}",
+                (unsigned long)(millis()-q.at), q.value);
+        if (!mqttPublish(sensorTopic, 0, false, msg, len)) break;
+        sampleTail++;
+    }
+}
+ESBTimer sampleTimer(sample);
+
+// printInfo prints wifi/mqtt info every now and then and right after WiFi events.
+void printInfo(void *) {
+    printf("* Wifi:%s MQTT:%s Portal:%s Queued:%u\n",
+            WiFi.isConnected() ? WiFi.SSID().c_str() : "---",
+            mqttClient.connected() ? config.mqtt_server : "---",
+            portalActive() ? "up" : "---", sampleHead-sampleTail);
+}
+ESBTimer infoTimer(printInfo);
+
+void onWiFiEvent(WiFiEvent_t event) {
+    esbTimers.start(infoTimer, 0, 20000);
+}
 
 // MQTT message handling
 
-static void onMqttMessage(char* topic, char* payload, MqttProps properties,
-    size_t len, size_t index, size_t total)
-{
+ESBTopic otaTopic = ESB_TOPIC_NONE; // <topic>/ota
+
+void onMessage(const char *topic, const char *payload, size_t len, MqttProps props) {
     // Handle over-the-air update messages
-    if (strlen(topic) == mqTopicLen+4 && len == total &&
-            strncmp(topic, mqTopic, mqTopicLen) == 0 &&
-            strcmp(topic+mqTopicLen, "/ota") == 0)
-    {
-        ESBOTA::begin(payload, len);
+    if (mqttTopicIs(otaTopic, topic)) {
+        ESBOTA::begin((char *)payload, len);
     }
 }
 
@@ -61,78 +106,24 @@ void setup() {
 #endif
 
     mqttSetup(config);
-    mqttClient.onMessage(onMqttMessage);
+    otaTopic = mqttTopic("/ota");
+    sensorTopic = mqttTopic("/sensor");
+    mqttAddSubscription(otaTopic, 1);
+    mqttEnableCLI(true); // accept commands on <topic>/cli/in
+    mqttOnMessage(onMessage);
+    WiFi.onEvent(onWiFiEvent);
     WiFi.mode(WIFI_STA); // start getting wifi to connect
     WiFi.begin();
+    portalEnable(config, CONF_OFFLINE); // config portal whenever WiFi is down for a while
+    esbTimers.start(infoTimer, 0, 20000);
+    esbTimers.start(sampleTimer, SAMPLE_MS, SAMPLE_MS);
 
     ESBVar::list();
 
     printf("===== Setup complete\n");
 }
 
-static uint32_t loopAt = 0;
-static uint32_t lastInfo = -10000;
-static bool wifiConn = false;
-static bool mqttConn = false;
-static uint32_t mqttLast = 0;
-DV(loopAt); DV(lastInfo); DV(wifiConn); DV(mqttConn); DV(mqttLast);
-
-// state to manage the WiFi configuration portal
-static bool mqttDidConnect = false; // once MQTT connects we don't show the portal ever again
-static uint32_t loopStart = 0;      // timer for the initial connection timeout
-static uint32_t portalStart = 0;    // timer for the portal timeout
-DV(mqttDidConnect); DV(loopStart); DV(portalStart);
-
 void loop() {
-    // update state
-    loopAt = millis();
-    if (loopStart == 0) loopStart = loopAt;
-    bool wc = WiFi.isConnected();
-    bool mc = mqttClient.connected();
-    if (mc) mqttLast = loopAt;
-    if (mc) mqttDidConnect = true;
-
-    // print wifi/mqtt info every now and then, or when it changes.
-    if (wc != wifiConn || mc != mqttConn || loopAt - lastInfo > 20000) {
-        //WiFi.printDiag(Serial);
-        printf("* Wifi:%s MQTT:%s\n",
-                wc ? WiFi.SSID().c_str() : "---",
-                mc ? config.mqtt_server : "---");
-        lastInfo = loopAt;
-        wifiConn = wc;
-        mqttConn = mc;
-    }
-
-    // Do we need to start the configuration portal?.
-    // The portal is started if, after the initial boot, we don't connect to MQTT within the
-    // CONF_CONN_TIMEOUT.
-    if (!mqttDidConnect && !wifiConfig && loopAt-loopStart > CONF_CONN_TIMEOUT) {
-        wifiConfig = new ESBWifiConfig(config);
-        wifiConfig->startPortal();
-        portalStart = loopAt;
-    }
-
-    // Is it time to shut down the config portal?
-    // The portal is shut down unconditionally after CONF_PORTAL_TIMEOUT.
-    if (mqttConn && wifiConfig && loopAt-portalStart > CONF_PORTAL_TIMEOUT) {
-        wifiConfig->stopPortal();
-        delete wifiConfig;
-        wifiConfig = 0;
-    }
-
-    // Do we need to reset 'cause things are just not working?
-    if (!mqttConn && loopAt-mqttLast > CONF_RESET_TIMEOUT*1000) {
-        printf("* MQTT disconnected for a long time, resetting...\n");
-        delay(50); // time for the printf
-        ESP.restart();
-        delay(10000); // just in case it doesn't reset...
-    }
-
     mqttLoop();
-    cli.loop();
-    if (wifiConfig) wifiConfig->loop();
-
-    //if (digitalRead(BUTTON) == LOW) reconfig();
-
-    delay(10);
+    esbTimers.wait(); // sleep until a timer is due
 }
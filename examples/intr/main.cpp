@@ -7,6 +7,8 @@
 // This example tests interrupts, specifically, whether calling `millis()` in an interupt handler
 // crashes OTA updates. The answer is 'yes' because it contains a 64-bit division from micros to
 // millis and that is not IRAM_ATTR. Using micros() instead works like a charm.
+// The interrupt handler hands each pulse to an ESBEventQueue, whose task computes the pulse rate
+// without losing pulses even at high rates.
 
 #include <Arduino.h>
 #include <WiFi.h>
@@ -21,45 +23,65 @@
 #define INTR  25 // interrupt pin, put pulses at ~20Hz here
 
 ESBConfig config;
-CommandParser cmdP(&Serial);
-ESBCLI cmd(config, cmdP);
+ESBCLI cmd(config);
 
-static volatile uint32_t ledAt = 0;
-#define INTR_MICROS 0
+static uint32_t pulses = 0;          // number of pulses handled
+static uint32_t pulseMin = ~0;       // shortest interval between pulses in micros
+static uint32_t pulseLast = 0;
+
+void ledOff(void *) {
+    digitalWrite(LED, 1-ON);
+}
+ESBTimer ledTimer(ledOff);
+
+// onPulses runs in the event queue's task and gets pulses in batches.
+void onPulses(const ESBEvent *events, int count) {
+    for (int i=0; i<count; i++) {
+        uint32_t dt = events[i].micros - pulseLast;
+        if (pulses > 0 && dt < pulseMin) pulseMin = dt;
+        pulseLast = events[i].micros;
+        pulses++;
+    }
+    esbTimers.start(ledTimer, 30); // turn the LED off 30ms after the last pulse
+}
+
+ESBEventQueue pulseQueue(256, onPulses);
+
+// printInfo prints wifi/mqtt info and pulse stats every now and then and right after WiFi events.
+void printInfo(void *) {
+    printf("* Wifi:%s MQTT:%s pulses:%u min-interval:%uus dropped:%u\n",
+            WiFi.isConnected() ? WiFi.SSID().c_str() : "---",
+            mqttClient.connected() ? config.mqtt_server : "---",
+            pulses, pulseMin, pulseQueue.overflows());
+}
+ESBTimer infoTimer(printInfo);
+
+void onWiFiEvent(WiFiEvent_t event) {
+    esbTimers.start(infoTimer, 0, 20000);
+}
 
 // Interrupt handler
 
 void IRAM_ATTR intr() {
     digitalWrite(LED, ON);
-#if INTR_MICROS
-    ledAt = micros();
-#else
-    ledAt = millis();
-#endif
+    pulseQueue.push(0);
 }
 
 // MQTT message handling
 
-void onMqttMessage(char* topic, char* payload, MqttProps properties,
-    size_t len, size_t index, size_t total)
-{
+ESBTopic otaTopic = ESB_TOPIC_NONE; // <topic>/ota
+
+// onMessage is called by mqttLoop, redelivered duplicates have already been dropped.
+void onMessage(const char *topic, const char *payload, size_t len, MqttProps props) {
     // Handle over-the-air update messages
-    if (strlen(topic) == mqTopicLen+4 && len == total &&
-            strncmp(topic, mqTopic, mqTopicLen) == 0 &&
-            strcmp(topic+mqTopicLen, "/ota") == 0)
-    {
-        ESBOTA::begin(payload, len);
+    if (mqttTopicIs(otaTopic, topic)) {
+        ESBOTA::begin((char *)payload, len);
     }
 }
 
-void onMqttConnect(bool sessionPresent) {
+void onConnection(bool connected, bool sessionPresent) {
+    if (!connected) return;
     printf("Connected to MQTT, session %spresent\n", sessionPresent?"":"not ");
-    char topic[64];
-
-    strncpy(topic, mqTopic, 32);
-    strcat(topic, "/ota");
-    uint16_t packetIdSub = mqttClient.subscribe(topic, 1);
-    printf("Subscribed at QoS 1, packetId: %d\n", packetIdSub);
 }
 
 //===== Setup
@@ -71,14 +93,19 @@ void setup() {
     pinMode(LED, OUTPUT);
     digitalWrite(LED, ON);
 
+    pulseQueue.begin();
     pinMode(INTR, INPUT_PULLUP);
     attachInterrupt(INTR, intr, RISING);
 
     config.read(); // read config file from flash
     cmd.init(); // init CLI
     mqttSetup(config);
-    mqttClient.onConnect(onMqttConnect);
-    mqttClient.onMessage(onMqttMessage);
+    otaTopic = mqttTopic("/ota");
+    mqttAddSubscription(otaTopic, 1); // subscribed on every connect
+    mqttOnConnection(onConnection);
+    mqttOnMessage(onMessage);
+    WiFi.onEvent(onWiFiEvent);
+    esbTimers.start(infoTimer, 0, 20000);
     WiFi.mode(WIFI_STA); // start getting wifi to connect
     WiFi.begin();
 
@@ -86,32 +113,7 @@ void setup() {
     printf("===== Setup complete\n");
 }
 
-uint32_t lastInfo = -1000000;
-bool wifiConn = false;
-
 void loop() {
-    // print wifi/mqtt info every now and then
-    bool conn = WiFi.isConnected();
-    if (conn != wifiConn || millis() - lastInfo > 20000) {
-        //WiFi.printDiag(Serial);
-        printf("* Wifi:%s MQTT:%s\n",
-                conn ? WiFi.SSID().c_str() : "---",
-                mqttClient.connected() ? config.mqtt_server : "---");
-        lastInfo = millis();
-        wifiConn = conn;
-    }
-
     mqttLoop();
-    cmd.loop();
-
-#if INTR_MICROS
-    if (ledAt != 0 && micros() - ledAt > 30000) {
-#else
-    if (ledAt != 0 && millis() - ledAt > 30) {
-#endif
-	digitalWrite(LED, 1-ON);
-	ledAt = 0;
-    }
-
-    //delay(10);
+    esbTimers.wait(); // sleep until a timer is due
 }
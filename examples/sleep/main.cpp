@@ -0,0 +1,34 @@
+// ESP32 Secure Base Deep Sleep Example
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+// Example application for a battery powered sensor: it wakes up, publishes a reading on
+// <topic>/reading at QoS 1, and goes back to deep sleep. WiFi and MQTT need to be configured
+// beforehand, e.g. using the cli-only example, the WiFi credentials are kept by the ESP-IDF and
+// the MQTT config in SPIFFS.
+// The time spent awake is published on <topic>/awake, after the first wake it should drop
+// because the WiFi scan and DHCP are skipped.
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <ESPSecureBase.h>
+
+#ifndef SENSOR
+#define SENSOR 34 // analog input
+#endif
+#define SLEEP_SEC 60
+
+ESBConfig config;
+
+void setup() {
+    Serial.begin(115200);
+    printf("\n===== ESP32 Secure Base Sleep Example, wake %u =====\n", sleepWakes());
+
+    config.read(); // read config file from flash
+
+    char msg[32];
+    int len = snprintf(msg, sizeof(msg), "%d", analogRead(SENSOR));
+    sleepPublish("/reading", msg, len);
+    sleepRun(config, SLEEP_SEC);
+}
+
+void loop() {}
@@ -1,147 +1,214 @@
 #include <ESPSecureBase.h>
-#include <functional>
-
-void ESBCLI::cmdWifiCB(CommandParser &cp, const char *cmd) {
-    char *subCmd = cp.getArg();
-    if (subCmd && strcmp(subCmd, "connect") == 0) {
-        char *ssid = cp.getArg();
-        char *pass = cp.getArg();
-        if (!ssid || *ssid == 0) {
-            printf("Usage: wifi connect <ssid> [<pass>]\n");
-        } else if (pass && strlen(pass) < 8) {
-            printf("Wifi: password must be at least 8 chars long, got %d\n", strlen(pass));
-        } else {
-            printf("Wifi: connecting to %s/%s\n", ssid, pass?pass:"-no-pass-");
-            WiFi.disconnect();
-            delay(100);
-            WiFi.setAutoConnect(true);
-            WiFi.setAutoReconnect(true);
-            WiFi.persistent(true);
-            WiFi.begin(ssid, pass);
-        }
+#include <esp_wifi.h>
+
+// config used by the command handlers, set by ESBCLI::init
+static ESBConfig *cliConfig;
+
+//===== wifi commands
+
+static void cmdWifiConnect(ESBArgs &args) {
+    const char *ssid = args.str();
+    const char *pass = args.str();
+    if (!ssid || *ssid == 0) {
+        printf("Usage: wifi connect <ssid> [<pass>]\n");
+    } else if (pass && strlen(pass) < 8) {
+        printf("Wifi: password must be at least 8 chars long, got %d\n", strlen(pass));
     } else {
-        bool info = subCmd && strcmp(subCmd, "info") == 0;
-        bool help = subCmd && strcmp(subCmd, "help") == 0;
-        if (subCmd && !info && !help) printf("Wifi: unknown sub-command '%s'\n", subCmd);
-        if (!subCmd || info) {
-            printf("Wifi: SSID=%s PASS=%s connected:%s\n",
-                    WiFi.SSID().c_str(), WiFi.psk().c_str(), WiFi.isConnected()?"yes":"no");
-        }
-        if (!subCmd || !info) {
-            printf("Wifi: available sub-commands are connect, info, help\n");
-        }
+        printf("Wifi: connecting to %s/%s\n", ssid, pass?pass:"-no-pass-");
+        ESB_ALLOC_SCOPE(wifiConnect, false);
+        WiFi.disconnect();
+        delay(100);
+        WiFi.setAutoConnect(true);
+        WiFi.setAutoReconnect(true);
+        WiFi.persistent(true);
+        WiFi.begin(ssid, pass);
     }
 }
+ESB_CMD(wifi, connect, cmdWifiConnect, "<ssid> [<pass>]");
 
-void ESBCLI::cmdMqttCB(CommandParser &cp, const char *cmd) {
-    const char *subCmd = cp.getArg();
-    const char *arg = cp.getArg(); if (!arg) arg = "";
-    //printf("MQTT command: '%s' '%s'\n", subCmd?subCmd:"", arg);
-    if (subCmd && strcmp(subCmd, "server") == 0) {
-        const char *port = cp.getArg();
-        if (!port) port = "8883";
-        printf("MQTT: setting server to %s:%s\n", arg, port);
-        strncpy(config.mqtt_server, arg, sizeof(config.mqtt_server)-1);
-        strncpy(config.mqtt_port, port, sizeof(config.mqtt_port)-1);
-        config.save();
-        mqttConnect();
-    } else if (subCmd && strcmp(subCmd, "ident") == 0) {
-        printf("MQTT: setting ident to %s\n", arg);
-        strncpy(config.mqtt_ident, arg, sizeof(config.mqtt_ident)-1);
-        config.save();
-        mqttConnect();
-    } else if (subCmd && strcmp(subCmd, "psk") == 0) {
-        printf("MQTT: setting psk to %s\n", arg);
-        strncpy(config.mqtt_psk, arg, sizeof(config.mqtt_psk)-1);
-        config.save();
-        mqttConnect();
-    } else {
-        bool info = subCmd && strcmp(subCmd, "info") == 0;
-        bool help = subCmd && strcmp(subCmd, "help") == 0;
-        if (subCmd && !info && !help) printf("MQTT: unknown sub-command '%s'", subCmd);
-        if (!subCmd || info) {
-            printf("MQTT: server=%s port=%s ident=%s psk=%s, connected:%s\n",
-                    config.mqtt_server, config.mqtt_port, config.mqtt_ident, config.mqtt_psk,
-                    mqttClient.connected()?"yes":"no");
-        }
-        if (!subCmd || !info) {
-            printf("MQTT: available sub-commands are server, ident, psk, info, help\n");
+static void cmdWifiInfo(ESBArgs &args) {
+    // WiFi.SSID() and WiFi.psk() return Strings, get the config directly instead
+    wifi_config_t conf;
+    if (esp_wifi_get_config(WIFI_IF_STA, &conf) != ESP_OK) memset(&conf, 0, sizeof(conf));
+    printf("Wifi: SSID=%.32s PASS=%.64s connected:%s\n",
+            conf.sta.ssid, conf.sta.password, WiFi.isConnected()?"yes":"no");
+}
+ESB_CMD(wifi, info, cmdWifiInfo, "");
+
+// cmdWifi shows the settings and the sub-commands for a bare "wifi".
+static void cmdWifi(ESBArgs &args) {
+    const char *sub = args.next();
+    if (sub) printf("Error: unknown wifi sub-command '%s'\n", sub);
+    else cmdWifiInfo(args);
+    ESBCmd::help("wifi");
+}
+ESB_CMD(wifi, , cmdWifi, "");
+
+//===== mqtt commands
+
+static void cmdMqttServer(ESBArgs &args) {
+    const char *server = args.str("");
+    uint32_t port = 8883;
+    if (!args.u32(port, true) || port == 0 || port > 65535) {
+        printf("Usage: mqtt server <hostname> [<port>]\n");
+        return;
+    }
+    printf("MQTT: setting server to %s:%u\n", server, port);
+    strncpy(cliConfig->mqtt_server, server, sizeof(cliConfig->mqtt_server)-1);
+    snprintf(cliConfig->mqtt_port, sizeof(cliConfig->mqtt_port), "%u", port);
+    cliConfig->save();
+    mqttConnect();
+}
+ESB_CMD(mqtt, server, cmdMqttServer, "<hostname> [<port>]");
+
+static void cmdMqttAlt(ESBArgs &args) {
+    // the list is one argument if quoted, else join the words
+    char list[sizeof(cliConfig->mqtt_alt)];
+    int len = 0;
+    list[0] = 0;
+    for (const char *a = args.str(); a; a = args.str()) {
+        len += snprintf(list+len, sizeof(list)-len, "%s%s", len ? " " : "", a);
+        if (len >= (int)sizeof(list)) {
+            printf("MQTT: alternate broker list too long\n");
+            return;
         }
     }
+    printf("MQTT: setting alternate brokers to \"%s\"\n", list);
+    strcpy(cliConfig->mqtt_alt, list);
+    cliConfig->save();
+    mqttConnect();
+}
+ESB_CMD(mqtt, alt, cmdMqttAlt, "[<hostname>[:<port>] ...]");
+
+static void cmdMqttBrokers(ESBArgs &args) {
+    brokerPrint();
+}
+ESB_CMD(mqtt, brokers, cmdMqttBrokers, "");
+
+static void cmdMqttIdent(ESBArgs &args) {
+    const char *arg = args.str("");
+    printf("MQTT: setting ident to %s\n", arg);
+    strncpy(cliConfig->mqtt_ident, arg, sizeof(cliConfig->mqtt_ident)-1);
+    cliConfig->save();
+    mqttConnect();
 }
+ESB_CMD(mqtt, ident, cmdMqttIdent, "<ident>");
 
-void ESBCLI::cmdRestartCB(CommandParser &cp, const char *cmd) {
+static void cmdMqttPsk(ESBArgs &args) {
+    const char *arg = args.str("");
+    printf("MQTT: setting psk to %s\n", arg);
+    strncpy(cliConfig->mqtt_psk, arg, sizeof(cliConfig->mqtt_psk)-1);
+    cliConfig->save();
+    mqttConnect();
+}
+ESB_CMD(mqtt, psk, cmdMqttPsk, "<hex-key>");
+
+static void cmdMqttInfo(ESBArgs &args) {
+    printf("MQTT: server=%s port=%s alt=\"%s\" ident=%s psk=%s, connected:%s\n",
+            cliConfig->mqtt_server, cliConfig->mqtt_port, cliConfig->mqtt_alt,
+            cliConfig->mqtt_ident, cliConfig->mqtt_psk, mqttClient.connected()?"yes":"no");
+}
+ESB_CMD(mqtt, info, cmdMqttInfo, "");
+
+// cmdMqtt shows the settings and the sub-commands for a bare "mqtt".
+static void cmdMqtt(ESBArgs &args) {
+    const char *sub = args.next();
+    if (sub) printf("Error: unknown mqtt sub-command '%s'\n", sub);
+    else cmdMqttInfo(args);
+    ESBCmd::help("mqtt");
+}
+ESB_CMD(mqtt, , cmdMqtt, "");
+
+//===== restart command
+
+static void cmdRestart(ESBArgs &args) {
     printf("*** Restarting...\n");
+    esbLogFlush();
     delay(50);
     ESP.restart();
     while (true) delay(100);
 }
+ESB_CMD(restart, , cmdRestart, "");
 
-void ESBCLI::cmdErrorCB(CommandParser &cp, const char *cmd) {
-    if (!cmd) cmd = "";
-    if (strcmp("help", cmd) != 0) printf("Error: unknown command '%s'\n", cmd);
-    printf("Available commands are: wifi, mqtt, restart, help\n");
-}
+//===== serial input
 
-void ESBCLI::init() {
-    using namespace std::placeholders; // for the _1, _2, ...
-    cmdParser.setDefault(std::bind(&ESBCLI::cmdErrorCB, this, _1, _2));
-    cmdParser.addCommand("wifi", std::bind(&ESBCLI::cmdWifiCB, this, _1, _2));
-    cmdParser.addCommand("mqtt", std::bind(&ESBCLI::cmdMqttCB, this, _1, _2));
-    cmdParser.addCommand("restart", std::bind(&ESBCLI::cmdRestartCB, this, _1, _2));
-}
+#define CLI_LINE_LEN 128 // max length of a command line
+#define CLI_LINES 4      // number of complete lines that can be queued for the CLI task
 
-ESBVar *ESBVar::_first = NULL;
+// Serial.onReceive appeared in arduino-esp32 2.0.3
+#ifdef ESP_ARDUINO_VERSION
+#if ESP_ARDUINO_VERSION >= ESP_ARDUINO_VERSION_VAL(2, 0, 3)
+#define CLI_RX_CALLBACK 1
+#endif
+#endif
 
-void ESBVar::list() {
-    printf("== Variables:\n");
-    for (ESBVar *v=_first; v; v=v->_next) {
-        uint32_t val = v->read();
-        printf("  %s [%d] @0x%08x = %d/%u/0x%x\n", v->_name, v->_size, (uint32_t)v->_ref,
-                (int32_t)val, val, val);
-    }
-}
+static char cliLine[CLI_LINE_LEN]; // line being assembled
+static int cliLen = 0;
+static char cliQueue[CLI_LINES][CLI_LINE_LEN]; // complete lines waiting to be run
+static volatile uint8_t cliHead = 0;           // written by onReceive
+static volatile uint8_t cliTail = 0;           // written by the CLI task
+static TaskHandle_t cliTask = NULL;
 
-ESBVar *ESBVar::find(const char *name) {
-    for (ESBVar *v = _first; v; v = v->_next) {
-        if (strcmp(v->_name, name) == 0) return v;
+// onReceive reads all available characters, echoes them, and queues complete lines.
+// It runs in the UART driver's event task, so the application's loop is not involved.
+void ESBCLI::onReceive() {
+    bool queued = false;
+    while (Serial.available() > 0) {
+        int ch = Serial.read();
+        if (ch == '\r' || ch == '\n') {
+            if (cliLen == 0) continue; // empty line or second char of \r\n
+            Serial.write('\n');
+            if ((uint8_t)(cliHead - cliTail) >= CLI_LINES) {
+                ESB_LOGW("CLI: busy, dropping command\n");
+            } else {
+                memcpy(cliQueue[cliHead % CLI_LINES], cliLine, cliLen);
+                cliQueue[cliHead % CLI_LINES][cliLen] = 0;
+                cliHead++;
+                queued = true;
+            }
+            cliLen = 0;
+        } else if (ch == '\b' || ch == 0x7f) {
+            if (cliLen > 0) {
+                cliLen--;
+                Serial.write("\b \b", 3);
+            }
+        } else if (ch >= ' ' && cliLen < CLI_LINE_LEN-1) {
+            cliLine[cliLen++] = ch;
+            Serial.write(ch);
+        }
     }
-    return NULL;
+    if (queued && cliTask) xTaskNotifyGive(cliTask);
 }
 
-void ESBDebug::debugCmdCB(CommandParser &cp, const char *cmd) {
-    const char *subCmd = cp.getArg();
-    const char *arg = cp.getArg(); if (!arg) arg = "";
-    ESBVar *var = NULL;
-    //printf("DEBUG command: '%s' '%s'\n", subCmd?subCmd:"", arg);
-    if (subCmd && strcmp(subCmd, "show") == 0) {
-        if (strlen(arg) == 0) {
-            printf("DEBUG show: variable name required\n");
-            return;
-        }
-        var = ESBVar::find(arg);
-        if (!var) {
-            printf("DEBUG show: variable '%s' not found\n", arg);
-            return;
-        }
-        uint32_t val = var->read();
-        printf("  %s: %d/%u/0x%x\n", var->_name, (int32_t)val, val, val);
-    } else if (subCmd && (var = ESBVar::find(subCmd)) != NULL) {
-        uint32_t val = var->read();
-        printf("  %s: %d/%u/0x%x\n", var->_name, (int32_t)val, val, val);
-    } else {
-        bool list = subCmd && strcmp(subCmd, "list") == 0;
-        bool help = subCmd && strcmp(subCmd, "help") == 0;
-        if (subCmd && !list && !help) printf("DEBUG: unknown sub-command '%s'", subCmd);
-        if (!subCmd || list) {
-            ESBVar::list();
-        }
-        if (!subCmd || !list) {
-            printf("DEBUG: available sub-commands are list, show, help\n");
+// task runs queued command lines. With older arduino-esp32, which has no receive callback, it
+// also polls the serial port, but it does so in its own task and not in loop().
+void ESBCLI::task(void *) {
+    while (true) {
+#ifdef CLI_RX_CALLBACK
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#else
+        vTaskDelay(pdMS_TO_TICKS(20));
+        onReceive();
+#endif
+        while (cliTail != cliHead) {
+            {
+                ESB_CONFIG_LOCK();
+                ESBCmd::exec(cliQueue[cliTail % CLI_LINES]);
+            }
+            cliTail++;
         }
     }
 }
 
+void ESBCLI::init() {
+    cliConfig = &config;
+    if (cliTask) return;
+    xTaskCreate(task, "esb_cli", 6144, NULL, tskIDLE_PRIORITY+1, &cliTask);
+#ifdef CLI_RX_CALLBACK
+    Serial.onReceive(onReceive);
+#endif
+}
+
 // The following are not used, but if they're not included here then platformio doesn't
 // find them when they're included in some other library. Sigh...
 #if 0
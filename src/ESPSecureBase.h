@@ -2,9 +2,31 @@
 // Copyright (c) 2019 Thorsten von Eicken, all rights reserved
 
 #include <ESPAsyncWiFiManager.h>
+#include "log.h"
 #include "ota.h"
+#include "bundle.h"
 #include "mqtt.h"
-#include "CommandParser.h"
+#include "cmd.h"
+#include "var.h"
+#include "trace.h"
+#include "prof.h"
+#include "mon.h"
+#include "evq.h"
+#include "lat.h"
+#include "timer.h"
+#include "topic.h"
+#include "mbox.h"
+#include "net.h"
+#include "subs.h"
+#include "flight.h"
+#include "bulk.h"
+#include "broker.h"
+#include "zip.h"
+#include "fleet.h"
+#include "portal.h"
+#include "prov.h"
+#include "sleep.h"
+#include "alloc.h"
 
 // ESBConfig manages the storage of Wifi and MQTT config parameters as well as updating the
 // respective client libs. A singleton object needs to be allocated during set-up and remain
@@ -20,6 +42,12 @@ public:
     char mqtt_port[6];
     char mqtt_ident[41];
     char mqtt_psk[41];
+    char mqtt_alt[81];   // alternate brokers: "host[:port] host[:port]...", see broker.h
+    // last config pushed over MQTT to this device and to the fleet, see fleet.h
+    char push_hash[17];
+    char fleet_hash[17];
+    uint32_t push_version;
+    uint32_t fleet_version;
 
     ESBConfig()
         : initialized(false)
@@ -31,6 +59,10 @@ public:
         memset(mqtt_port, 0, sizeof(mqtt_port));
         memset(mqtt_ident, 0, sizeof(mqtt_ident));
         memset(mqtt_psk, 0, sizeof(mqtt_psk));
+        memset(mqtt_alt, 0, sizeof(mqtt_alt));
+        memset(push_hash, 0, sizeof(push_hash));
+        memset(fleet_hash, 0, sizeof(fleet_hash));
+        push_version = fleet_version = 0;
     }
 
 //private:
@@ -38,9 +70,20 @@ public:
     bool initialized; // true once the config has been read
 
     void read();
+    void readProv();
     void save();
 };
 
+// ESBConfigLock holds the recursive config lock for the rest of the scope. CLI commands, config
+// pushes, and the portal run in different tasks and each may change fields, save the config,
+// and reconnect, they do it holding the lock. It's a no-op before ESBConfig::read.
+class ESBConfigLock {
+public:
+    ESBConfigLock();
+    ~ESBConfigLock();
+};
+#define ESB_CONFIG_LOCK() ESBConfigLock esbConfigLock_
+
 // ESBWifiConfig manages the AsyncWifiManager in order to run the config AP and show the necessary
 // configuration UI. It holds the storage for the Wifi manager and the HTTP server and needs to
 // remain allocated while these are active. It can be deallocated once the setup is complete.
@@ -74,7 +117,9 @@ public:
     // TODO: this has issues with crashing AsyncTCP stuff, ugh...
     //bool reconfig(int connectTimeout, int portalTimeout);
 
-    // startPortal starts the configuration portal
+    // startPortal starts the configuration portal without blocking, loop() must then be called
+    // periodically. Values saved in the portal are written to the config and set saved.
+    // See portal.h for a service that does this based on the WiFi state.
     void startPortal();
 
     // stopPortal stops the configuration portal
@@ -104,76 +149,32 @@ public:
 
     void init(int connectTimeout, int portalTimeout);
     void save();
+
+    // initServer registers handlers for the pre-compressed portal pages, they need to be
+    // registered before the wifi manager's own so they take precedence.
+    void initServer();
+    void sendPage(AsyncWebServerRequest *request, const uint8_t *gz, size_t len, const char *etag);
+    void sendValues(AsyncWebServerRequest *request);
 };
 
+// ESBCLI runs the serial command line. It registers the config with the wifi, mqtt, and debug
+// commands (see cmd.h) and processes serial input as it arrives: the UART receive callback
+// assembles lines and hands complete ones to a CLI task, which runs them. The application's
+// loop() does not need to poll anything. This replaces the CommandParser-based ESBCLI, which took
+// a parser and an ESBDebug and had to be polled with loop(): applications construct ESBCLI with
+// just the config and drop the loop() call. Commands run under ESB_CONFIG_LOCK, so one from the
+// serial port and one from MQTT don't change the config at the same time.
 class ESBCLI {
 public:
-    ESBCLI(ESBConfig &c, CommandParser &cp)
-      : cmdParser(cp)
-      , config(c)
+    ESBCLI(ESBConfig &c)
+      : config(c)
     {}
 
     void init();
 
-    void loop() {
-        // Check if user typed something into the serial monitor
-        cmdParser.loop();
-    }
-
 //private:
-    void cmdErrorCB(CommandParser &cp, const char *cmd);
-    void cmdWifiCB(CommandParser &cp, const char *cmd);
-    void cmdMqttCB(CommandParser &cp, const char *cmd);
-    void cmdRestartCB(CommandParser &cp, const char *cmd);
-    CommandParser &cmdParser;
     ESBConfig &config;
-};
-
-class ESBDebug {
-public:
-    ESBDebug(CommandParser &cp)
-    {
-        using namespace std::placeholders; // for the _1, _2, ...
-        cp.addCommand("debug", std::bind(&ESBDebug::debugCmdCB, this, _1, _2));
-    }
-
-//private: // private but not enforced
-
-    void debugCmdCB(CommandParser &cp, const char *cmd);
 
-    //CommandParser &_cp;
+    static void onReceive();
+    static void task(void *);
 };
-
-class ESBVar {
-public:
-    const char *_name;
-    void       *_ref;
-    ESBVar     *_next;
-    uint8_t    _size;
-
-    static ESBVar *_first;
-
-    ESBVar(const char *name, void *ref, int size)
-      : _name(name)
-      , _ref(ref)
-      , _size(size)
-    {
-        _next = _first;
-        _first = this;
-    }
-
-    static void list();
-
-    static ESBVar *find(const char *name);
-
-    uint32_t read() {
-        switch(_size) {
-        case 1: return (uint32_t)( *(uint8_t*)_ref );
-        case 2: return (uint32_t)( *(uint16_t*)_ref );
-        case 4: return (uint32_t)( *(uint32_t*)_ref );
-        default: return 0;
-        }
-    }
-};
-
-#define DV(v) static ESBVar __ ## v(#v, &v, sizeof(v))
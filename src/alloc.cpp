@@ -0,0 +1,149 @@
+// ESP32 Secure Base - heap allocation tracker
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+#include <esp_heap_caps.h>
+
+std::atomic<ESBAllocSite *> ESBAllocSite::_first(NULL);
+
+#ifdef ESB_ALLOC_TRACK
+
+static ESBAllocSite allocOther("other", false);
+ESBAllocSite allocNet("tcpip", false);
+
+// innermost scope of each task, entries are claimed on first use and never released
+struct AllocTask {
+    TaskHandle_t task;
+    ESBAllocSite *site;
+};
+static AllocTask allocTasks[ESB_ALLOC_TASKS];
+static portMUX_TYPE allocMux = portMUX_INITIALIZER_UNLOCKED;
+
+static AllocTask *allocFind(TaskHandle_t task) {
+    for (int i=0; i<ESB_ALLOC_TASKS; i++) {
+        if (allocTasks[i].task == task) return &allocTasks[i];
+    }
+    return NULL;
+}
+
+ESBAllocScope::ESBAllocScope(ESBAllocSite &site) {
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    AllocTask *t = allocFind(task);
+    if (!t) {
+        portENTER_CRITICAL(&allocMux);
+        t = allocFind(NULL);
+        if (t) t->task = task;
+        portEXIT_CRITICAL(&allocMux);
+    }
+    _task = t;
+    _prev = t ? t->site : NULL;
+    if (t) t->site = &site;
+}
+
+ESBAllocScope::~ESBAllocScope() {
+    if (_task) ((AllocTask *)_task)->site = _prev;
+}
+
+static ESBAllocSite *allocSite() {
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    AllocTask *t = task ? allocFind(task) : NULL;
+    return t && t->site ? t->site : &allocOther;
+}
+
+static void allocCount(size_t size) {
+    ESBAllocSite *s = allocSite();
+    portENTER_CRITICAL(&allocMux);
+    s->_allocs++;
+    s->_bytes += size;
+    if (s->_steady && millis() > ESB_ALLOC_WARMUP) {
+        s->_violations++;
+        s->_lastSize = size;
+    }
+    portEXIT_CRITICAL(&allocMux);
+}
+
+static void freeCount(void *ptr) {
+    if (!ptr) return;
+    size_t size = heap_caps_get_allocated_size(ptr);
+    ESBAllocSite *s = allocSite();
+    portENTER_CRITICAL(&allocMux);
+    s->_frees++;
+    s->_freed += size;
+    portEXIT_CRITICAL(&allocMux);
+}
+
+// the hooks, the linker's --wrap turns calls to malloc into calls to __wrap_malloc and makes the
+// original available as __real_malloc
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size) {
+    void *p = __real_malloc(size);
+    if (p) allocCount(size);
+    return p;
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    void *p = __real_calloc(n, size);
+    if (p) allocCount(n*size);
+    return p;
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    freeCount(ptr);
+    void *p = __real_realloc(ptr, size);
+    if (p) allocCount(size);
+    return p;
+}
+
+void __wrap_free(void *ptr) {
+    freeCount(ptr);
+    __real_free(ptr);
+}
+}
+
+void allocLoop() {
+    for (ESBAllocSite *s=ESBAllocSite::_first.load(); s; s=s->_next) {
+        uint32_t v = s->_violations;
+        if (v == s->_reported) continue;
+        ESB_LOGW("ALLOC: %s allocated %u times in steady state, last %u bytes\n", s->_name,
+                v-s->_reported, s->_lastSize);
+        s->_reported = v;
+    }
+}
+
+#else
+
+void allocLoop() {}
+
+#endif
+
+//===== debug command
+
+static void cmdDebugAlloc(ESBArgs &args) {
+#ifdef ESB_ALLOC_TRACK
+    const char *arg = args.str("");
+    if (strcmp(arg, "reset") == 0) {
+        for (ESBAllocSite *s=ESBAllocSite::_first.load(); s; s=s->_next) {
+            s->_allocs = s->_frees = s->_bytes = s->_freed = 0;
+            s->_violations = s->_reported = s->_lastSize = 0;
+        }
+        printf("DEBUG: allocation stats reset\n");
+        return;
+    } else if (*arg != 0) {
+        printf("Usage: debug alloc [reset]\n");
+        return;
+    }
+    printf("== Heap allocations:    allocs    frees    bytes    freed steady violations\n");
+    for (ESBAllocSite *s=ESBAllocSite::_first.load(); s; s=s->_next) {
+        printf("  %-16s %9u %8u %8u %8u %-6s %u\n", s->_name, s->_allocs, s->_frees, s->_bytes,
+                s->_freed, s->_steady ? "yes" : "no", s->_violations);
+    }
+#else
+    printf("DEBUG: allocation tracking not enabled, build with -DESB_ALLOC_TRACK, see alloc.h\n");
+#endif
+}
+ESB_CMD(debug, alloc, cmdDebugAlloc, "[reset]");
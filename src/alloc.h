@@ -0,0 +1,73 @@
+// ESP32 Secure Base - heap allocation tracker
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// The library's steady-state paths (keep-alive, message dispatch, CLI, config save) are meant to
+// run without touching the heap so weeks of uptime don't fragment it. To check, build with
+//   -DESB_ALLOC_TRACK -Wl,--wrap=malloc -Wl,--wrap=calloc -Wl,--wrap=realloc -Wl,--wrap=free
+// which routes all heap calls through a hook that attributes them to the innermost
+// ESB_ALLOC_SCOPE(name, steady) of the calling task, or to "other". Allocations in a steady
+// scope after the first ESB_ALLOC_WARMUP ms are violations and logged by allocLoop, which
+// mqttLoop calls. Calls into the TCP/IP stack are in non-steady scopes because LwIP allocates
+// its packet buffers on the heap. "debug alloc" shows the counts, "debug alloc reset" clears them.
+// Without ESB_ALLOC_TRACK the scopes compile to nothing.
+
+#include <Arduino.h>
+#include <atomic>
+
+#ifndef ESB_ALLOC_WARMUP
+#define ESB_ALLOC_WARMUP 60000 // ms after boot during which lazy allocations are expected
+#endif
+#ifndef ESB_ALLOC_TASKS
+#define ESB_ALLOC_TASKS 16     // max number of tasks with an active scope
+#endif
+
+class ESBAllocSite {
+public:
+    const char   *_name;
+    bool         _steady;   // allocations are violations after warm-up
+    uint32_t     _allocs;
+    uint32_t     _frees;
+    uint32_t     _bytes;    // allocated
+    uint32_t     _freed;    // bytes freed
+    uint32_t     _violations;
+    uint32_t     _lastSize; // size of the last violation
+    uint32_t     _reported; // violations logged so far
+    ESBAllocSite *_next;
+
+    // _first is the list of sites, a site is pushed when its scope first runs, which can happen in
+    // several tasks at once while allocLoop walks the list
+    static std::atomic<ESBAllocSite *> _first;
+
+    ESBAllocSite(const char *name, bool steady)
+      : _name(name), _steady(steady), _allocs(0), _frees(0), _bytes(0), _freed(0)
+      , _violations(0), _lastSize(0), _reported(0)
+    {
+        _next = _first.load();
+        while (!_first.compare_exchange_weak(_next, this)) {}
+    }
+};
+
+class ESBAllocScope {
+public:
+    void         *_task; // entry of the task in the tracker, NULL if the table is full
+    ESBAllocSite *_prev;
+
+    ESBAllocScope(ESBAllocSite &site);
+    ~ESBAllocScope();
+};
+
+// allocNet is the non-steady "tcpip" site for calls into the network stack.
+extern ESBAllocSite allocNet;
+
+#ifdef ESB_ALLOC_TRACK
+#define ESB_ALLOC_SCOPE(name, steady) \
+    static ESBAllocSite esbAllocSite_ ## name(#name, steady); \
+    ESBAllocScope esbAllocScope_ ## name(esbAllocSite_ ## name)
+#define ESB_ALLOC_NET() ESBAllocScope esbAllocNet_(allocNet)
+#else
+#define ESB_ALLOC_SCOPE(name, steady)
+#define ESB_ALLOC_NET()
+#endif
+
+// allocLoop logs new steady-state violations.
+extern void allocLoop();
@@ -0,0 +1,198 @@
+// ESP32 Secure Base - MQTT broker selection
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+
+ESBBroker brokers[ESB_BROKERS];
+int brokerNum = 0;
+int brokerCur = 0;
+// brokerMux guards the table and brokerCur, the MQTT callbacks in the AsyncTCP task and the
+// timers both update them
+static portMUX_TYPE brokerMux = portMUX_INITIALIZER_UNLOCKED;
+
+static AsyncClient brokerProbeClient;
+static volatile bool brokerProbeOk = false; // the preferred broker answered a probe
+static volatile bool brokerProbing = false; // the probe connection is open or being made
+static uint32_t brokerProbeAt;              // when the probe connection was started
+static bool brokerProbeInit = false;
+
+static void brokerProbe(void *);
+ESBTimer brokerProbeTimer(brokerProbe);
+
+// brokerAdd appends host[:port] to the table, it keeps the stats if the entry didn't change.
+static void brokerAdd(const char *spec, int len, uint16_t dfltPort) {
+    if (brokerNum >= ESB_BROKERS) return;
+    ESBBroker &b = brokers[brokerNum++];
+    const char *colon = (const char *)memchr(spec, ':', len);
+    int hlen = colon ? colon-spec : len;
+    if (hlen >= (int)sizeof(b.host)) hlen = sizeof(b.host)-1;
+    uint16_t port = colon ? atoi(colon+1) : dfltPort;
+    if (strncmp(b.host, spec, hlen) == 0 && b.host[hlen] == 0 && b.port == port) return;
+    memcpy(b.host, spec, hlen);
+    b.host[hlen] = 0;
+    b.port = port;
+    b.rtt = 0;
+    b.fails = 0;
+    b.downUntil = 0;
+}
+
+void brokerSetup(ESBConfig &config) {
+    uint16_t port = atoi(config.mqtt_port);
+    if (port == 0) port = 8883;
+    portENTER_CRITICAL(&brokerMux);
+    brokerNum = 0;
+    brokerAdd(config.mqtt_server, strlen(config.mqtt_server), port);
+    for (const char *s = config.mqtt_alt; *s; ) {
+        int len = strcspn(s, " ,");
+        if (len) brokerAdd(s, len, port);
+        s += len;
+        s += strspn(s, " ,");
+    }
+    if (brokerCur >= brokerNum) brokerCur = 0;
+    portEXIT_CRITICAL(&brokerMux);
+}
+
+// brokerBest returns the index of the broker to try next: the one with the lowest latency among
+// those that are not backing off, or the one whose back-off ends first. It must be called with
+// brokerMux held.
+static int brokerBest() {
+    uint32_t now = millis();
+    int best = -1, soonest = 0;
+    uint32_t bestScore = 0;
+    for (int i=0; i<brokerNum; i++) {
+        ESBBroker &b = brokers[i];
+        if (b.fails && (int32_t)(b.downUntil - now) > 0) {
+            if ((int32_t)(b.downUntil - brokers[soonest].downUntil) < 0) soonest = i;
+            continue;
+        }
+        uint32_t score = b.rtt + (i ? ESB_BROKER_BIAS : 0);
+        if (best < 0 || score < bestScore) {
+            best = i;
+            bestScore = score;
+        }
+    }
+    return best >= 0 ? best : soonest;
+}
+
+ESBBroker &brokerPick() {
+    portENTER_CRITICAL(&brokerMux);
+    brokerCur = brokerBest();
+    ESBBroker &b = brokers[brokerCur];
+    portEXIT_CRITICAL(&brokerMux);
+    return b;
+}
+
+void brokerConnected(uint32_t ms) {
+    portENTER_CRITICAL(&brokerMux);
+    int cur = brokerCur;
+    ESBBroker &b = brokers[cur];
+    b.rtt = b.rtt ? (3*b.rtt + ms) / 4 : ms;
+    b.fails = 0;
+    b.downUntil = 0;
+    portEXIT_CRITICAL(&brokerMux);
+    ESB_LOGI("MQTT: connected to %s:%d in %ums\n", b.host, b.port, ms);
+    if (cur != 0) mqTimers->start(brokerProbeTimer, ESB_BROKER_PROBE);
+    else mqTimers->stop(brokerProbeTimer);
+}
+
+void brokerFailed() {
+    portENTER_CRITICAL(&brokerMux);
+    ESBBroker &b = brokers[brokerCur];
+    if (b.fails < 255) b.fails++;
+    int fails = b.fails;
+    uint32_t backoff = ESB_BROKER_BACKOFF << (fails < 8 ? fails-1 : 7);
+    if (backoff > ESB_BROKER_BACKOFF_MAX) backoff = ESB_BROKER_BACKOFF_MAX;
+    b.downUntil = millis() + backoff;
+    portEXIT_CRITICAL(&brokerMux);
+    ESB_LOGW("MQTT: broker %s:%d failed %d times, skipping it for %us\n",
+            b.host, b.port, fails, backoff/1000);
+}
+
+uint32_t brokerRetryMs() {
+    portENTER_CRITICAL(&brokerMux);
+    ESBBroker &b = brokers[brokerBest()];
+    int32_t left = b.downUntil - millis();
+    uint32_t ms = b.fails && left > 0 ? left : 0;
+    portEXIT_CRITICAL(&brokerMux);
+    return ms;
+}
+
+void brokerPrint() {
+    // print a copy, printf can't run with the mux held
+    ESBBroker all[ESB_BROKERS];
+    portENTER_CRITICAL(&brokerMux);
+    int num = brokerNum, cur = brokerCur;
+    memcpy(all, brokers, sizeof(all));
+    portEXIT_CRITICAL(&brokerMux);
+    uint32_t now = millis();
+    for (int i=0; i<num; i++) {
+        ESBBroker &b = all[i];
+        int32_t down = b.downUntil - now;
+        printf("%c %d %s:%d rtt=%ums fails=%d%s", i == cur ? '*' : ' ', i, b.host, b.port,
+                b.rtt, b.fails, i == 0 ? " preferred" : "");
+        if (b.fails && down > 0) printf(" retry in %ds", down/1000);
+        printf("\n");
+    }
+}
+
+//===== probing the preferred broker
+
+// The probe callbacks run in the AsyncTCP task. A probe ends with onProbeDisconnect whether it
+// connected or not, so brokerProbing doesn't stay set, the switch happens in brokerProbe.
+static void onProbeConnect(void *, AsyncClient *cli) {
+    brokerProbeOk = true;
+    cli->close();
+    mqTimers->start(brokerProbeTimer, 0);
+}
+
+static void onProbeError(void *, AsyncClient *cli, int8_t err) {
+    ESB_LOGD("MQTT: probe of the preferred broker failed: %s\n", cli->errorToString(err));
+    brokerProbing = false;
+}
+
+static void onProbeDisconnect(void *, AsyncClient *) {
+    brokerProbing = false;
+}
+
+static void onProbeTimeout(void *, AsyncClient *cli, uint32_t) {
+    cli->close(true);
+}
+
+static void brokerProbe(void *) {
+    portENTER_CRITICAL(&brokerMux);
+    bool alt = brokerCur != 0 && brokerNum > 0;
+    bool back = false;
+    if (alt && brokerProbeOk) {
+        brokerProbeOk = false;
+        brokers[0].fails = 0;
+        brokers[0].downUntil = 0;
+        back = brokerBest() == 0;
+    }
+    portEXIT_CRITICAL(&brokerMux);
+    if (!alt || !mqttClient.connected()) return;
+    ESBBroker &b = brokers[0];
+    if (back) {
+        ESB_LOGI("MQTT: preferred broker %s:%d is back, moving\n", b.host, b.port);
+        mqttConnect();
+        return;
+    }
+    if (!brokerProbeInit) {
+        brokerProbeClient.onConnect(onProbeConnect);
+        brokerProbeClient.onError(onProbeError);
+        brokerProbeClient.onDisconnect(onProbeDisconnect);
+        brokerProbeClient.onTimeout(onProbeTimeout);
+        brokerProbeInit = true;
+    }
+    // a connection attempt that hangs, e.g. SYNs going unanswered, is abandoned
+    if (brokerProbing && millis() - brokerProbeAt > ESB_BROKER_CONNECT) {
+        brokerProbeClient.close(true);
+        brokerProbing = false;
+    }
+    if (!brokerProbing) {
+        ESB_ALLOC_NET();
+        brokerProbeAt = millis();
+        brokerProbing = true;
+        if (!brokerProbeClient.connect(b.host, b.port)) brokerProbing = false;
+    }
+    mqTimers->start(brokerProbeTimer, ESB_BROKER_PROBE);
+}
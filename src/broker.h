@@ -0,0 +1,61 @@
+// ESP32 Secure Base - MQTT broker selection
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// Besides the preferred broker in mqtt_server/mqtt_port the config can list alternates in
+// mqtt_alt ("host[:port] host[:port]..."), all sharing the PSK identity. Each connection attempt
+// picks a broker by its smoothed connect latency, with the alternates handicapped by
+// ESB_BROKER_BIAS ms so the preferred broker wins unless it is clearly slower. An attempt that
+// fails or doesn't complete within ESB_BROKER_CONNECT ms takes the broker out of the rotation
+// for an exponentially growing back-off and the next one is tried right away, so failing over
+// takes seconds. While connected to an alternate, the preferred broker is probed with a plain
+// TCP connection every ESB_BROKER_PROBE ms and the session moves back once it answers.
+// "mqtt brokers" shows the table.
+
+#include <Arduino.h>
+
+#ifndef ESB_BROKERS
+#define ESB_BROKERS 4               // max number of brokers, including the preferred one
+#endif
+#ifndef ESB_BROKER_CONNECT
+#define ESB_BROKER_CONNECT 5000     // ms for a connection attempt, TLS handshake included
+#endif
+#ifndef ESB_BROKER_BIAS
+#define ESB_BROKER_BIAS 200         // ms added to the latency of the alternates
+#endif
+#ifndef ESB_BROKER_BACKOFF
+#define ESB_BROKER_BACKOFF 2000     // ms a broker is skipped after a failure, doubled each time
+#endif
+#ifndef ESB_BROKER_BACKOFF_MAX
+#define ESB_BROKER_BACKOFF_MAX 60000
+#endif
+#ifndef ESB_BROKER_PROBE
+#define ESB_BROKER_PROBE 60000      // ms between probes of the preferred broker
+#endif
+
+struct ESBBroker {
+    char     host[41];
+    uint16_t port;
+    uint32_t rtt;       // smoothed connect latency in ms, 0 if it never connected
+    uint8_t  fails;     // consecutive failed attempts
+    uint32_t downUntil; // millis() before which it isn't tried again
+};
+
+extern ESBBroker brokers[ESB_BROKERS];
+extern int brokerNum; // entries in brokers[], the first is the preferred broker
+extern int brokerCur; // broker of the current or last connection attempt
+
+struct ESBConfig;
+// brokerSetup (re)builds the table from the config, keeping the stats of unchanged entries.
+extern void brokerSetup(ESBConfig &config);
+// brokerPick chooses the broker for the next connection attempt.
+extern ESBBroker &brokerPick();
+// brokerConnected records a successful attempt that took ms, brokerFailed a failed one.
+extern void brokerConnected(uint32_t ms);
+extern void brokerFailed();
+// brokerRetryMs returns how long until a broker is available for the next attempt.
+extern uint32_t brokerRetryMs();
+// brokerPrint prints the table.
+extern void brokerPrint();
+
+// brokerProbeTimer probes the preferred broker while connected to an alternate.
+extern ESBTimer brokerProbeTimer;
@@ -0,0 +1,91 @@
+// ESP32 Secure Base - bulk MQTT session
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+
+AsyncMqttClient mqttBulkClient;
+static bool bulkOn = false;
+static bool bulkInit = false;
+static char bulkClientId[48];
+
+static void bulkRetry(void *);
+ESBTimer bulkRetryTimer(bulkRetry);
+
+bool mqttBulk() { return bulkOn; }
+
+static void onBulkConnect(bool sessionPresent) {
+    ESB_NET_LOCK();
+    ESB_LOGI("Connected to MQTT bulk session\n");
+    mqTimers->stop(bulkRetryTimer);
+}
+
+static void onBulkDisconnect(AsyncMqttClientDisconnectReason reason) {
+    ESB_NET_LOCK();
+    if (!bulkOn) return;
+    ESB_LOGW("Disconnected from MQTT bulk session: %d\n", (int)reason);
+    if (!bulkRetryTimer.active()) mqTimers->start(bulkRetryTimer, ESB_BULK_RETRY);
+}
+
+static void bulkRetry(void *) {
+    if (!bulkOn || mqttBulkClient.connected()) return;
+    // the control session comes first, its connect brings up the bulk session
+    if (mqttClient.connected()) bulkConnect();
+    mqTimers->start(bulkRetryTimer, ESB_BULK_RETRY);
+}
+
+void bulkConfigure(ESBConfig &config) {
+    if (!bulkOn) return;
+    // same broker as the control session
+    mqttBulkClient.setServer(brokers[brokerCur].host, brokers[brokerCur].port);
+    mqttBulkClient.setSecure(true);
+    mqttBulkClient.setPsk(config.mqtt_ident, config.mqtt_psk);
+    snprintf(bulkClientId, sizeof(bulkClientId), "%s-bulk", mqttClient.getClientId());
+    mqttBulkClient.setClientId(bulkClientId);
+}
+
+void bulkConnect() {
+    if (!bulkOn || mqttBulkClient.connected()) return;
+    if (netRemote()) {
+        netPost(NET_BULK, 1, NULL, 0);
+        return;
+    }
+    ESB_ALLOC_SCOPE(mqttConnect, false);
+    if (!bulkInit) {
+        mqttBulkClient.onConnect(onBulkConnect);
+        mqttBulkClient.onDisconnect(onBulkDisconnect);
+        bulkInit = true;
+    }
+    mqttBulkClient.connect();
+}
+
+void bulkDisconnect() {
+    if (netRemote()) {
+        netPost(NET_BULK, 0, NULL, 0);
+        return;
+    }
+    if (mqttBulkClient.connected()) mqttBulkClient.disconnect();
+}
+
+void mqttEnableBulk(bool enable) {
+    if (enable == bulkOn) return;
+    bulkOn = enable;
+    if (!enable) {
+        mqTimers->stop(bulkRetryTimer);
+        bulkDisconnect();
+    } else if (mqttClient.connected()) {
+        mqttConnect(); // reconnect both with the bulk session configured
+    }
+}
+
+bool bulkPublish(const char *topic, uint8_t qos, bool retain, const char *payload, size_t len) {
+    if (!mqttBulkClient.connected()) return false;
+    if (netRemote()) {
+        return netPost(NET_PUBLISH, qos | retain<<2 | NET_PUB_BULK, topic, strlen(topic),
+                payload, len);
+    }
+    ESB_ALLOC_NET();
+    const char *packed = zipPack(payload, len);
+    bool ok = mqttBulkClient.publish(topic, qos, retain, packed, len) != 0;
+    zipDone(packed);
+    return ok;
+}
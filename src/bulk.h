@@ -0,0 +1,39 @@
+// ESP32 Secure Base - bulk MQTT session
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// All MQTT traffic normally shares mqttClient, so a burst of telemetry queues the keep-alive
+// pings, CLI commands, and OTA triggers behind it in the same TLS stream, and a slow ping
+// response causes a needless reconnect. mqttEnableBulk(true) opens a second session to the same
+// broker with the same PSK identity, and messages on bulk topics (registered with
+// mqttTopic(suffix, true): log, trace, metrics, latency) are published on it while everything
+// else stays on the control session. The bulk session is connected whenever the control session
+// is, it has its own client id (<control id>-bulk) and doesn't subscribe to anything. Bulk
+// messages are not retransmitted by the in-flight window (flight.h), telemetry is QoS 0.
+// While the bulk session is down its messages are dropped rather than moved to the control
+// session.
+
+#include <Arduino.h>
+
+#ifndef ESB_BULK_RETRY
+#define ESB_BULK_RETRY 10000 // ms between connection attempts of the bulk session
+#endif
+
+extern AsyncMqttClient mqttBulkClient;
+
+// mqttEnableBulk enables or disables the bulk session, call it before or after mqttSetup.
+extern void mqttEnableBulk(bool enable);
+// mqttBulk returns true if bulk topics go to the bulk session.
+extern bool mqttBulk();
+
+// bulkPublish publishes on the bulk session, returns false if it's not connected.
+extern bool bulkPublish(const char *topic, uint8_t qos, bool retain,
+        const char *payload, size_t len);
+// bulkConfigure sets the server and credentials from the config, called by mqttConfigure.
+extern void bulkConfigure(ESBConfig &config);
+// bulkConnect connects the bulk session if it's enabled and not connected, bulkDisconnect
+// disconnects it.
+extern void bulkConnect();
+extern void bulkDisconnect();
+
+// bulkRetryTimer reconnects the bulk session on the MQTT timer wheel.
+extern ESBTimer bulkRetryTimer;
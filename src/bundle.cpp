@@ -0,0 +1,284 @@
+// ESP32 Secure Base - OTA bundles
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+#include <Update.h>
+#include <MD5Builder.h>
+#include <SPIFFS.h>
+#include <esp_partition.h>
+
+#define SECTOR 4096
+#define SUBTYPE_SPIFFS 0x82
+
+static uint8_t hdrBuf[sizeof(ESBBundleHdr) + ESB_BUNDLE_SEGS*sizeof(ESBBundleSeg)];
+static size_t hdrLen;               // bytes of the header received
+static ESBBundleHdr *hdr = (ESBBundleHdr *)hdrBuf;
+static ESBBundleSeg *segs = (ESBBundleSeg *)(hdrBuf + sizeof(ESBBundleHdr));
+
+static size_t bundleLen;            // total length of the bundle
+static char bundleMd5[33];          // expected MD5 of the whole bundle
+static MD5Builder bundleHash;       // of the whole bundle
+static MD5Builder segHash;          // of the current segment
+static int seg;                     // current segment, -1 while receiving the header
+static uint32_t segOff;             // bytes of the current segment written
+static const esp_partition_t *part; // partition of the current data segment
+static bool running = false;
+static bool done = false;
+static bool spiffsDown = false;     // SPIFFS unmounted while it's being written
+
+//===== SPIFFS
+
+static void spiffsUnmount() {
+    if (spiffsDown) return;
+    spiffsDown = true;
+    SPIFFS.end();
+    ESB_LOGI("BUNDLE: SPIFFS unmounted\n");
+}
+
+// spiffsRemount mounts SPIFFS again, formatting it if what was written isn't a usable image,
+// and saves the in-memory config if the image doesn't have one.
+static void spiffsRemount() {
+    if (!spiffsDown) return;
+    spiffsDown = false;
+    if (!SPIFFS.begin(false)) {
+        ESB_LOGW("BUNDLE: cannot mount SPIFFS, formatting it, takes ~20 seconds\n");
+        if (!SPIFFS.begin(true)) {
+            ESB_LOGE("BUNDLE: SPIFFS formatting failed\n");
+            return;
+        }
+    }
+    ESBConfig *c = mqttConfig();
+    if (c && c->initialized && !SPIFFS.exists("/config.json")) c->save();
+}
+
+// remountTimer remounts SPIFFS from the loop task once the data segment or the whole update
+// ended, mounting may format it, which takes too long to do in the network callbacks.
+static void bundleRemount(void *) { spiffsRemount(); }
+static ESBTimer remountTimer(bundleRemount);
+
+//===== segments
+
+// md5Add feeds data to h, MD5Builder takes at most 64KB at a time.
+static void md5Add(MD5Builder &h, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        uint16_t n = len > 0xffff ? 0xffff : len;
+        h.add((uint8_t *)data, n);
+        data += n;
+        len -= n;
+    }
+}
+
+static void toHex(const uint8_t *md5, char *hex) {
+    for (int i=0; i<16; i++) sprintf(hex+2*i, "%02x", md5[i]);
+}
+
+// checkHeader validates the segment table and finds the partitions, it's done before anything
+// is written so a bundle that doesn't fit the partition table changes nothing. The app must come
+// first so a download that's damaged in the app fails before any data partition is touched.
+static bool checkHeader() {
+    size_t total = hdr->hdrSize;
+    for (int i=0; i<hdr->count; i++) {
+        ESBBundleSeg &s = segs[i];
+        s.label[sizeof(s.label)-1] = 0;
+        total += s.size;
+        if (s.size == 0) {
+            ESB_LOGE("BUNDLE: segment %d is empty\n", i);
+            return false;
+        }
+        if (s.type == ESB_BUNDLE_APP) {
+            if (i != 0) {
+                ESB_LOGE("BUNDLE: the app segment must be the first one\n");
+                return false;
+            }
+            continue;
+        }
+        // only SPIFFS, FAT, and custom partitions, not the ones that keep the device booting nor
+        // the factory provisioning
+        if (s.type != ESB_BUNDLE_DATA || s.subtype < 0x40 || s.subtype == ESB_PROV_SUBTYPE) {
+            ESB_LOGE("BUNDLE: segment %d: partition type %d/%d not supported\n", i, s.type,
+                    s.subtype);
+            return false;
+        }
+        const esp_partition_t *p = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                (esp_partition_subtype_t)s.subtype, s.label[0] ? s.label : NULL);
+        if (!p || p->size < s.size) {
+            ESB_LOGE("BUNDLE: segment %d: no data partition %s/0x%02x for %u bytes\n", i,
+                    s.label, s.subtype, s.size);
+            return false;
+        }
+    }
+    if (total != bundleLen) {
+        ESB_LOGE("BUNDLE: segments add up to %u bytes, expected %u\n", total, bundleLen);
+        return false;
+    }
+    return true;
+}
+
+static bool segStart() {
+    ESBBundleSeg &s = segs[seg];
+    segOff = 0;
+    ESB_LOGI("BUNDLE: segment %d: %u bytes to %s\n", seg, s.size,
+            s.type == ESB_BUNDLE_APP ? "app" : s.label);
+    if (s.type == ESB_BUNDLE_APP) {
+        if (Update.isRunning()) Update.abort();
+        if (!Update.begin(s.size)) {
+            ESB_LOGE("BUNDLE: not enough space for the app\n");
+            return false;
+        }
+        char hex[33];
+        toHex(s.md5, hex);
+        Update.setMD5(hex);
+    } else {
+        part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                (esp_partition_subtype_t)s.subtype, s.label[0] ? s.label : NULL);
+        if (s.subtype == SUBTYPE_SPIFFS) spiffsUnmount();
+    }
+    segHash.begin();
+    return true;
+}
+
+static bool segWrite(const uint8_t *data, size_t len) {
+    ESBBundleSeg &s = segs[seg];
+    md5Add(segHash, data, len);
+    if (s.type == ESB_BUNDLE_APP) {
+        if (Update.write((uint8_t *)data, len) != len) {
+            ESB_LOGE("BUNDLE: app write failed, error %d\n", Update.getError());
+            return false;
+        }
+        segOff += len;
+        return true;
+    }
+    while (len > 0) {
+        // erase each sector as it's reached so no single call blocks for long
+        if (segOff % SECTOR == 0 && esp_partition_erase_range(part, segOff, SECTOR) != ESP_OK) {
+            ESB_LOGE("BUNDLE: erasing %s at 0x%x failed\n", s.label, segOff);
+            return false;
+        }
+        size_t n = SECTOR - segOff % SECTOR;
+        if (n > len) n = len;
+        if (esp_partition_write(part, segOff, data, n) != ESP_OK) {
+            ESB_LOGE("BUNDLE: writing %s at 0x%x failed\n", s.label, segOff);
+            return false;
+        }
+        segOff += n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool segEnd() {
+    ESBBundleSeg &s = segs[seg];
+    uint8_t md5[16];
+    segHash.calculate();
+    segHash.getBytes(md5);
+    if (memcmp(md5, s.md5, sizeof(md5)) != 0) {
+        if (s.type == ESB_BUNDLE_APP) ESB_LOGE("BUNDLE: MD5 mismatch in the app\n");
+        else ESB_LOGE("BUNDLE: MD5 mismatch in segment %d, %s is damaged\n", seg, s.label);
+        return false;
+    }
+    // the app is set to boot once everything else has been written, see bundleFinish
+    if (s.type != ESB_BUNDLE_APP && s.subtype == SUBTYPE_SPIFFS) esbTimers.start(remountTimer, 0);
+    return true;
+}
+
+// bundleFinish checks the whole bundle and sets the new app, if any, to boot.
+static bool bundleFinish() {
+    bundleHash.calculate();
+    char hex[33];
+    bundleHash.getChars(hex);
+    if (strcasecmp(hex, bundleMd5) != 0) {
+        ESB_LOGE("BUNDLE: MD5 mismatch, got %s expected %s\n", hex, bundleMd5);
+        return false;
+    }
+    if (segs[0].type == ESB_BUNDLE_APP && !Update.end()) {
+        ESB_LOGE("BUNDLE: app update failed, error %d\n", Update.getError());
+        return false;
+    }
+    return true;
+}
+
+//===== stream
+
+void bundleBegin(size_t len, const char *md5) {
+    if (Update.isRunning()) Update.abort();
+    esbTimers.stop(remountTimer); // SPIFFS stays unmounted until this attempt ends
+    bundleLen = len;
+    strncpy(bundleMd5, md5, 32);
+    bundleMd5[32] = 0;
+    bundleHash.begin();
+    hdrLen = 0;
+    seg = -1;
+    running = true;
+    done = false;
+}
+
+// bundleHeader accumulates the header, it returns the number of bytes consumed or -1.
+static int bundleHeader(const uint8_t *data, size_t len) {
+    size_t need = hdrLen < sizeof(ESBBundleHdr) ? sizeof(ESBBundleHdr) : hdr->hdrSize;
+    size_t n = need - hdrLen;
+    if (n > len) n = len;
+    memcpy(hdrBuf+hdrLen, data, n);
+    hdrLen += n;
+    if (hdrLen == sizeof(ESBBundleHdr)) {
+        if (hdr->magic != ESB_BUNDLE_MAGIC || hdr->version != ESB_BUNDLE_VERSION ||
+                hdr->count < 1 || hdr->count > ESB_BUNDLE_SEGS ||
+                hdr->hdrSize != sizeof(ESBBundleHdr) + hdr->count*sizeof(ESBBundleSeg)) {
+            ESB_LOGE("BUNDLE: bad header (version %d, %d segments)\n", hdr->version,
+                    hdr->count);
+            return -1;
+        }
+    } else if (hdrLen == hdr->hdrSize) {
+        if (!checkHeader()) return -1;
+        seg = 0;
+        if (!segStart()) return -1;
+    }
+    return n;
+}
+
+// bundleStep processes the next piece of the bundle, it returns false on error.
+static bool bundleStep(const uint8_t *data, size_t len) {
+    while (len > 0) {
+        if (seg < 0) {
+            int n = bundleHeader(data, len);
+            if (n < 0) return false;
+            data += n;
+            len -= n;
+            continue;
+        }
+        size_t n = segs[seg].size - segOff;
+        if (n > len) n = len;
+        if (!segWrite(data, n)) return false;
+        data += n;
+        len -= n;
+        if (segOff < segs[seg].size) continue;
+        if (!segEnd()) return false;
+        if (seg == hdr->count-1) {
+            if (!bundleFinish()) return false;
+            running = false;
+            done = true;
+            if (spiffsDown) esbTimers.start(remountTimer, 0); // bundleBegin may have stopped it
+            return true;
+        }
+        seg++;
+        if (!segStart()) return false;
+    }
+    return true;
+}
+
+bool bundleWrite(const uint8_t *data, size_t len) {
+    if (!running) return false;
+    md5Add(bundleHash, data, len);
+    if (bundleStep(data, len)) return true;
+    bundleAbort();
+    return false;
+}
+
+bool bundleDone() { return done; }
+
+void bundleAbort() {
+    if (!running) return;
+    running = false;
+    if (Update.isRunning()) Update.abort();
+    if (spiffsDown) esbTimers.start(remountTimer, 0);
+}
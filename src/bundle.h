@@ -0,0 +1,61 @@
+// ESP32 Secure Base - OTA bundles
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// A bundle updates the firmware and data partitions, e.g. the SPIFFS image with the portal
+// assets, in one download and one reboot. ESBOTA recognizes it by its first byte (plain app
+// images start with 0xE9) and streams it through bundleWrite, which routes each segment to its
+// partition as the bytes arrive, nothing is buffered beyond the header.
+// Format, little-endian: an ESBBundleHdr, count ESBBundleSeg entries, then the segments' data
+// back to back in the same order. An app segment, which must be the first one, goes through
+// Update into the next OTA partition and its MD5 is checked before any data partition is
+// touched, so a download that's damaged or cut off in the app changes nothing. Data segments go
+// to the data partition with the given subtype and label (any label if empty), each sector is
+// erased just before it's written, and the segment's MD5 is checked at its end. The MD5 in the
+// OTA message covers the whole bundle and is checked last, only then is the new app set to boot.
+// Data partitions are written in place: if a data segment fails, that partition is damaged until
+// the next successful update while the running firmware carries on, and the new app doesn't
+// boot. SPIFFS is unmounted while it's being written. Afterwards it's mounted again, formatted
+// if it doesn't hold a usable image, and the in-memory config is saved if config.json is missing.
+// The factory provisioning partition (see prov.h) can't be written by a bundle.
+// tools/mkbundle.py builds bundles.
+
+#include <Arduino.h>
+
+#define ESB_BUNDLE_MAGIC   0x42425345 // "ESBB"
+#define ESB_BUNDLE_VERSION 1
+#ifndef ESB_BUNDLE_SEGS
+#define ESB_BUNDLE_SEGS 4             // max number of segments
+#endif
+
+#define ESB_BUNDLE_APP  0 // segment types, same as esp_partition_type_t
+#define ESB_BUNDLE_DATA 1
+
+struct ESBBundleHdr {
+    uint32_t magic;
+    uint8_t  version;
+    uint8_t  count;   // number of segments
+    uint16_t hdrSize; // sizeof(ESBBundleHdr) + count*sizeof(ESBBundleSeg)
+};
+
+struct ESBBundleSeg {
+    char     label[16]; // partition label, NUL-padded, may be empty
+    uint8_t  type;      // ESB_BUNDLE_APP or ESB_BUNDLE_DATA
+    uint8_t  subtype;   // partition subtype for data segments
+    uint16_t flags;     // reserved, 0
+    uint32_t size;
+    uint8_t  md5[16];
+};
+
+// bundleIs returns true if an OTA download starting with byte b is a bundle.
+static inline bool bundleIs(uint8_t b) { return b == (ESB_BUNDLE_MAGIC & 0xff); }
+// bundleBegin starts an update from a bundle of len bytes, md5 is the 32 hex digit MD5 of the
+// whole bundle.
+extern void bundleBegin(size_t len, const char *md5);
+// bundleWrite processes the next piece of the bundle, it returns false and aborts the update if
+// something is wrong.
+extern bool bundleWrite(const uint8_t *data, size_t len);
+// bundleDone returns true once all segments have been written and verified and the new app, if
+// any, has been set to boot.
+extern bool bundleDone();
+// bundleAbort abandons the update in progress.
+extern void bundleAbort();
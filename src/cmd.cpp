@@ -0,0 +1,165 @@
+// ESP32 Secure Base - command registry
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+
+// The table is zero-initialized before any constructor runs, so registration from static
+// constructors in other compilation units is safe regardless of their order.
+const ESBCmdDef *ESBCmd::_table[ESB_CMD_SLOTS];
+uint8_t ESBCmd::_dropped = 0;
+
+//===== Arguments
+
+ESBArgs::ESBArgs(char *line)
+    : cmd(NULL)
+    , sub(NULL)
+    , _rest(line)
+    , _pending(NULL)
+{
+    cmd = next();
+    sub = next();
+}
+
+char *ESBArgs::next() {
+    if (_pending) {
+        char *p = _pending;
+        _pending = NULL;
+        return p;
+    }
+    if (!_rest) return NULL;
+    // skip leading white space
+    while (*_rest == ' ' || *_rest == '\t' || *_rest == '\r' || *_rest == '\n') _rest++;
+    if (*_rest == 0) return NULL;
+    // find end of word or of quoted string
+    char *arg = _rest;
+    if (*arg == '"') {
+        arg = ++_rest;
+        while (*_rest && *_rest != '"') _rest++;
+    } else {
+        while (*_rest && *_rest != ' ' && *_rest != '\t' && *_rest != '\r' && *_rest != '\n')
+            _rest++;
+    }
+    if (*_rest) *_rest++ = 0;
+    return arg;
+}
+
+bool ESBArgs::u32(uint32_t &v, bool optional) {
+    const char *a = next();
+    if (!a || *a == 0) return optional;
+    char *end;
+    uint32_t val = strtoul(a, &end, 0);
+    if (*end != 0) return false;
+    v = val;
+    return true;
+}
+
+bool ESBArgs::i32(int32_t &v, bool optional) {
+    const char *a = next();
+    if (!a || *a == 0) return optional;
+    char *end;
+    int32_t val = strtol(a, &end, 0);
+    if (*end != 0) return false;
+    v = val;
+    return true;
+}
+
+//===== Command table
+
+ESBCmd::ESBCmd(const ESBCmdDef *def) {
+    // linear probing, the table is sized such that it never fills up in practice
+    uint32_t ix = def->key;
+    for (int i=0; i<ESB_CMD_SLOTS; i++, ix++) {
+        if (_table[ix & (ESB_CMD_SLOTS-1)] == NULL) {
+            _table[ix & (ESB_CMD_SLOTS-1)] = def;
+            return;
+        }
+    }
+    _dropped++; // can't print anything here: runs before setup()
+}
+
+const ESBCmdDef *ESBCmd::find(const char *cmd, const char *sub) {
+    uint32_t key = esbCmdKey(cmd, sub);
+    uint32_t ix = key;
+    for (int i=0; i<ESB_CMD_SLOTS; i++, ix++) {
+        const ESBCmdDef *def = _table[ix & (ESB_CMD_SLOTS-1)];
+        if (def == NULL) return NULL;
+        if (def->key == key && strcmp(def->cmd, cmd) == 0 && strcmp(def->sub, sub) == 0) {
+            return def;
+        }
+    }
+    return NULL;
+}
+
+void ESBCmd::help(const char *cmd) {
+    if (_dropped) printf("Error: %d commands did not fit into the table\n", _dropped);
+    if (!cmd) {
+        // list each command once, that is, skip any that appear again later in the table
+        printf("Available commands are:");
+        for (int i=0; i<ESB_CMD_SLOTS; i++) {
+            const ESBCmdDef *def = _table[i];
+            if (!def) continue;
+            bool dup = false;
+            for (int j=i+1; j<ESB_CMD_SLOTS && !dup; j++) {
+                dup = _table[j] && strcmp(_table[j]->cmd, def->cmd) == 0;
+            }
+            if (!dup) printf(" %s", def->cmd);
+        }
+        printf("\n");
+        return;
+    }
+    printf("Available %s sub-commands are:\n", cmd);
+    for (int i=0; i<ESB_CMD_SLOTS; i++) {
+        const ESBCmdDef *def = _table[i];
+        if (def && strcmp(def->cmd, cmd) == 0) {
+            printf("  %s%s%s %s\n", def->cmd, def->sub[0] ? " " : "", def->sub, def->usage);
+        }
+    }
+}
+
+void ESBCmd::dispatch(ESBArgs &args) {
+    if (!args.cmd) {
+        help(NULL);
+        return;
+    }
+    const char *sub = args.sub ? args.sub : "";
+    const ESBCmdDef *def = find(args.cmd, sub);
+    if (def) {
+        def->fn(args);
+        return;
+    }
+    // try the default handler, it gets the sub-command as first argument
+    def = args.sub && strcmp(args.sub, "help") == 0 ? NULL : find(args.cmd, "");
+    if (def) {
+        args._pending = (char *)args.sub;
+        args.sub = NULL;
+        def->fn(args);
+        return;
+    }
+    if (!args.sub || strcmp(args.sub, "help") != 0) {
+        // check whether the command exists at all
+        bool known = false;
+        for (int i=0; i<ESB_CMD_SLOTS && !known; i++) {
+            known = _table[i] && strcmp(_table[i]->cmd, args.cmd) == 0;
+        }
+        if (!known) {
+            printf("Error: unknown command '%s'\n", args.cmd);
+            help(NULL);
+            return;
+        }
+        if (args.sub) printf("Error: unknown %s sub-command '%s'\n", args.cmd, args.sub);
+    }
+    help(args.cmd);
+}
+
+void ESBCmd::exec(char *line) {
+    ESB_LATENCY(command, 10000);
+    ESB_ALLOC_SCOPE(command, true);
+    ESBArgs args(line);
+    if (!args.cmd) return; // empty line
+    dispatch(args);
+}
+
+static void cmdHelp(ESBArgs &args) {
+    ESBCmd::help(args.next());
+}
+ESB_CMD(help, , cmdHelp, "[<command>]");
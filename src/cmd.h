@@ -0,0 +1,88 @@
+// ESP32 Secure Base - command registry
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// Commands are registered statically using ESB_CMD(cmd, sub, fn, usage), similar to how DV()
+// registers variables. The descriptors are constant-initialized and end up in flash, the key is
+// a hash of "cmd sub" computed at compile time, and registration just drops a pointer into a
+// fixed-size open-addressed table, so there is no heap allocation and dispatch is a single hash
+// and (almost always) a single probe.
+
+#include <Arduino.h>
+
+// number of slots in the command table, must be a power of two and should be at least twice
+// the number of registered commands
+#ifndef ESB_CMD_SLOTS
+#define ESB_CMD_SLOTS 64
+#endif
+
+// esbHash is a 32-bit FNV-1a hash usable at compile time, h allows hashes to be chained.
+constexpr uint32_t esbHash(const char *s, uint32_t h = 2166136261u) {
+    return *s ? esbHash(s+1, (h ^ (uint8_t)*s) * 16777619u) : h;
+}
+
+// esbCmdKey hashes "cmd sub", sub is the empty string for a command's default handler.
+constexpr uint32_t esbCmdKey(const char *cmd, const char *sub) {
+    return esbHash(sub, esbHash(" ", esbHash(cmd)));
+}
+
+// ESBArgs hands the arguments of a command to its handler, it tokenizes the command line
+// in-place.
+class ESBArgs {
+public:
+    const char *cmd; // command name
+    const char *sub; // sub-command name or NULL
+
+    ESBArgs(char *line);
+
+    // next returns the next raw argument or NULL, double quotes can be used to group words
+    // into one argument.
+    char *next();
+    // str returns the next argument or dflt if there is none.
+    const char *str(const char *dflt = NULL) { const char *a = next(); return a ? a : dflt; }
+    // i32/u32 parse the next argument as decimal or 0x-prefixed hex number, they return false
+    // if the argument is malformed or if it is missing and not optional, v is only changed if
+    // a number was parsed.
+    bool i32(int32_t &v, bool optional = false);
+    bool u32(uint32_t &v, bool optional = false);
+
+//private:
+    char *_rest;     // rest of the line still to be tokenized
+    char *_pending;  // argument pushed back by the dispatcher, returned by next() first
+};
+
+typedef void (*ESBCmdFn)(ESBArgs &args);
+
+// ESBCmdDef describes a command, it is a plain aggregate so it can be constant-initialized.
+struct ESBCmdDef {
+    const char *cmd;
+    const char *sub;   // "" for the command's default handler, which gets the sub-command as arg
+    uint32_t   key;    // esbCmdKey(cmd, sub)
+    ESBCmdFn   fn;
+    const char *usage; // argument summary for help
+};
+
+// ESBCmd registers a command definition in the table.
+class ESBCmd {
+public:
+    ESBCmd(const ESBCmdDef *def);
+
+    // find looks up the handler for cmd+sub, sub may be "".
+    static const ESBCmdDef *find(const char *cmd, const char *sub);
+    // exec tokenizes and runs a command line (the line is modified).
+    static void exec(char *line);
+    // dispatch runs a command whose name and sub-command have been pulled out of args.
+    static void dispatch(ESBArgs &args);
+    // help prints the sub-commands of cmd or, if cmd is NULL, the list of commands.
+    static void help(const char *cmd);
+
+//private:
+    static const ESBCmdDef *_table[ESB_CMD_SLOTS];
+    static uint8_t _dropped; // number of commands that didn't fit into the table
+};
+
+// ESB_CMD registers handler fn for "cmd sub", leave sub empty to register the default handler.
+// For example: ESB_CMD(wifi, connect, cmdWifiConnect, "<ssid> [<pass>]");
+#define ESB_CMD(cmd, sub, fn, usage) \
+    static const ESBCmdDef esbCmdDef_ ## cmd ## _ ## sub = \
+        { #cmd, #sub, esbCmdKey(#cmd, #sub), fn, usage }; \
+    static ESBCmd esbCmdReg_ ## cmd ## _ ## sub(&esbCmdDef_ ## cmd ## _ ## sub)
@@ -12,17 +12,43 @@
 #include <WiFi.h>
 #include "ESPSecureBase.h"
 #include <ArduinoJson.h>
+#include "portal_html.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+#define CONFIG_JSON 768 // StaticJsonDocument capacity for the config
+
+static SemaphoreHandle_t configMutex = NULL; // see ESBConfigLock
+
+ESBConfigLock::ESBConfigLock() {
+    if (configMutex) xSemaphoreTakeRecursive(configMutex, portMAX_DELAY);
+}
+
+ESBConfigLock::~ESBConfigLock() {
+    if (configMutex) xSemaphoreGiveRecursive(configMutex);
+}
+
+// esbAPName returns "ESP-<chip-id>", it's built once because getESP32ChipID returns a String.
+static const char *esbAPName() {
+    static char name[24];
+    if (name[0] == 0) {
+        extern String getESP32ChipID();
+        snprintf(name, sizeof(name), "ESP-%s", getESP32ChipID().c_str());
+    }
+    return name;
+}
 
 // read reads the configuration from SPIFFS (flash filesystem).
 void ESBConfig::read() {
+    if (!configMutex) configMutex = xSemaphoreCreateRecursiveMutex();
     // mount SPIFFS, this does nothing if it's already mounted.
     if (!SPIFFS.begin(false)) {
         uint32_t t0 = millis();
-        Serial.println("** Formatting fresh SPIFFS, takes ~20 seconds");
+        ESB_LOGW("** Formatting fresh SPIFFS, takes ~20 seconds");
         if (!SPIFFS.begin(true)) {
-            Serial.println("SPIFFS formatting failed, check your hardware, OOPS!");
+            ESB_LOGE("SPIFFS formatting failed, check your hardware, OOPS!");
         } else {
-            printf("Format took %lus\n", (millis()-t0+500)/1000);
+            ESB_LOGI("Format took %lus\n", (millis()-t0+500)/1000);
         }
     }
 
@@ -30,12 +56,12 @@ void ESBConfig::read() {
     if (configFile && configFile.size() > 10) {
         // load as json
         size_t size = configFile.size();
-        printf("config file size is %d\n", size);
-        DynamicJsonDocument json(2*size);
+        ESB_LOGI("config file size is %d\n", size);
+        StaticJsonDocument<CONFIG_JSON> json;
         DeserializationError err = deserializeJson(json, configFile);
         configFile.close();
         if (err) {
-            printf("failed to parse config.json: %s\n", err.c_str());
+            ESB_LOGE("failed to parse config.json: %s\n", err.c_str());
 #if 1
             File cf = SPIFFS.open("/config.json", FILE_READ);
             printf("Contents (%d): <<", cf.size());
@@ -53,6 +79,11 @@ void ESBConfig::read() {
         strncpy(mqtt_port, json["mqtt_port"] |"", sizeof(mqtt_port));
         strncpy(mqtt_ident, json["mqtt_ident"] |"", sizeof(mqtt_ident));
         strncpy(mqtt_psk, json["mqtt_psk"] |"", sizeof(mqtt_psk));
+        strncpy(mqtt_alt, json["mqtt_alt"] |"", sizeof(mqtt_alt)-1);
+        strncpy(push_hash, json["push_hash"] |"", sizeof(push_hash)-1);
+        strncpy(fleet_hash, json["fleet_hash"] |"", sizeof(fleet_hash)-1);
+        push_version = json["push_version"] |0UL;
+        fleet_version = json["fleet_version"] |0UL;
 
 #if 0
         strcpy(mqtt_server, "192.168.0.14");
@@ -61,50 +92,83 @@ void ESBConfig::read() {
 #endif
 
         char psk[5]; strncpy(psk, mqtt_psk, 4); psk[4] = 0;
-        printf("Config restored: MQTT<%s,%s;%s,%s...> AP<%s>\n",
+        ESB_LOGI("Config restored: MQTT<%s,%s;%s,%s...> AP<%s>\n",
                 mqtt_server, mqtt_port, mqtt_ident, psk, ap_pass);
 
+    } else if (provGet()) {
+        if (configFile) configFile.close();
+        ESB_LOGI("No config file, using provisioned mqtt ident/psk\n");
     } else {
     if (configFile) configFile.close();
-        Serial.println("No config file, initializing mqtt ident/psk");
+        ESB_LOGI("No config file, initializing mqtt ident/psk");
 
         // Construct default MQTT client id using chip MAC
-        extern String getESP32ChipID();
-        strcpy(mqtt_ident, "ESP-");
-        strcat(mqtt_ident, getESP32ChipID().c_str());
+        strcpy(mqtt_ident, esbAPName());
 
         // Construct default random MQTT psk.
         char psk[16];
         esp_fill_random(psk, 16);
         for (int i=0; i<16; i++) sprintf(mqtt_psk+2*i, "%02x", psk[i]);
-        printf("MQTT ident=%s psk=%s\n", mqtt_ident, mqtt_psk);
+        ESB_LOGI("MQTT ident=%s psk=%s\n", mqtt_ident, mqtt_psk);
     }
+    readProv();
     initialized = true;
 }
 
-// save checks whether something has changed and if so saves the config to SPIFFS.
+// readProv applies the provisioning blob, see prov.h: its ident and psk override the config, its
+// brokers only fill in what the config doesn't have so changes made later stick.
+void ESBConfig::readProv() {
+    const ESBProv *p = provGet();
+    if (!p) return;
+    if (p->mqtt_ident[0]) strncpy(mqtt_ident, p->mqtt_ident, sizeof(mqtt_ident)-1);
+    if (p->mqtt_psk[0]) strncpy(mqtt_psk, p->mqtt_psk, sizeof(mqtt_psk)-1);
+    if (!mqtt_server[0]) strncpy(mqtt_server, p->mqtt_server, sizeof(mqtt_server)-1);
+    if (!mqtt_port[0]) strncpy(mqtt_port, p->mqtt_port, sizeof(mqtt_port)-1);
+    if (!mqtt_alt[0]) strncpy(mqtt_alt, p->mqtt_alt, sizeof(mqtt_alt)-1);
+}
+
+PROF_DEF(configSave);
+
+// save checks whether something has changed and if so saves the config to SPIFFS. It goes
+// through the VFS file descriptor API and a static JSON document so it doesn't allocate.
 void ESBConfig::save() {
+    ESB_CONFIG_LOCK();
+    PROF(configSave);
+    ESB_LATENCY(configSave, 10000);
+    ESB_ALLOC_SCOPE(configSave, true);
 
     char psk[5]; strncpy(psk, mqtt_psk, 4); psk[4] = 0;
-    printf("Saving config: MQTT<%s,%s;%s,%s...> AP<%s>\n",
+    ESB_LOGI("Saving config: MQTT<%s,%s;%s,%s...> AP<%s>\n",
             mqtt_server, mqtt_port, mqtt_ident, psk, ap_pass);
-    DynamicJsonDocument json(1024);
-    json["ap_pass"] = ap_pass;
-    json["mqtt_server"] = mqtt_server;
-    json["mqtt_port"] = mqtt_port;
-    json["mqtt_ident"] = mqtt_ident;
-    json["mqtt_psk"] = mqtt_psk;
-
-    File configFile = SPIFFS.open("/config.json", FILE_WRITE);
-    if (!configFile) {
-        printf("failed to write config.json\n");
-    } else {
-        serializeJson(json, configFile);
-        configFile.close();
+    // the strings are stored as pointers, they're only copied when serialized
+    StaticJsonDocument<CONFIG_JSON> json;
+    json["ap_pass"] = (const char *)ap_pass;
+    json["mqtt_server"] = (const char *)mqtt_server;
+    json["mqtt_port"] = (const char *)mqtt_port;
+    json["mqtt_ident"] = (const char *)mqtt_ident;
+    json["mqtt_psk"] = (const char *)mqtt_psk;
+    json["mqtt_alt"] = (const char *)mqtt_alt;
+    json["push_hash"] = (const char *)push_hash;
+    json["fleet_hash"] = (const char *)fleet_hash;
+    json["push_version"] = push_version;
+    json["fleet_version"] = fleet_version;
+    // escaped strings can make the JSON longer than the buffer, don't save a truncated file
+    char buf[CONFIG_JSON];
+    if (measureJson(json) >= sizeof(buf)) {
+        ESB_LOGE("config doesn't fit in %d bytes, not saved\n", sizeof(buf));
+        return;
+    }
+    size_t len = serializeJson(json, buf, sizeof(buf));
+
+    int fd = open("/spiffs/config.json", O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0 || write(fd, buf, len) != (ssize_t)len) {
+        ESB_LOGE("failed to write config.json\n");
     }
+    if (fd >= 0) close(fd);
 }
 
 void ESBWifiConfig::save() {
+    ESB_CONFIG_LOCK();
     if (strcmp(config.ap_pass, custom_ap_pass.getValue()) == 0 &&
             strcmp(config.mqtt_server, custom_mqtt_server.getValue()) == 0 &&
             strcmp(config.mqtt_port, custom_mqtt_port.getValue()) == 0 &&
@@ -132,6 +196,7 @@ void ESBWifiConfig::init(int connectTimeout, int portalTimeout) {
     wifiMan.setConfigPortalTimeout(portalTimeout);
     wifiMan.setTryConnectDuringConfigPortal(false); // stop scanning...
     if (!initialized) {
+        initServer();
         wifiMan.addParameter(&custom_header);
         wifiMan.addParameter(&custom_ap_pass);
         wifiMan.addParameter(&custom_header2);
@@ -143,13 +208,78 @@ void ESBWifiConfig::init(int connectTimeout, int portalTimeout) {
     }
 }
 
+// sendPage sends a gzip'ed page straight out of flash. Browsers get to cache it because the
+// page itself is static: the field values are fetched separately from /esb/values.
+void ESBWifiConfig::sendPage(AsyncWebServerRequest *request, const uint8_t *gz, size_t len,
+        const char *etag)
+{
+    if (request->hasHeader("If-None-Match") &&
+            strcmp(request->getHeader("If-None-Match")->value().c_str(), etag) == 0) {
+        request->send(request->beginResponse(304));
+        return;
+    }
+    AsyncWebServerResponse *response = request->beginResponse_P(200, "text/html", gz, len);
+    response->addHeader("Content-Encoding", "gzip");
+    response->addHeader("ETag", etag);
+    response->addHeader("Cache-Control", "no-cache"); // revalidate, mostly gets a 304
+    request->send(response);
+}
+
+// jsonStr appends a quoted and escaped JSON string to buf, returns the new length.
+static int jsonStr(char *buf, int len, int size, const char *str) {
+    if (len < size) buf[len++] = '"';
+    for (; *str && len < size-2; str++) {
+        if (*str == '"' || *str == '\\') buf[len++] = '\\';
+        if ((uint8_t)*str >= ' ') buf[len++] = *str; // drop control chars
+    }
+    if (len < size) buf[len++] = '"';
+    return len;
+}
+
+// sendValues sends the dynamic part of the portal page: the current field values and the SSIDs
+// found by the last scan.
+void ESBWifiConfig::sendValues(AsyncWebServerRequest *request) {
+    AsyncWiFiManagerParameter *params[] = {
+        &custom_ap_pass, &custom_mqtt_server, &custom_mqtt_port, &custom_mqtt_ident,
+        &custom_mqtt_psk,
+    };
+    char buf[1024];
+    int size = sizeof(buf) - 4; // leave room for the closing brackets
+    int len = snprintf(buf, size, "{\"name\":\"%s\",\"fields\":{", esbAPName());
+    for (int i=0; i<sizeof(params)/sizeof(params[0]); i++) {
+        if (i > 0 && len < size) buf[len++] = ',';
+        len = jsonStr(buf, len, size, params[i]->getID());
+        if (len < size) buf[len++] = ':';
+        len = jsonStr(buf, len, size, params[i]->getValue());
+    }
+    len += snprintf(buf+len, size-len, "},\"nets\":[");
+    if (len > size) len = size;
+    int n = WiFi.scanComplete();
+    for (int i=0; i<n && len < size-40; i++) {
+        if (i > 0) buf[len++] = ',';
+        len = jsonStr(buf, len, size, WiFi.SSID(i).c_str());
+    }
+    strcpy(buf+len, "]}");
+    request->send(200, "application/json", buf);
+}
+
+void ESBWifiConfig::initServer() {
+    auto index = [this](AsyncWebServerRequest *request) {
+        sendPage(request, portal_index_gz, sizeof(portal_index_gz), PORTAL_INDEX_ETAG);
+    };
+    server.on("/", HTTP_GET, index);
+    server.on("/wifi", HTTP_GET, index);
+    server.on("/0wifi", HTTP_GET, index);
+    server.on("/esb/values", HTTP_GET, [this](AsyncWebServerRequest *request) {
+        sendValues(request);
+    });
+}
+
 bool ESBWifiConfig::connect(int connectTimeout, int portalTimeout) {
     init(connectTimeout, portalTimeout);
 
     // Run the wifi manager.
-    extern String getESP32ChipID();
-    String ap_name = "ESP-" + getESP32ChipID();
-    bool connected = wifiMan.autoConnect(ap_name.c_str(), config.ap_pass);
+    bool connected = wifiMan.autoConnect(esbAPName(), config.ap_pass);
     save();
     return connected;
 }
@@ -162,9 +292,7 @@ bool ESBWifiConfig::reconfig(int connectTimeout, int portalTimeout) {
     //auto cb = [this]() {  saved = true; };
     //wifiMan.setSaveConfigCallback(cb);
 
-    extern String getESP32ChipID();
-    String ap_name = "ESP-" + getESP32ChipID();
-    wifiMan.startConfigPortalModeless(ap_name.c_str(), config.ap_pass);
+    wifiMan.startConfigPortalModeless(esbAPName(), config.ap_pass);
     //config_save();
     //return saved;
     return false;
@@ -174,9 +302,8 @@ bool ESBWifiConfig::reconfig(int connectTimeout, int portalTimeout) {
 void ESBWifiConfig::startPortal() {
     init(0, 3600);
 
-    extern String getESP32ChipID();
-    String ap_name = "ESP-" + getESP32ChipID();
-    wifiMan.startConfigPortalModeless(ap_name.c_str(), config.ap_pass);
+    wifiMan.setSaveConfigCallback([this]() { save(); });
+    wifiMan.startConfigPortalModeless(esbAPName(), config.ap_pass);
 }
 
 void ESBWifiConfig::stopPortal() {
@@ -0,0 +1,94 @@
+// ESP32 Secure Base - event queue from interrupt handlers to a task
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+#include <esp_attr.h>
+#include <esp_heap_caps.h>
+
+ESBEventQueue::ESBEventQueue(uint16_t size, ESBEventFn fn)
+  : _ring(NULL)
+  , _fn(fn)
+  , _head(0)
+  , _tail(0)
+  , _waiting(0)
+  , _overflows(0)
+  , _task(NULL)
+{
+    uint32_t n = 2;
+    while (n < size && n < 0x8000) n *= 2;
+    _mask = n-1;
+}
+
+bool ESBEventQueue::begin(bool task, UBaseType_t prio) {
+    if (!_ring) {
+        // internal RAM so the ISR can write it while the flash cache is disabled
+        _ring = (ESBEvent *)heap_caps_malloc((_mask+1)*sizeof(ESBEvent),
+                MALLOC_CAP_INTERNAL|MALLOC_CAP_8BIT);
+        if (!_ring) return false;
+    }
+    if (task && !_task) xTaskCreate(ESBEventQueue::task, "esb_evq", 3072, this, prio, &_task);
+    return true;
+}
+
+void IRAM_ATTR ESBEventQueue::push(uint32_t data) {
+    uint32_t ccount = esbCCount();
+    uint32_t us = micros();
+    uint32_t h = _head.load(std::memory_order_relaxed);
+    uint32_t t = _tail.load(std::memory_order_acquire);
+    if (!_ring || h - t > _mask) {
+        _overflows++;
+        return;
+    }
+    ESBEvent &ev = _ring[h & _mask];
+    ev.ccount = ccount;
+    ev.micros = us;
+    ev.data = data;
+    _head.store(h+1);
+    // wake the consumer only if it's going to sleep, i.e. once per batch, see task()
+    if (!_task || !_waiting.exchange(0)) return;
+    if (xPortInIsrContext()) {
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(_task, &woken);
+        if (woken) portYIELD_FROM_ISR();
+    } else {
+        xTaskNotifyGive(_task);
+    }
+}
+
+int ESBEventQueue::drain() {
+    int total = 0;
+    for (;;) {
+        uint32_t t = _tail.load(std::memory_order_relaxed);
+        uint32_t h = _head.load(std::memory_order_acquire);
+        if (h == t) return total;
+        // hand out the events up to the end of the ring, the rest in the next iteration
+        uint32_t i = t & _mask;
+        uint32_t n = h - t;
+        if (n > _mask+1 - i) n = _mask+1 - i;
+        _fn(_ring+i, n);
+        _tail.store(t+n, std::memory_order_release);
+        total += n;
+    }
+}
+
+// task drains the queue and blocks until the producer notifies it. It announces that it's about
+// to block in _waiting and then checks the ring once more, while the producer stores the head and
+// then checks _waiting, both sequentially consistent: either the task sees the new event or the
+// producer sees the flag, so no wake-up is lost. A notification that arrives while the task isn't
+// blocked only causes an extra pass.
+void ESBEventQueue::task(void *arg) {
+    ESBEventQueue *q = (ESBEventQueue *)arg;
+    uint32_t overflows = 0;
+    while (true) {
+        q->drain();
+        if (q->_overflows != overflows) {
+            ESB_LOGW("EVQ: %u events dropped\n", q->_overflows-overflows);
+            overflows = q->_overflows;
+        }
+        q->_waiting.store(1);
+        if (q->_head.load() == q->_tail.load(std::memory_order_relaxed)) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+        q->_waiting.store(0);
+    }
+}
@@ -0,0 +1,63 @@
+// ESP32 Secure Base - event queue from interrupt handlers to a task
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// ESBEventQueue delivers events from an interrupt handler to a task: push() records the cycle
+// counter, micros(), and a 32-bit payload in a single-producer/single-consumer ring and wakes
+// the consumer task, which passes the events to a handler in batches. push() and everything it
+// touches is in IRAM/DRAM, so interrupts keep working while the flash is being written, e.g.
+// during OTA. If the consumer falls behind events are dropped and counted.
+// Each queue supports one producer (one interrupt handler or one task) and one consumer.
+
+#include <Arduino.h>
+#include <atomic>
+
+struct ESBEvent {
+    uint32_t ccount; // CPU cycle counter of the core the interrupt ran on
+    uint32_t micros;
+    uint32_t data;
+};
+
+// ESBEventFn is called with a batch of consecutive events.
+typedef void (*ESBEventFn)(const ESBEvent *events, int count);
+
+// esbCCount reads the CCOUNT register, unlike ESP.getCycleCount() it's always inlined so it
+// is safe in IRAM code.
+static inline __attribute__((always_inline)) uint32_t esbCCount() {
+#ifdef __XTENSA__
+    uint32_t ccount;
+    __asm__ __volatile__("rsr %0, ccount" : "=a"(ccount));
+    return ccount;
+#else
+    return 0;
+#endif
+}
+
+class ESBEventQueue {
+public:
+    // size is the number of events the ring holds, it is rounded up to a power of two.
+    ESBEventQueue(uint16_t size, ESBEventFn fn);
+
+    // begin allocates the ring and starts the consumer task, returns false if out of memory.
+    // With task=false the application calls drain() itself.
+    bool begin(bool task = true, UBaseType_t prio = tskIDLE_PRIORITY+2);
+
+    // push queues an event, it may be called from an ISR.
+    void push(uint32_t data);
+
+    // drain passes all queued events to the handler, returns how many there were.
+    int drain();
+
+    uint32_t overflows() { return _overflows; }
+
+//private:
+    ESBEvent   *_ring;
+    uint16_t   _mask;
+    ESBEventFn _fn;
+    std::atomic<uint32_t> _head; // written by the producer
+    std::atomic<uint32_t> _tail; // written by the consumer
+    std::atomic<uint32_t> _waiting; // the consumer task is about to block, the producer wakes it
+    volatile uint32_t _overflows;
+    TaskHandle_t _task;
+
+    static void task(void *);
+};
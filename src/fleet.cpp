@@ -0,0 +1,127 @@
+// ESP32 Secure Base - configuration push
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+#include <ArduinoJson.h>
+
+#define FLEET_DEVICE 0
+#define FLEET_ALL    1
+#define FLEET_JSON   512 // StaticJsonDocument capacity, the strings stay in fleetBuf
+
+static ESBConfig *fleetConfig = NULL;
+static ESBTopic fleetTopic[2] = { ESB_TOPIC_NONE, ESB_TOPIC_NONE };
+// the latest message from each topic, written by fleetMessage and taken by fleetLoop under
+// fleetMux, and the one being applied
+static char fleetBuf[2][ESB_FLEET_BUF];
+static size_t fleetLen[2];
+static bool fleetPending[2];
+static portMUX_TYPE fleetMux = portMUX_INITIALIZER_UNLOCKED;
+static char fleetWork[ESB_FLEET_BUF+1];
+static size_t fleetWorkLen;
+
+void mqttEnableConfigPush(ESBConfig &config, const char *fleet) {
+    fleetConfig = &config;
+    // the fleet topic first so the device's own delta is applied after it
+    if (fleet) {
+        fleetTopic[FLEET_ALL] = mqttTopicAbs(fleet);
+        mqttAddSubscription(fleetTopic[FLEET_ALL], 1);
+    }
+    fleetTopic[FLEET_DEVICE] = mqttTopic("/config");
+    mqttAddSubscription(fleetTopic[FLEET_DEVICE], 1);
+}
+
+// fleetMessage runs in the AsyncTCP task, it copies the message for fleetLoop.
+bool fleetMessage(const char *topic, const char *payload, size_t len, size_t total) {
+    if (!fleetConfig) return false;
+    for (int src=0; src<2; src++) {
+        if (!mqttTopicIs(fleetTopic[src], topic)) continue;
+        if (len == 0) return true; // retained message cleared
+        if (len != total || len > ESB_FLEET_BUF) {
+            ESB_LOGW("CONFIG: message on %s too long (%d bytes)\n", topic, total);
+            return true;
+        }
+        // a message that hasn't been applied yet is superseded by the newer one
+        portENTER_CRITICAL(&fleetMux);
+        memcpy(fleetBuf[src], payload, len);
+        fleetLen[src] = len;
+        fleetPending[src] = true;
+        portEXIT_CRITICAL(&fleetMux);
+        esbTimers.wake();
+        return true;
+    }
+    return false;
+}
+
+// fleetApply applies the message from src, which is in fleetWork.
+static void fleetApply(int src) {
+    ESBConfig &c = *fleetConfig;
+    // parsing a mutable buffer doesn't copy the strings
+    StaticJsonDocument<FLEET_JSON> json;
+    DeserializationError err = deserializeJson(json, fleetWork, fleetWorkLen);
+    if (err) {
+        ESB_LOGE("CONFIG: cannot parse message: %s\n", err.c_str());
+        return;
+    }
+    ESB_CONFIG_LOCK();
+    const char *hash = json["hash"] | "";
+    uint32_t v = json["v"] | 0UL;
+    char *lastHash = src == FLEET_ALL ? c.fleet_hash : c.push_hash;
+    uint32_t &lastV = src == FLEET_ALL ? c.fleet_version : c.push_version;
+    if (*hash == 0) {
+        ESB_LOGE("CONFIG: message without hash\n");
+        return;
+    }
+    if (strncmp(hash, lastHash, sizeof(c.push_hash)-1) == 0) return; // already applied
+    if (v < lastV) {
+        ESB_LOGW("CONFIG: ignoring version %u, have %u\n", v, lastV);
+        return;
+    }
+
+    struct { const char *key; char *field; size_t size; bool conn; } fields[] = {
+        { "ap_pass",     c.ap_pass,     sizeof(c.ap_pass),     false },
+        { "mqtt_server", c.mqtt_server, sizeof(c.mqtt_server), true },
+        { "mqtt_port",   c.mqtt_port,   sizeof(c.mqtt_port),   true },
+        { "mqtt_alt",    c.mqtt_alt,    sizeof(c.mqtt_alt),    true },
+        { "mqtt_ident",  c.mqtt_ident,  sizeof(c.mqtt_ident),  true },
+        { "mqtt_psk",    c.mqtt_psk,    sizeof(c.mqtt_psk),    true },
+    };
+    JsonObject set = json["set"];
+    int changed = 0;
+    bool reconnect = false;
+    for (auto &f : fields) {
+        JsonVariant val = set[f.key];
+        if (val.isNull()) continue;
+        char num[12];
+        const char *s = val.as<const char *>();
+        if (!s && val.is<long>()) {
+            snprintf(num, sizeof(num), "%ld", val.as<long>());
+            s = num;
+        }
+        if (!s || strcmp(s, f.field) == 0) continue;
+        strncpy(f.field, s, f.size-1);
+        f.field[f.size-1] = 0;
+        ESB_LOGI("CONFIG: %s changed\n", f.key);
+        changed++;
+        reconnect |= f.conn;
+    }
+
+    strncpy(lastHash, hash, sizeof(c.push_hash)-1);
+    lastV = v;
+    ESB_LOGI("CONFIG: applied version %u (%s), %d fields changed\n", v, hash, changed);
+    c.save();
+    if (reconnect) mqttConnect();
+}
+
+void fleetLoop() {
+    for (int src=FLEET_ALL; src >= FLEET_DEVICE; src--) {
+        portENTER_CRITICAL(&fleetMux);
+        bool pending = fleetPending[src];
+        if (pending) {
+            memcpy(fleetWork, fleetBuf[src], fleetLen[src]);
+            fleetWorkLen = fleetLen[src];
+            fleetPending[src] = false;
+        }
+        portEXIT_CRITICAL(&fleetMux);
+        if (pending) fleetApply(src);
+    }
+}
@@ -0,0 +1,30 @@
+// ESP32 Secure Base - configuration push
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// mqttEnableConfigPush subscribes to the retained <mqTopic>/config and optionally to a topic
+// shared by the fleet. Each carries a config delta:
+//   {"v":3, "hash":"9f3c20a1", "set":{"mqtt_server":"broker2", "mqtt_port":8883}}
+// where hash identifies the content (tools/config_push.py uses a hash of "set") and v is a
+// version that must not go backwards. The hash of the last applied message from each topic is
+// saved in the config, so the retained message delivered on every reconnect is a no-op. Else
+// the fields of "set" that differ from the config are changed, the config is saved, and MQTT
+// reconnects only if a connection parameter changed. Fields: ap_pass, mqtt_server,
+// mqtt_port, mqtt_alt, mqtt_ident, mqtt_psk. The device's own topic is subscribed after the
+// fleet topic, so its retained delta is applied last and takes precedence.
+// The messages are parsed and applied by mqttLoop holding the config lock (see ESBConfigLock), a
+// message that arrives before the previous one from the same topic was applied replaces it.
+
+#include <Arduino.h>
+
+#ifndef ESB_FLEET_BUF
+#define ESB_FLEET_BUF 512 // max size of a config message
+#endif
+
+struct ESBConfig;
+// mqttEnableConfigPush subscribes to the config topics, fleetTopic is a full topic or NULL and
+// must remain allocated.
+extern void mqttEnableConfigPush(ESBConfig &config, const char *fleetTopic = NULL);
+// fleetMessage queues a message on one of the config topics, it returns false for other topics.
+extern bool fleetMessage(const char *topic, const char *payload, size_t len, size_t total);
+// fleetLoop applies queued config messages, mqttLoop calls it.
+extern void fleetLoop();
@@ -0,0 +1,328 @@
+// ESP32 Secure Base - QoS 1/2 in-flight window
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+
+// message flags
+#define FL_SENDING 1 // publish() in progress, the buffer must not be compacted
+#define FL_ACKED   2 // acknowledged, removed by the next compaction
+#define FL_RESENT  4 // retransmitted, its acknowledgement gives no RTT sample
+#define FL_FRESH   8 // the broker lost the session, publish it again with a new packet id
+
+#define FLIGHT_EARLY 4 // acknowledgements remembered that overtook the return from publish()
+
+// FlightMsg is an unacknowledged message in flightBuf, it is followed by the NUL-terminated
+// topic and the payload and padded to a multiple of 4 bytes.
+struct FlightMsg {
+    uint32_t sent;     // millis() of the last transmission
+    uint32_t deadline; // millis() of the next retransmission
+    uint16_t id;       // MQTT packet id
+    uint16_t tlen;
+    uint16_t plen;
+    uint16_t size;     // bytes used in flightBuf
+    uint8_t  qos;      // qos | retain<<2
+    uint8_t  flags;
+    uint8_t  tries;    // retransmissions so far
+
+    char *topic() { return (char *)(this+1); }
+    char *payload() { return topic()+tlen+1; }
+};
+
+static uint32_t flightBuf[ESB_FLIGHT_BUF/4];
+static uint16_t flightLen = 0;   // bytes used in flightBuf
+static uint8_t flightCount = 0;  // unacknowledged messages
+static uint8_t flightBusy = 0;   // publish() calls in progress
+static uint16_t flightEarly[FLIGHT_EARLY];
+static uint8_t flightEarlyNext = 0;
+static portMUX_TYPE flightMux = portMUX_INITIALIZER_UNLOCKED;
+static volatile TaskHandle_t flightWaiter = NULL; // task blocked in flightWait
+
+static int32_t flightSrtt = -1; // smoothed RTT in ms, -1 before the first sample
+static int32_t flightRttvar = 0;
+static uint32_t flightRtoMs = ESB_FLIGHT_RTO_INIT;
+
+static uint32_t flightSeen[ESB_FLIGHT_SEEN]; // hashes of recently received messages
+static uint8_t flightSeenNext = 0;
+
+static void flightRetransmit(void *);
+ESBTimer flightTimer(flightRetransmit);
+
+uint32_t flightRto() { return flightRtoMs; }
+
+#define FOREACH_MSG(m) \
+    for (FlightMsg *m = (FlightMsg *)flightBuf; \
+         (uint8_t *)m < (uint8_t *)flightBuf + flightLen; \
+         m = (FlightMsg *)((uint8_t *)m + m->size))
+
+// flightSample updates the RTT estimate, called with flightMux held.
+static void flightSample(int32_t rtt) {
+    if (flightSrtt < 0) {
+        flightSrtt = rtt;
+        flightRttvar = rtt/2;
+    } else {
+        int32_t d = flightSrtt - rtt;
+        if (d < 0) d = -d;
+        flightRttvar = (3*flightRttvar + d) / 4;
+        flightSrtt = (7*flightSrtt + rtt) / 8;
+    }
+    uint32_t rto = flightSrtt + 4*flightRttvar;
+    if (rto < ESB_FLIGHT_RTO_MIN) rto = ESB_FLIGHT_RTO_MIN;
+    if (rto > ESB_FLIGHT_RTO_MAX) rto = ESB_FLIGHT_RTO_MAX;
+    flightRtoMs = rto;
+}
+
+// flightAcked marks m as acknowledged, called with flightMux held.
+static void flightAcked(FlightMsg *m) {
+    m->flags |= FL_ACKED;
+    flightCount--;
+    if (!(m->flags & FL_RESENT)) flightSample(millis() - m->sent);
+}
+
+// flightEarlyAck checks whether the acknowledgement of the message just published with id
+// overtook the return from publish(), called with flightMux held.
+static void flightEarlyAck(FlightMsg *m, uint16_t id) {
+    for (int i=0; i<FLIGHT_EARLY; i++) {
+        if (flightEarly[i] == id) {
+            flightEarly[i] = 0;
+            flightAcked(m);
+            return;
+        }
+    }
+}
+
+// flightOpened tells the tasks waiting for the window that it opened.
+static void flightOpened() {
+    TaskHandle_t waiter = flightWaiter;
+    if (waiter) xTaskNotifyGive(waiter);
+    // the esb_net task may have parked a publish
+    mqTimers->wake();
+}
+
+// flightCompact removes the acknowledged messages, called with flightMux held.
+static void flightCompact() {
+    if (flightBusy) return;
+    uint16_t to = 0;
+    for (uint16_t off=0; off < flightLen; ) {
+        FlightMsg *m = (FlightMsg *)((uint8_t *)flightBuf + off);
+        uint16_t size = m->size;
+        if (!(m->flags & FL_ACKED)) {
+            if (to != off) memmove((uint8_t *)flightBuf + to, m, size);
+            to += size;
+        }
+        off += size;
+    }
+    flightLen = to;
+}
+
+static uint32_t flightSize(const char *topic, size_t len) {
+    return (sizeof(FlightMsg) + strlen(topic)+1 + len + 3) & ~3;
+}
+
+// flightFits returns true if a message of size bytes can be added, called with flightMux held.
+static bool flightFits(uint32_t size) {
+    if (flightCount >= ESB_FLIGHT_WINDOW) return false;
+    if (flightLen + size > ESB_FLIGHT_BUF) flightCompact();
+    return flightLen + size <= ESB_FLIGHT_BUF;
+}
+
+bool flightFull(const char *topic, size_t len) {
+    uint32_t size = flightSize(topic, len);
+    if (size > ESB_FLIGHT_BUF) return false; // sent untracked, see flightSend
+    portENTER_CRITICAL(&flightMux);
+    bool fits = flightFits(size);
+    portEXIT_CRITICAL(&flightMux);
+    return !fits;
+}
+
+// flightSchedule starts the timer for the earliest retransmission.
+static void flightSchedule() {
+    uint32_t now = millis();
+    int32_t next = ESB_TIMER_IDLE;
+    portENTER_CRITICAL(&flightMux);
+    FOREACH_MSG(m) {
+        if (m->flags & (FL_ACKED|FL_SENDING)) continue;
+        int32_t left = m->deadline - now;
+        if (left < next) next = left;
+    }
+    portEXIT_CRITICAL(&flightMux);
+    if (next == ESB_TIMER_IDLE) mqTimers->stop(flightTimer);
+    else mqTimers->start(flightTimer, next > 0 ? next : 0);
+}
+
+// flightSend publishes a message that has already been compressed.
+static bool flightSend(const char *topic, uint8_t qos, bool retain, const char *payload,
+        size_t len)
+{
+    uint32_t size = flightSize(topic, len);
+    if (qos == 0 || size > ESB_FLIGHT_BUF) {
+        if (qos) ESB_LOGW("MQTT: message on %s too long to retransmit (%d bytes)\n", topic, len);
+        return mqttClient.publish(topic, qos, retain, payload, len) != 0;
+    }
+
+    portENTER_CRITICAL(&flightMux);
+    if (!flightFits(size)) {
+        portEXIT_CRITICAL(&flightMux);
+        return false;
+    }
+    FlightMsg *m = (FlightMsg *)((uint8_t *)flightBuf + flightLen);
+    m->id = 0;
+    m->tlen = strlen(topic);
+    m->plen = len;
+    m->size = size;
+    m->qos = qos | retain<<2;
+    m->flags = FL_SENDING;
+    m->tries = 0;
+    memcpy(m->topic(), topic, m->tlen+1);
+    memcpy(m->payload(), payload, len);
+    flightLen += size;
+    flightCount++;
+    flightBusy++;
+    portEXIT_CRITICAL(&flightMux);
+
+    uint32_t now = millis();
+    uint16_t id = mqttClient.publish(m->topic(), qos, retain, m->payload(), len);
+
+    portENTER_CRITICAL(&flightMux);
+    flightBusy--;
+    m->flags &= ~FL_SENDING;
+    m->id = id;
+    m->sent = now;
+    m->deadline = now + flightRtoMs;
+    if (!id) {
+        // not sent, drop it
+        m->flags |= FL_ACKED|FL_RESENT;
+        flightCount--;
+    } else {
+        flightEarlyAck(m, id);
+    }
+    portEXIT_CRITICAL(&flightMux);
+    flightSchedule();
+    return id != 0;
+}
+
+bool flightPublish(const char *topic, uint8_t qos, bool retain, const char *payload, size_t len) {
+    ESB_ALLOC_NET();
+    const char *packed = zipPack(payload, len);
+    bool ok = flightSend(topic, qos, retain, packed, len);
+    zipDone(packed);
+    return ok;
+}
+
+// flightAck runs in the AsyncTCP task.
+void flightAck(uint16_t packetId) {
+    ESB_NET_LOCK();
+    bool found = false;
+    portENTER_CRITICAL(&flightMux);
+    FOREACH_MSG(m) {
+        if (m->id == packetId && !(m->flags & (FL_ACKED|FL_SENDING|FL_FRESH))) {
+            flightAcked(m);
+            found = true;
+            break;
+        }
+    }
+    if (!found) {
+        flightEarly[flightEarlyNext] = packetId;
+        flightEarlyNext = (flightEarlyNext+1) % FLIGHT_EARLY;
+    }
+    portEXIT_CRITICAL(&flightMux);
+    if (found) flightOpened();
+}
+
+bool flightWait(uint32_t ms) {
+    flightWaiter = xTaskGetCurrentTaskHandle();
+    uint32_t n = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ms));
+    flightWaiter = NULL;
+    return n != 0;
+}
+
+static void flightRetransmit(void *) {
+    if (!mqttClient.connected()) return; // flightConnected restarts the timer
+    ESB_ALLOC_NET();
+    for (;;) {
+        uint32_t now = millis();
+        FlightMsg *due = NULL;
+        portENTER_CRITICAL(&flightMux);
+        FOREACH_MSG(m) {
+            if (m->flags & (FL_ACKED|FL_SENDING)) continue;
+            if ((int32_t)(m->deadline - now) <= 0) {
+                due = m;
+                break;
+            }
+        }
+        if (due) {
+            due->flags |= FL_SENDING|FL_RESENT;
+            flightBusy++;
+        }
+        portEXIT_CRITICAL(&flightMux);
+        if (!due) break;
+
+        if (due->tries >= ESB_FLIGHT_TRIES) {
+            // the broker keeps not answering, give up on the message so it doesn't hold up the
+            // window forever
+            ESB_LOGE("MQTT: dropped %d on %s after %d tries\n", due->id, due->topic(), due->tries);
+            portENTER_CRITICAL(&flightMux);
+            flightBusy--;
+            due->flags = (due->flags & ~FL_SENDING) | FL_ACKED;
+            flightCount--;
+            portEXIT_CRITICAL(&flightMux);
+            flightOpened();
+            continue;
+        }
+        due->tries++;
+
+        uint16_t id;
+        if (due->flags & FL_FRESH) {
+            ESB_LOGW("MQTT: resending %d on %s in the new session\n", due->id, due->topic());
+            id = mqttClient.publish(due->topic(), due->qos & 3, due->qos & 4, due->payload(),
+                    due->plen);
+        } else {
+            ESB_LOGW("MQTT: retransmitting %d on %s (try %d)\n", due->id, due->topic(),
+                    due->tries);
+            id = mqttClient.publish(due->topic(), due->qos & 3, due->qos & 4, due->payload(),
+                    due->plen, true, due->id);
+        }
+
+        portENTER_CRITICAL(&flightMux);
+        flightBusy--;
+        due->flags &= ~FL_SENDING;
+        if (id && (due->flags & FL_FRESH)) {
+            due->flags &= ~FL_FRESH;
+            due->id = id;
+            flightEarlyAck(due, id);
+        }
+        // back off exponentially while the broker doesn't answer
+        uint32_t rto = flightRtoMs << (due->tries < 5 ? due->tries : 5);
+        if (rto > ESB_FLIGHT_RTO_MAX) rto = ESB_FLIGHT_RTO_MAX;
+        due->sent = millis();
+        due->deadline = due->sent + rto;
+        portEXIT_CRITICAL(&flightMux);
+    }
+    flightSchedule();
+}
+
+void flightConnected(bool sessionPresent) {
+    uint32_t now = millis();
+    portENTER_CRITICAL(&flightMux);
+    FOREACH_MSG(m) {
+        m->deadline = now;
+        // without the session the old packet ids mean nothing to the broker
+        if (!sessionPresent) m->flags |= FL_FRESH;
+    }
+    portEXIT_CRITICAL(&flightMux);
+    mqTimers->start(flightTimer, 0);
+}
+
+// flightDuplicate runs in the AsyncTCP task.
+bool flightDuplicate(const char *topic, const char *payload, size_t len, MqttProps props) {
+    if (props.qos == 0) return false;
+    uint32_t h = esbHash(topic);
+    for (size_t i=0; i<len; i++) h = (h ^ (uint8_t)payload[i]) * 16777619u;
+    if (h == 0) h = 1; // 0 marks an empty slot
+    for (int i=0; i<ESB_FLIGHT_SEEN; i++) {
+        // an identical message without the dup flag is a new one that happens to repeat
+        if (flightSeen[i] == h) return props.dup;
+    }
+    flightSeen[flightSeenNext] = h;
+    flightSeenNext = (flightSeenNext+1) % ESB_FLIGHT_SEEN;
+    return false;
+}
@@ -0,0 +1,57 @@
+// ESP32 Secure Base - QoS 1/2 in-flight window
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// Messages published at QoS 1 or 2 are kept, topic and payload, in a static buffer until the
+// broker acknowledges them, and up to ESB_FLIGHT_WINDOW of them may be unacknowledged at any
+// time. A message not acknowledged within the retransmit timeout is published again with the
+// dup flag and its original packet id, as are all unacknowledged messages after a reconnect that
+// resumes the session. After a clean-session reconnect the broker has forgotten the packet ids,
+// so the messages are published again as new ones. A message still unacknowledged after
+// ESB_FLIGHT_TRIES retransmissions is dropped.
+// The timeout is derived from the round-trip times of the acknowledgements the same way TCP
+// does it (smoothed RTT plus four times its deviation, doubled on each retransmit).
+// When the window is full mqttPublish returns false, except via the esb_net task (see net.h),
+// which parks the publish until an acknowledgement opens the window while it keeps serving its
+// other requests: the sustained rate is then one window per round-trip.
+// On the receive side the hashes of recent QoS 1/2 messages are remembered, so a redelivered
+// message (dup flag set) that was already received is dropped instead of being processed twice.
+
+#include <Arduino.h>
+
+#ifndef ESB_FLIGHT_WINDOW
+#define ESB_FLIGHT_WINDOW 8    // max unacknowledged messages
+#endif
+#ifndef ESB_FLIGHT_BUF
+#define ESB_FLIGHT_BUF 4096    // bytes for the unacknowledged messages
+#endif
+#ifndef ESB_FLIGHT_SEEN
+#define ESB_FLIGHT_SEEN 16     // number of received messages remembered to drop duplicates
+#endif
+#ifndef ESB_FLIGHT_TRIES
+#define ESB_FLIGHT_TRIES 10    // retransmissions before a message is dropped
+#endif
+#define ESB_FLIGHT_RTO_INIT 1000 // ms retransmit timeout before the first RTT sample
+#define ESB_FLIGHT_RTO_MIN 200
+#define ESB_FLIGHT_RTO_MAX 30000
+
+// flightPublish publishes a message, compressed if enabled (see zip.h), and tracks it if
+// qos > 0. Returns false if the window is full or the client could not send it. Must be called
+// where the MQTT client may be called.
+extern bool flightPublish(const char *topic, uint8_t qos, bool retain,
+        const char *payload, size_t len);
+// flightFull returns true if a message of len bytes on topic doesn't fit into the window.
+extern bool flightFull(const char *topic, size_t len);
+// flightAck is the MQTT client's onPublish callback.
+extern void flightAck(uint16_t packetId);
+// flightConnected retransmits the unacknowledged messages on a new connection.
+extern void flightConnected(bool sessionPresent);
+// flightWait blocks the calling task until an acknowledgement opens the window or ms pass,
+// returns false on timeout. Only one task may wait at a time.
+extern bool flightWait(uint32_t ms);
+// flightDuplicate returns true if a received message is a redelivery of one already processed.
+extern bool flightDuplicate(const char *topic, const char *payload, size_t len, MqttProps props);
+// flightRto returns the current retransmit timeout in ms.
+extern uint32_t flightRto();
+
+// flightTimer runs the retransmissions on the MQTT timer wheel.
+extern ESBTimer flightTimer;
@@ -0,0 +1,164 @@
+// ESP32 Secure Base - loop latency watchdog
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+
+#define LAT_REPORT_MS 10000 // min interval between MQTT reports
+#define LAT_MSG 1024        // max size of a report
+
+uint32_t latLoopBudget = 50000;
+DVW(latLoopBudget);
+
+std::atomic<ESBLatSite *> ESBLatSite::_first(NULL);
+
+// a loop iteration that went over budget
+struct LatIter {
+    uint32_t   us;
+    uint32_t   at;   // millis() at the end of the iteration
+    ESBLatSite *site; // innermost call site over budget, NULL if none
+};
+
+static LatIter latWorst[ESB_LAT_WORST]; // worst first
+static TaskHandle_t latTask = NULL;     // task running loop(), set by the first latLoop
+static uint32_t latMark;                // micros() at the start of the current iteration
+static uint32_t latIdleUs = 0;          // time spent waiting in the current iteration
+static int latDepth = 0;                // nesting of call sites in the loop task
+static ESBLatSite *latIterSite = NULL;  // innermost call site over budget in this iteration
+static int latIterDepth = 0;
+static uint32_t latIterUs = 0;
+static bool latNew = false;             // a new worst case has not been published yet
+
+// latFile strips the directories from a __FILE__ path.
+static const char *latFile(const char *path) {
+    const char *s = strrchr(path, '/');
+    return s ? s+1 : path;
+}
+
+//===== call sites
+
+ESBLatScope::ESBLatScope(ESBLatSite &site) : _site(site), _depth(0) {
+    if (latTask && xTaskGetCurrentTaskHandle() == latTask) _depth = ++latDepth;
+    _t0 = micros();
+}
+
+ESBLatScope::~ESBLatScope() {
+    uint32_t us = micros() - _t0;
+    if (_depth) latDepth--;
+    _site.record(us, _depth);
+}
+
+void ESBLatSite::record(uint32_t us, int depth) {
+    _calls++;
+    if (us <= _budget) return;
+    _over++;
+    // an enclosing site exits after the one that actually blocked, so it doesn't override it
+    if (depth > 0 && (!latIterSite || depth > latIterDepth ||
+                (depth == latIterDepth && us > latIterUs))) {
+        latIterSite = this;
+        latIterDepth = depth;
+        latIterUs = us;
+    }
+    if (us > _worst) {
+        _worst = us;
+        _worstAt = millis();
+        latNew = true;
+        ESB_LOGW("LAT: %s took %uus, budget %uus (%s:%d)\n", _name, us, _budget,
+                latFile(_file), _line);
+    }
+}
+
+//===== loop iterations
+
+static int latJson(char *buf, int size) {
+    uint32_t now = millis();
+    int len = snprintf(buf, size, "{\"budget\":%u,\"loop\":[", latLoopBudget);
+    for (int i=0; i<ESB_LAT_WORST && latWorst[i].us && len < size-80; i++) {
+        LatIter &w = latWorst[i];
+        len += snprintf(buf+len, size-len, "%s{\"us\":%u,\"ago\":%u,\"in\":\"%s\"}", i ? "," : "",
+                w.us, (now-w.at)/1000, w.site ? w.site->_name : "application");
+    }
+    len += snprintf(buf+len, size-len, "],\"sites\":[");
+    bool first = true;
+    for (ESBLatSite *s=ESBLatSite::_first.load(); s && len < size-120; s=s->_next) {
+        if (s->_over == 0) continue;
+        len += snprintf(buf+len, size-len, "%s{\"site\":\"%s\",\"at\":\"%s:%d\",\"budget\":%u,"
+                "\"calls\":%u,\"over\":%u,\"worst\":%u}", first ? "" : ",", s->_name,
+                latFile(s->_file), s->_line, s->_budget, s->_calls, s->_over, s->_worst);
+        first = false;
+    }
+    len += snprintf(buf+len, size-len, "]}");
+    return len < size ? len : size-1;
+}
+
+static void latPublish() {
+    static char msg[LAT_MSG];
+    int len = latJson(msg, sizeof(msg));
+    static ESBTopic topic = ESB_TOPIC_NONE;
+    mqttPublish(mqttTopicOnce(topic, "/latency", true), 0, false, msg, len);
+}
+
+void latLoop() {
+    static uint32_t lastReport = 0;
+    uint32_t now = micros();
+    if (!latTask) {
+        latTask = xTaskGetCurrentTaskHandle();
+        latMark = now;
+        return;
+    }
+    uint32_t us = now - latMark - latIdleUs;
+    latMark = now;
+    latIdleUs = 0;
+    if (us > latLoopBudget && us > latWorst[ESB_LAT_WORST-1].us) {
+        // insert into the list of worst iterations
+        int i = ESB_LAT_WORST-1;
+        for (; i > 0 && latWorst[i-1].us < us; i--) latWorst[i] = latWorst[i-1];
+        latWorst[i].us = us;
+        latWorst[i].at = millis();
+        latWorst[i].site = latIterSite;
+        latNew = true;
+        ESB_LOGW("LAT: loop took %uus, budget %uus, in %s\n", us, latLoopBudget,
+                latIterSite ? latIterSite->_name : "application");
+    }
+    latIterSite = NULL;
+    latIterDepth = 0;
+    latIterUs = 0;
+
+    if (latNew && mqttClient.connected() && millis() - lastReport > LAT_REPORT_MS) {
+        latPublish();
+        latNew = false;
+        lastReport = millis();
+    }
+}
+
+void latIdle(uint32_t us) {
+    if (xTaskGetCurrentTaskHandle() == latTask) latIdleUs += us;
+}
+
+//===== debug command
+
+static void cmdDebugLat(ESBArgs &args) {
+    const char *arg = args.str("");
+    if (strcmp(arg, "reset") == 0) {
+        memset(latWorst, 0, sizeof(latWorst));
+        for (ESBLatSite *s=ESBLatSite::_first.load(); s; s=s->_next) {
+            s->_calls = s->_over = s->_worst = 0;
+        }
+        printf("DEBUG: latency stats reset\n");
+        return;
+    } else if (*arg != 0) {
+        printf("Usage: debug lat [reset]\n");
+        return;
+    }
+    uint32_t now = millis();
+    printf("== Worst loop iterations (budget %uus):\n", latLoopBudget);
+    for (int i=0; i<ESB_LAT_WORST && latWorst[i].us; i++) {
+        printf("  %8uus %6us ago in %s\n", latWorst[i].us, (now-latWorst[i].at)/1000,
+                latWorst[i].site ? latWorst[i].site->_name : "application");
+    }
+    printf("== Call sites:        calls     over    worst   budget\n");
+    for (ESBLatSite *s=ESBLatSite::_first.load(); s; s=s->_next) {
+        printf("  %-16s %9u %8u %6uus %6uus %s:%d\n", s->_name, s->_calls, s->_over, s->_worst,
+                s->_budget, latFile(s->_file), s->_line);
+    }
+}
+ESB_CMD(debug, lat, cmdDebugLat, "[reset]");
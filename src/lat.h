@@ -0,0 +1,72 @@
+// ESP32 Secure Base - loop latency watchdog
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// ESB_LATENCY(name, budget) at the top of a block checks that the rest of the block completes
+// within budget microseconds. Each call site keeps its call count, how often it went over
+// budget, and its worst time. In addition, latLoop (called from mqttLoop) measures each loop()
+// iteration against latLoopBudget and remembers the worst iterations together with the
+// innermost call site that went over budget during the iteration, which usually is the call
+// that blocked. New worst cases are logged right away and published on <mqTopic>/latency,
+// "debug lat" lists them and "debug lat reset" clears them.
+// Defining ESB_NO_LATENCY compiles the call site checks out.
+
+#include <Arduino.h>
+#include <atomic>
+
+#ifndef ESB_LAT_WORST
+#define ESB_LAT_WORST 8 // number of worst loop iterations remembered
+#endif
+
+class ESBLatSite {
+public:
+    const char *_name;
+    const char *_file;
+    uint16_t   _line;
+    uint32_t   _budget;  // microseconds
+    uint32_t   _calls;
+    uint32_t   _over;    // calls that exceeded the budget
+    uint32_t   _worst;   // microseconds
+    uint32_t   _worstAt; // millis() of the worst call
+    ESBLatSite *_next;
+
+    // _first is the list of sites, pushed to when a scope first runs in any task
+    static std::atomic<ESBLatSite *> _first;
+
+    ESBLatSite(const char *name, const char *file, int line, uint32_t budget)
+      : _name(name), _file(file), _line(line), _budget(budget)
+      , _calls(0), _over(0), _worst(0), _worstAt(0)
+    {
+        _next = _first.load();
+        while (!_first.compare_exchange_weak(_next, this)) {}
+    }
+
+    void record(uint32_t us, int depth);
+};
+
+class ESBLatScope {
+public:
+    ESBLatSite &_site;
+    uint32_t   _t0;
+    int        _depth; // nesting depth in the loop task, 0 in other tasks
+
+    ESBLatScope(ESBLatSite &site);
+    ~ESBLatScope();
+};
+
+#ifndef ESB_NO_LATENCY
+#define ESB_LATENCY(name, budget) \
+    static ESBLatSite esbLatSite_ ## name(#name, __FILE__, __LINE__, budget); \
+    ESBLatScope esbLatScope_ ## name(esbLatSite_ ## name)
+#else
+#define ESB_LATENCY(name, budget)
+#endif
+
+// latLoopBudget is the time in microseconds a loop() iteration may take, it is writable using
+// "debug set latLoopBudget".
+extern uint32_t latLoopBudget;
+
+// latLoop marks the start of a loop() iteration and publishes new worst cases.
+extern void latLoop();
+// latIdle tells the watchdog that the loop task was blocked waiting for us microseconds, which
+// doesn't count against the budget.
+extern void latIdle(uint32_t us);
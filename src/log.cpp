@@ -0,0 +1,127 @@
+// ESP32 Secure Base - asynchronous logging
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+#include <atomic>
+
+#define LOG_BATCH 1024     // max size of an MQTT log message
+#define LOG_BATCH_MS 2000  // max time a line waits in the MQTT batch
+
+// Each slot carries a sequence number that tells producers and the consumer whose turn it is:
+// for position pos in the ring (slot pos%N, turn pos/N) the slot is free when seq==2*turn and
+// holds a message when seq==2*turn+1. This way a zero-initialized ring is valid and logging
+// works before anything has been set-up.
+struct LogSlot {
+    std::atomic<uint32_t> seq;
+    uint8_t level;
+    uint8_t len;
+    char text[ESB_LOG_LINE];
+};
+
+static LogSlot logRing[ESB_LOG_SLOTS];
+static std::atomic<uint32_t> logHead; // next position to be claimed by a producer
+static uint32_t logTail = 0;          // next position to be output, consumer only
+static std::atomic<bool> logStarted;
+static TaskHandle_t logTask = NULL;
+std::atomic<uint32_t> esbLogDropped(0);
+
+// batching of messages for MQTT
+static uint8_t logMqttLevel = ESB_LOG_NONE;
+static char logBatch[LOG_BATCH];
+static int logBatchLen = 0;
+static uint32_t logBatchAt = 0; // when the first line was added to the batch
+
+static void logPublish() {
+    if (logBatchLen > 0 && mqttClient.connected()) {
+        static ESBTopic topic = ESB_TOPIC_NONE;
+        mqttPublish(mqttTopicOnce(topic, "/log", true), 0, false, logBatch, logBatchLen);
+    }
+    logBatchLen = 0;
+}
+
+static void logOutput(LogSlot &s) {
+    fwrite(s.text, 1, s.len, stdout);
+    if (s.level > logMqttLevel) return;
+    if (logBatchLen + s.len > LOG_BATCH) logPublish();
+    if (logBatchLen == 0) logBatchAt = millis();
+    memcpy(logBatch+logBatchLen, s.text, s.len);
+    logBatchLen += s.len;
+}
+
+// logDrain outputs all queued messages, returns true if there were any.
+static bool logDrain() {
+    bool any = false;
+    for (;;) {
+        LogSlot &s = logRing[logTail & (ESB_LOG_SLOTS-1)];
+        uint32_t turn = logTail / ESB_LOG_SLOTS;
+        if (s.seq.load(std::memory_order_acquire) != 2*turn+1) break;
+        logOutput(s);
+        s.seq.store(2*(turn+1), std::memory_order_release);
+        logTail++;
+        any = true;
+    }
+    return any;
+}
+
+static void logLoop(void *) {
+    uint32_t dropped = 0;
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LOG_BATCH_MS/2));
+        logDrain();
+        uint32_t d = esbLogDropped.load(std::memory_order_relaxed);
+        if (d != dropped) {
+            printf("log: %u messages dropped\n", d-dropped);
+            dropped = d;
+        }
+        fflush(stdout);
+        if (logBatchLen > 0 && millis()-logBatchAt > LOG_BATCH_MS) logPublish();
+    }
+}
+
+void esbLog(uint8_t level, const char *fmt, ...) {
+    // start the output task on first use
+    if (!logStarted.exchange(true)) {
+        xTaskCreate(logLoop, "esb_log", 3072, NULL, tskIDLE_PRIORITY+1, &logTask);
+    }
+
+    // claim a slot
+    uint32_t pos = logHead.load(std::memory_order_relaxed);
+    LogSlot *s;
+    for (;;) {
+        s = &logRing[pos & (ESB_LOG_SLOTS-1)];
+        uint32_t seq = s->seq.load(std::memory_order_acquire);
+        int32_t dif = (int32_t)(seq - 2*(pos / ESB_LOG_SLOTS));
+        if (dif == 0) {
+            if (logHead.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+        } else if (dif < 0) {
+            esbLogDropped.fetch_add(1, std::memory_order_relaxed); // the consumer is behind
+            return;
+        } else {
+            pos = logHead.load(std::memory_order_relaxed); // another producer got it
+        }
+    }
+
+    // format message into the slot, ensure it ends with a newline
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(s->text, ESB_LOG_LINE, fmt, args);
+    va_end(args);
+    if (len < 0) len = 0;
+    if (len > ESB_LOG_LINE-1) len = ESB_LOG_LINE-1;
+    if (len == 0 || s->text[len-1] != '\n') s->text[len++] = '\n';
+    s->len = len;
+    s->level = level;
+    s->seq.store(2*(pos / ESB_LOG_SLOTS)+1, std::memory_order_release);
+    if (logTask) xTaskNotifyGive(logTask);
+}
+
+void esbLogMqtt(uint8_t level) {
+    logMqttLevel = level;
+}
+
+void esbLogFlush(uint32_t timeout) {
+    ESB_LATENCY(logFlush, 5000);
+    uint32_t t0 = millis();
+    while (logTail != logHead.load() && millis()-t0 < timeout) delay(10);
+    fflush(stdout);
+}
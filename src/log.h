@@ -0,0 +1,46 @@
+// ESP32 Secure Base - asynchronous logging
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// Log messages are formatted by the caller into a slot of a lock-free multi-producer ring buffer
+// and written out by a low-priority task, so the network callbacks never wait for the UART.
+// Messages above ESB_LOG_LEVEL are compiled out. If the ring is full messages are dropped and
+// counted rather than blocking. Logging from ISRs is not supported.
+
+#pragma once
+#include <Arduino.h>
+#include <atomic>
+
+#define ESB_LOG_NONE  0
+#define ESB_LOG_ERROR 1
+#define ESB_LOG_WARN  2
+#define ESB_LOG_INFO  3
+#define ESB_LOG_DEBUG 4
+
+#ifndef ESB_LOG_LEVEL
+#define ESB_LOG_LEVEL ESB_LOG_INFO
+#endif
+#ifndef ESB_LOG_SLOTS
+#define ESB_LOG_SLOTS 32 // number of messages the ring holds, must be a power of two
+#endif
+#ifndef ESB_LOG_LINE
+#define ESB_LOG_LINE 100 // max length of a message, longer ones are truncated
+#endif
+
+#define ESB_LOGE(...) do { if (ESB_LOG_LEVEL >= ESB_LOG_ERROR) esbLog(ESB_LOG_ERROR, __VA_ARGS__); } while (0)
+#define ESB_LOGW(...) do { if (ESB_LOG_LEVEL >= ESB_LOG_WARN) esbLog(ESB_LOG_WARN, __VA_ARGS__); } while (0)
+#define ESB_LOGI(...) do { if (ESB_LOG_LEVEL >= ESB_LOG_INFO) esbLog(ESB_LOG_INFO, __VA_ARGS__); } while (0)
+#define ESB_LOGD(...) do { if (ESB_LOG_LEVEL >= ESB_LOG_DEBUG) esbLog(ESB_LOG_DEBUG, __VA_ARGS__); } while (0)
+
+// esbLog queues a message, the output task is started on first use.
+extern void esbLog(uint8_t level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// esbLogMqtt additionally publishes messages at or below level on <mqTopic>/log, batching
+// as many as fit into one message. ESB_LOG_NONE turns it off.
+extern void esbLogMqtt(uint8_t level);
+
+// esbLogFlush waits up to timeout milliseconds for queued messages to be written, useful
+// before restarting.
+extern void esbLogFlush(uint32_t timeout = 200);
+
+// esbLogDropped counts the messages dropped because the ring was full, in any task.
+extern std::atomic<uint32_t> esbLogDropped;
@@ -0,0 +1,94 @@
+// ESP32 Secure Base - lock-free mailbox between tasks
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+
+// messages are 8-byte aligned so the padding at the end of the ring always has room for the
+// stamp and the size
+#define MAIL_ALIGN 8
+
+ESBMailbox::ESBMailbox(uint16_t size)
+  : _ring(NULL)
+  , _task(NULL)
+  , _head(0)
+  , _tail(0)
+  , _dropped(0)
+{
+    uint32_t n = 64;
+    while (n < size && n < 0x8000) n *= 2;
+    _mask = n-1;
+}
+
+bool ESBMailbox::begin() {
+    // the ring must start out zeroed, see done()
+    if (!_ring) _ring = (uint8_t *)calloc(_mask+1, 1);
+    return _ring != NULL;
+}
+
+bool ESBMailbox::post(uint8_t type, uint8_t arg, const void *a, size_t alen,
+        const void *b, size_t blen)
+{
+    uint32_t size = _mask+1;
+    if (!_ring || alen+blen > size) {
+        _dropped++;
+        return false;
+    }
+    uint32_t need = (sizeof(ESBMail) + alen+1 + blen+1 + MAIL_ALIGN-1) & ~(MAIL_ALIGN-1);
+
+    // reserve need bytes, plus the rest of the ring if the message would wrap
+    uint32_t h = _head.load(std::memory_order_relaxed);
+    uint32_t pad;
+    do {
+        uint32_t off = h & _mask;
+        pad = off+need > size ? size-off : 0;
+        if (h+pad+need - _tail.load(std::memory_order_acquire) > size) {
+            _dropped++;
+            return false;
+        }
+    } while (!_head.compare_exchange_weak(h, h+pad+need,
+                std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    if (pad) {
+        ESBMail *p = (ESBMail *)(_ring + (h & _mask));
+        p->size = pad;
+        p->type = ESB_MAIL_PAD;
+        p->stamp.store(h+1, std::memory_order_release);
+        h += pad;
+    }
+    ESBMail *m = (ESBMail *)(_ring + (h & _mask));
+    m->size = need;
+    m->type = type;
+    m->arg = arg;
+    m->alen = alen;
+    m->blen = blen;
+    if (alen) memcpy(m->a(), a, alen);
+    m->a()[alen] = 0;
+    if (blen) memcpy(m->b(), b, blen);
+    m->b()[blen] = 0;
+    m->stamp.store(h+1, std::memory_order_release);
+
+    TaskHandle_t task = _task;
+    if (task && task != xTaskGetCurrentTaskHandle()) xTaskNotifyGive(task);
+    return true;
+}
+
+ESBMail *ESBMailbox::get() {
+    _task = xTaskGetCurrentTaskHandle();
+    if (!_ring) return NULL;
+    for (;;) {
+        uint32_t t = _tail.load(std::memory_order_relaxed);
+        ESBMail *m = (ESBMail *)(_ring + (t & _mask));
+        // a message that has been reserved but not stamped yet ends the batch
+        if (m->stamp.load(std::memory_order_acquire) != t+1) return NULL;
+        if (m->type != ESB_MAIL_PAD) return m;
+        done(m);
+    }
+}
+
+// done zeroes the message before handing the space back, this way a header that is reserved
+// but not written yet never carries a stale stamp.
+void ESBMailbox::done(ESBMail *m) {
+    uint32_t size = m->size;
+    memset((void *)m, 0, size);
+    _tail.store(_tail.load(std::memory_order_relaxed)+size, std::memory_order_release);
+}
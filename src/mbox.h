@@ -0,0 +1,57 @@
+// ESP32 Secure Base - lock-free mailbox between tasks
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// ESBMailbox passes variable-length messages from any number of tasks to one consumer task
+// through a byte ring without taking a lock. A producer reserves space by advancing the head
+// using compare-and-swap, copies its message in, and then publishes it by stamping the header
+// with the message's position. The consumer takes messages in reservation order and stops at one
+// that hasn't been stamped yet, and clears what it consumed so stale bytes never look like a
+// stamp. A message never wraps around the end of the ring, a producer that would have to wrap
+// pads the end instead. When the ring is full post() fails and the message is counted as dropped.
+// Each message consists of a type, a one-byte argument, and two parts, each of which is followed
+// by a NUL so strings can be used in-place. Posting notifies the consumer task (the last task
+// that called get()), so a consumer blocked in ulTaskNotifyTake or ESBTimers::wait wakes up.
+
+#include <Arduino.h>
+#include <atomic>
+
+#define ESB_MAIL_PAD 0 // message type that skips to the start of the ring
+
+struct ESBMail {
+    std::atomic<uint32_t> stamp; // position+1, stored last to publish the message
+    uint16_t size;               // bytes in the ring incl. header and alignment
+    uint8_t  type;
+    uint8_t  arg;
+    uint16_t alen;               // length of the first part
+    uint16_t blen;               // length of the second part
+
+    char *a() { return (char *)(this+1); }
+    char *b() { return a()+alen+1; }
+};
+
+class ESBMailbox {
+public:
+    // size is the number of bytes in the ring, it is rounded up to a power of two.
+    ESBMailbox(uint16_t size);
+
+    // begin allocates the ring, returns false if out of memory.
+    bool begin();
+
+    // post copies a message into the mailbox, returns false if it doesn't fit.
+    bool post(uint8_t type, uint8_t arg, const void *a, size_t alen,
+            const void *b = NULL, size_t blen = 0);
+
+    // get returns the next message or NULL, done() releases it, consumer only.
+    ESBMail *get();
+    void done(ESBMail *m);
+
+    uint32_t dropped() { return _dropped; }
+
+//private:
+    uint8_t    *_ring;
+    uint32_t   _mask;
+    volatile TaskHandle_t _task; // consumer
+    std::atomic<uint32_t> _head; // next position to be reserved by a producer
+    std::atomic<uint32_t> _tail; // next position to be consumed
+    volatile uint32_t _dropped;
+};
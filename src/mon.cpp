@@ -0,0 +1,179 @@
+// ESP32 Secure Base - heap and stack monitor
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+#include <esp_attr.h>
+#include <esp_heap_caps.h>
+
+#define MON_MAGIC 0x4d4f4e31 // "MON1"
+#define MON_SAMPLE_MS 1000   // interval at which metrics are sampled
+#define MON_MSG 768          // max size of a metrics message
+
+// alarm bits
+#define MON_FREE  1
+#define MON_BLOCK 2
+#define MON_LOW   4
+#define MON_STACK 8
+
+uint32_t monMinFree = 20000;
+uint32_t monMinBlock = 8192;
+uint32_t monMinLow = 10000;
+uint32_t monMinStack = 512;
+DVW(monMinFree);
+DVW(monMinBlock);
+DVW(monMinLow);
+DVW(monMinStack);
+
+static ESBMonSnapshot monCur;                  // latest sample
+static RTC_NOINIT_ATTR ESBMonSnapshot monPrev; // taken right before the last restart
+static bool monPrevValid = false;
+static bool monPrevSent = false;
+static uint8_t monAlarms = 0;    // metrics currently below their threshold
+static bool monAlarmNew = false; // an alarm was raised since the last publish
+
+// the metrics can also be shown and traced as debug variables
+static ESBVar __heapFree("heapFree", monCur.heapFree);
+static ESBVar __heapBlock("heapBlock", monCur.heapBlock);
+static ESBVar __heapLow("heapLow", monCur.heapLow);
+
+//===== sampling
+
+// tasks looked up by name if the FreeRTOS trace facility is not available
+static const char *monTaskNames[] = {
+    "loopTask", "async_tcp", "esb_log", "esb_cli", "esp_timer", "tiT", "wifi", "IDLE0", "IDLE1",
+};
+
+static void monAddTask(ESBMonSnapshot &s, const char *name, uint32_t stack) {
+    if (s.numTasks >= ESB_MON_TASKS) return;
+    ESBMonTask &t = s.tasks[s.numTasks++];
+    strncpy(t.name, name, sizeof(t.name)-1);
+    t.name[sizeof(t.name)-1] = 0;
+    t.stack = stack > 0xffff ? 0xffff : stack;
+}
+
+static void monSample(ESBMonSnapshot &s) {
+    s.at = millis();
+    s.heapFree = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    s.heapBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    s.heapLow = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    s.numTasks = 0;
+#if configUSE_TRACE_FACILITY
+    // returns 0 if there are more than ESB_MON_TASKS tasks, then fall back to the list of names
+    static TaskStatus_t status[ESB_MON_TASKS];
+    int n = uxTaskGetSystemState(status, ESB_MON_TASKS, NULL);
+    for (int i=0; i<n; i++) monAddTask(s, status[i].pcTaskName, status[i].usStackHighWaterMark);
+#endif
+    if (s.numTasks > 0) return;
+    for (int i=0; i<(int)(sizeof(monTaskNames)/sizeof(monTaskNames[0])); i++) {
+        TaskHandle_t h = xTaskGetHandle(monTaskNames[i]);
+        if (h) monAddTask(s, monTaskNames[i], uxTaskGetStackHighWaterMark(h));
+    }
+}
+
+// monCheck raises the alarm bit if val is below min and clears it once val has recovered by
+// an eighth of min, so a metric hovering around its threshold doesn't flood the log.
+static void monCheck(uint8_t bit, const char *what, uint32_t val, uint32_t min) {
+    if (val < min && !(monAlarms & bit)) {
+        monAlarms |= bit;
+        monAlarmNew = true;
+        ESB_LOGW("MON: %s %u below %u\n", what, val, min);
+    } else if (val >= min + min/8) {
+        monAlarms &= ~bit;
+    }
+}
+
+static void monCheckAll(ESBMonSnapshot &s) {
+    monCheck(MON_FREE, "free heap", s.heapFree, monMinFree);
+    monCheck(MON_BLOCK, "largest free block", s.heapBlock, monMinBlock);
+    monCheck(MON_LOW, "lowest free heap", s.heapLow, monMinLow);
+    int low = -1;
+    for (int i=0; i<s.numTasks; i++) {
+        if (low < 0 || s.tasks[i].stack < s.tasks[low].stack) low = i;
+    }
+    if (low >= 0) monCheck(MON_STACK, s.tasks[low].name, s.tasks[low].stack, monMinStack);
+}
+
+void monSnapshot(const char *reason) {
+    monSample(monPrev);
+    strncpy(monPrev.reason, reason, sizeof(monPrev.reason)-1);
+    monPrev.reason[sizeof(monPrev.reason)-1] = 0;
+    monPrev.magic = MON_MAGIC;
+}
+
+//===== reporting
+
+static int monJson(char *buf, int size, const ESBMonSnapshot &s, bool prev) {
+    int len = snprintf(buf, size, "{\"uptime\":%u,\"heap_free\":%u,\"heap_block\":%u,"
+            "\"heap_low\":%u", s.at/1000, s.heapFree, s.heapBlock, s.heapLow);
+    if (prev) len += snprintf(buf+len, size-len, ",\"restart\":\"%s\"", s.reason);
+    else len += snprintf(buf+len, size-len, ",\"alarms\":%u", monAlarms);
+    len += snprintf(buf+len, size-len, ",\"stacks\":{");
+    for (int i=0; i<s.numTasks && len < size-30; i++) {
+        len += snprintf(buf+len, size-len, "%s\"%s\":%u", i ? "," : "", s.tasks[i].name,
+                s.tasks[i].stack);
+    }
+    len += snprintf(buf+len, size-len, "}}");
+    return len < size ? len : size-1;
+}
+
+static void monPublish(const ESBMonSnapshot &s, bool prev) {
+    static char msg[MON_MSG];
+    int len = monJson(msg, sizeof(msg), s, prev);
+    static ESBTopic topic = ESB_TOPIC_NONE;
+    mqttPublish(mqttTopicOnce(topic, "/metrics", true), 0, false, msg, len);
+}
+
+static void monPrint(const ESBMonSnapshot &s) {
+    printf("  heap free %u (alarm <%u), largest block %u (<%u), lowest %u (<%u)\n",
+            s.heapFree, monMinFree, s.heapBlock, monMinBlock, s.heapLow, monMinLow);
+    printf("  stack never used (alarm <%u):", monMinStack);
+    for (int i=0; i<s.numTasks; i++) {
+        printf("%s %s:%u", i%5 ? "" : "\n   ", s.tasks[i].name, s.tasks[i].stack);
+    }
+    printf("\n");
+}
+
+void monLoop() {
+    static uint32_t lastSample = 0, lastPublish = 0;
+    static bool first = true;
+    if (first) {
+        first = false;
+        // RTC memory is random after power-up, the magic tells whether it's a snapshot
+        monPrevValid = monPrev.magic == MON_MAGIC;
+        monPrev.magic = 0;
+        if (monPrevValid) {
+            if (monPrev.numTasks > ESB_MON_TASKS) monPrev.numTasks = ESB_MON_TASKS;
+            ESB_LOGW("MON: restarted by %s after %us: heap free %u, block %u, lowest %u\n",
+                    monPrev.reason, monPrev.at/1000, monPrev.heapFree, monPrev.heapBlock,
+                    monPrev.heapLow);
+        }
+    }
+    if (lastSample == 0 || millis() - lastSample >= MON_SAMPLE_MS) {
+        monSample(monCur);
+        monCheckAll(monCur);
+        lastSample = millis();
+    }
+
+    if (!mqttClient.connected()) return;
+    if (monPrevValid && !monPrevSent) {
+        monPublish(monPrev, true);
+        monPrevSent = true;
+    }
+    if (monAlarmNew || millis() - lastPublish >= ESB_MON_PUBLISH_MS) {
+        monPublish(monCur, false);
+        monAlarmNew = false;
+        lastPublish = millis();
+    }
+}
+
+//===== debug command
+
+static void cmdDebugMon(ESBArgs &args) {
+    printf("== Monitor (%ds ago):\n", (millis()-monCur.at)/1000);
+    monPrint(monCur);
+    if (monPrevValid) {
+        printf("== Before restart by %s after %us:\n", monPrev.reason, monPrev.at/1000);
+        monPrint(monPrev);
+    }
+}
+ESB_CMD(debug, mon, cmdDebugMon, "");
@@ -0,0 +1,42 @@
+// ESP32 Secure Base - heap and stack monitor
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// monLoop samples free heap, largest free block, minimum-ever free heap, and the stack
+// high-water mark of every task once a second. Each metric has a threshold, writable using
+// "debug set", and crossing it logs a warning once until the metric recovers. The metrics are
+// published periodically as JSON on <mqTopic>/metrics and "debug mon" prints them.
+// monSnapshot saves the metrics into RTC memory that survives a software restart, the next
+// boot logs and publishes the snapshot so the state that led to the restart is not lost.
+
+#include <Arduino.h>
+
+#ifndef ESB_MON_TASKS
+#define ESB_MON_TASKS 24          // max number of tasks tracked
+#endif
+#ifndef ESB_MON_PUBLISH_MS
+#define ESB_MON_PUBLISH_MS 60000  // interval at which metrics are published
+#endif
+
+struct ESBMonTask {
+    char     name[12];
+    uint16_t stack;    // high-water mark: stack bytes never used
+};
+
+struct ESBMonSnapshot {
+    uint32_t magic;    // marks a valid snapshot in RTC memory
+    uint32_t at;       // millis() when taken
+    char     reason[16];
+    uint32_t heapFree;
+    uint32_t heapBlock;
+    uint32_t heapLow;
+    uint8_t  numTasks;
+    ESBMonTask tasks[ESB_MON_TASKS];
+};
+
+// thresholds in bytes, an alarm is raised when a metric falls below
+extern uint32_t monMinFree, monMinBlock, monMinLow, monMinStack;
+
+// monLoop samples and publishes the metrics, it is called from mqttLoop.
+extern void monLoop();
+// monSnapshot saves the current metrics so they can be reported after a restart.
+extern void monSnapshot(const char *reason);
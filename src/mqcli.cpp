@@ -0,0 +1,165 @@
+// ESP32 Secure Base - command line over MQTT
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// Commands arrive on <mqTopic>/cli/in as "<id> <command line>" and are run from mqttLoop using
+// the same command table as the serial CLI. Everything the command prints to stdout is captured,
+// up to ESB_CLI_OUT bytes, and once the command is done published on <mqTopic>/cli/out as one
+// message, or as a few if it exceeds ESB_CLI_CHUNK bytes. Each response message starts with a
+// header line "<id> <seq><more>" where seq counts from 0 and more is '+' if further messages
+// follow and '.' for the last one. Messages the ESB_LOG macros produce while the command runs
+// go to the log task and the serial port as usual, they are not part of the response.
+
+#include <ESPSecureBase.h>
+
+#ifndef ESB_CLI_CHUNK
+#define ESB_CLI_CHUNK 1024 // max size of a response message
+#endif
+#ifndef ESB_CLI_OUT
+#define ESB_CLI_OUT 4096 // max response size, the rest of the output is dropped
+#endif
+#ifndef ESB_CLI_ACK_WAIT
+#define ESB_CLI_ACK_WAIT 2000 // ms to wait for the in-flight window to open
+#endif
+#define CLI_RETRY 50       // ms between attempts to publish while the window is full
+#define CLI_ID_LEN 16      // max length of the correlation id
+#define CLI_LINE_LEN 256   // max length of a command line
+
+static bool cliEnabled = false;
+static char cliLine[CLI_LINE_LEN]; // pending command, written by the MQTT callback
+static char cliId[CLI_ID_LEN+1];   // id of pending command
+static volatile bool cliPending = false; // set until the response is sent
+static bool cliSending = false;          // command done, response being published
+
+// response being captured and sent
+static char *cliOutBuf;        // output of the command, ESB_CLI_OUT bytes allocated with cliOut
+static int cliOutLen;          // bytes in cliOutBuf
+static int cliSent;            // bytes of cliOutBuf published so far
+static int cliSeq;             // sequence number of the next message
+static uint32_t cliProgress;   // millis() when the last message was published
+static char cliBuf[ESB_CLI_CHUNK]; // message being published
+static FILE *cliOut;           // stream that captures stdout while a command runs
+
+static void cliSend(void *);
+static ESBTimer cliSendTimer(cliSend);
+
+// cliInTopic and cliOutTopic return the handles of <mqTopic>/cli/in and <mqTopic>/cli/out.
+static ESBTopic cliInTopic() {
+    static ESBTopic topic = ESB_TOPIC_NONE;
+    return mqttTopicOnce(topic, "/cli/in");
+}
+
+static ESBTopic cliOutTopic() {
+    static ESBTopic topic = ESB_TOPIC_NONE;
+    return mqttTopicOnce(topic, "/cli/out");
+}
+
+// cliWrite is the write function of cliOut, it appends to the response, the command runs with
+// the config lock held so nothing is published until it's done.
+static int cliWrite(void *cookie, const char *data, int len) {
+    int n = len;
+    if (n > ESB_CLI_OUT-cliOutLen) n = ESB_CLI_OUT-cliOutLen;
+    memcpy(cliOutBuf+cliOutLen, data, n);
+    cliOutLen += n;
+    return len;
+}
+
+// cliSend publishes the response messages that fit into the in-flight window. It runs in the
+// task that runs esbTimers and retries from cliSendTimer while the window is full rather than
+// blocking, so the retransmit and keep-alive timers keep running.
+static void cliSend(void *) {
+    while (cliSending) {
+        int n = cliOutLen-cliSent;
+        int hdr = snprintf(cliBuf, sizeof(cliBuf), "%s %d+\n", cliId, cliSeq);
+        if (n > (int)sizeof(cliBuf)-hdr) n = sizeof(cliBuf)-hdr;
+        bool last = cliSent+n == cliOutLen;
+        if (last) cliBuf[hdr-2] = '.';
+        memcpy(cliBuf+hdr, cliOutBuf+cliSent, n);
+        if (!mqttPublish(cliOutTopic(), 1, false, cliBuf, hdr+n)) {
+            if (mqttClient.connected() && millis()-cliProgress < ESB_CLI_ACK_WAIT) {
+                esbTimers.start(cliSendTimer, CLI_RETRY);
+                return;
+            }
+            ESB_LOGW("MQTT CLI: no acknowledgement, dropping output\n");
+            cliSending = cliPending = false;
+            return;
+        }
+        cliSent += n;
+        cliSeq++;
+        cliProgress = millis();
+        if (last) cliSending = cliPending = false;
+    }
+}
+
+// mqcliMessage handles a message on <mqTopic>/cli/in, it runs in the AsyncTCP task and only
+// queues the command, returns false if the topic is not the CLI's.
+bool mqcliMessage(const char *topic, const char *payload, size_t len, size_t total) {
+    if (!cliEnabled) return false;
+    if (!mqttTopicIs(cliInTopic(), topic)) return false;
+    if (len != total || len >= CLI_LINE_LEN) {
+        ESB_LOGW("MQTT CLI: command too long (%d bytes)\n", total);
+        return true;
+    }
+    if (cliPending) {
+        ESB_LOGW("MQTT CLI: busy, dropping command\n");
+        return true;
+    }
+    // split off the id
+    const char *sp = (const char *)memchr(payload, ' ', len);
+    int idLen = sp ? sp-payload : len;
+    if (idLen > CLI_ID_LEN) idLen = CLI_ID_LEN;
+    memcpy(cliId, payload, idLen);
+    cliId[idLen] = 0;
+    int lineLen = 0;
+    if (sp) {
+        lineLen = len-(sp+1-payload);
+        memcpy(cliLine, sp+1, lineLen);
+    }
+    cliLine[lineLen] = 0;
+    cliPending = true;
+    esbTimers.wake(); // mqttLoop runs the command
+    return true;
+}
+
+// mqcliLoop runs a pending command with stdout redirected into the response and starts
+// publishing it. Stdout is per-task, so only output produced by the command itself is captured.
+// cliPending stays set until the response is sent, so commands that arrive meanwhile are dropped.
+void mqcliLoop() {
+    if (!cliPending || cliSending) return;
+    ESB_ALLOC_SCOPE(mqcli, true);
+    ESB_LOGI("MQTT CLI: %s: %s\n", cliId, cliLine);
+    if (!cliOut) {
+        ESB_ALLOC_SCOPE(mqcliInit, false);
+        cliOutBuf = (char *)malloc(ESB_CLI_OUT);
+        if (cliOutBuf) cliOut = funopen(NULL, NULL, cliWrite, NULL, NULL);
+        if (!cliOut) {
+            ESB_LOGE("MQTT CLI: cannot open output stream\n");
+            free(cliOutBuf);
+            cliOutBuf = NULL;
+            cliPending = false;
+            return;
+        }
+        setvbuf(cliOut, NULL, _IONBF, 0); // cliOutBuf is the buffer
+    }
+    cliOutLen = 0;
+    FILE *saved = stdout;
+    stdout = cliOut;
+    {
+        ESB_CONFIG_LOCK(); // the serial CLI may be running a command too
+        ESBCmd::exec(cliLine);
+    }
+    fflush(stdout);
+    stdout = saved;
+    if (cliOutLen == ESB_CLI_OUT) ESB_LOGW("MQTT CLI: output truncated to %d bytes\n", ESB_CLI_OUT);
+    cliSent = 0;
+    cliSeq = 0;
+    cliProgress = millis();
+    cliSending = true;
+    cliSend(NULL);
+}
+
+void mqttEnableCLI(bool enable) {
+    if (enable == cliEnabled) return;
+    cliEnabled = enable;
+    if (enable) mqttAddSubscription(cliInTopic(), 1);
+    else mqttRemoveSubscription(cliInTopic());
+}
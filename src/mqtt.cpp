@@ -9,60 +9,129 @@ static ESBConfig *config;
 char mqTopic[65];   // main topic prefix for pub&sub, init'd as mqIdent with sub - with /
 int mqTopicLen = 0; // strlen(mqTopic)
 
-// keep-alive stuff
+// keep-alive stuff: we ping ourselves when the connection has been quiet for MQ_TIMEOUT/2,
+// reconnect when it has been quiet for MQ_TIMEOUT, and restart when no ping response arrived
+// for 20*MQ_TIMEOUT. The ping response and the connection restart the timers.
 #define MQ_TIMEOUT (60*1000)    // in milliseconds
-static uint32_t mqLast = 0x100000; // when we last received something
+#define MQ_RETRY 10000          // interval between connection attempts
+#define MQ_RECONNECT 1000       // delay before reconnecting after losing the connection
+#define MQ_WIFI_POLL 1000       // interval at which we check for WiFi while it's not connected
 static uint32_t mqPing = 0;     // when we last sent a ping
-static uint32_t mqPingRx = 0;     // when we last received a ping response
 uint32_t mqPingMs = 0;   // timeing of last ping
+static uint32_t mqConnectStart; // when the current connection attempt started
+// connection attempt in progress, see broker.h. The connect and disconnect callbacks in the
+// AsyncTCP task and the timeout in the timer task race to end the attempt, whichever clears the
+// flag with exchange() does the accounting.
+static std::atomic<bool> mqConnecting(false);
 
-// helper to subscribe to our own pings
-static void mqttSubPing() {
-    char topic[75];
-    strcpy(topic, mqTopic);
-    strcat(topic, "/ping");
-    (void) mqttClient.subscribe(topic, 0);
+static void mqttRetry(void *);
+static void mqttKeepalive(void *);
+static void mqttSilence(void *);
+static void mqttWatchdog(void *);
+static void mqttConnectTimeout(void *);
+static ESBTimer mqRetryTimer(mqttRetry);         // connects while we're not connected
+static ESBTimer mqKeepaliveTimer(mqttKeepalive); // sends pings
+static ESBTimer mqSilenceTimer(mqttSilence);     // reconnects when the connection is dead
+static ESBTimer mqWatchdogTimer(mqttWatchdog);   // restarts when nothing helps
+static ESBTimer mqConnectTimer(mqttConnectTimeout); // gives up on a connection attempt
+ESBTimers *mqTimers = &esbTimers;                // wheel running the timers above
+
+// mqttAlive restarts the keep-alive timers when we heard from the broker.
+static void mqttAlive() {
+    mqTimers->start(mqKeepaliveTimer, MQ_TIMEOUT/2);
+    mqTimers->start(mqSilenceTimer, MQ_TIMEOUT);
+}
+
+// mqttPingTopic returns the handle of <mqTopic>/ping, where we ping ourselves
+static ESBTopic mqttPingTopic() {
+    static ESBTopic topic = ESB_TOPIC_NONE;
+    return mqttTopicOnce(topic, "/ping");
 }
 
 static void onMqttConnect(bool sessionPresent) {
-    printf("Connected to MQTT, session %spresent\n", sessionPresent?"":"not ");
-    mqLast = millis();
-    mqttSubPing();
+    ESB_NET_LOCK();
+    ESB_LOGI("Connected to MQTT, session %spresent\n", sessionPresent?"":"not ");
+    mqTimers->stop(mqRetryTimer);
+    mqTimers->stop(mqConnectTimer);
+    if (mqConnecting.exchange(false)) brokerConnected(millis() - mqConnectStart);
+    mqttAlive();
+    // subscribe before anything else can run so no message is missed
+    subsConnected();
+    flightConnected(sessionPresent);
+    bulkConnect();
+    netConnection(true, sessionPresent);
 }
 
 static void onMqttDisconnect(AsyncMqttClientDisconnectReason reason) {
-    printf("Disconnected from MQTT: %d\n", (int)reason);
+    ESB_NET_LOCK();
+    ESB_LOGW("Disconnected from MQTT: %d\n", (int)reason);
+    mqTimers->stop(mqKeepaliveTimer);
+    mqTimers->stop(mqSilenceTimer);
+    if (mqConnecting.exchange(false)) {
+        // the attempt failed, try the next broker right away
+        mqTimers->stop(mqConnectTimer);
+        brokerFailed();
+        mqTimers->start(mqRetryTimer, brokerRetryMs());
+    } else if (!mqRetryTimer.active()) {
+        mqTimers->start(mqRetryTimer, MQ_RECONNECT);
+    }
+    subsDisconnected();
+    netConnection(false, false);
 }
 
-// onMqttMessage handles the ping response messages
-static void onMqttMessage(char* topic, char* payload, MqttProps properties,
+PROF_DEF(mqttMessage);
+
+// mqttReceive handles the ping response messages and passes the rest on to the CLI or the
+// application. A message that arrives in pieces is reassembled first so the duplicate check,
+// decompression, and the handlers all see the complete payload.
+void mqttReceive(const char *topic, const char *payload, MqttProps properties,
     size_t len, size_t index, size_t total)
 {
+    ESB_NET_LOCK();
+    PROF(mqttMessage);
+    ESB_ALLOC_SCOPE(mqttMessage, true);
     //printf("MQTT RCV %s qos=%d dup=%d retain=%d len=%d index=%d total=%d\n",
     //        topic, properties.qos, properties.dup, properties.retain, len, index, total);
 
-    if (strlen(topic) == mqTopicLen+5 &&
-            strncmp(topic, mqTopic, mqTopicLen) == 0 &&
-            strcmp(topic+mqTopicLen, "/ping") == 0)
-    {
-        mqLast = millis();
-        mqPingRx = mqLast;
-        mqPingMs = mqLast-mqPing;
-	printf("Ping response in %ums\n", mqLast-mqPing);
+    payload = netReassemble(topic, payload, len, index, total);
+    if (!payload) return;
+    len = total;
+    if (flightDuplicate(topic, payload, len, properties)) {
+        ESB_LOGW("MQTT: dropped duplicate message on %s\n", topic);
+        return;
+    }
+    if (zipReceived(payload, len)) {
+        payload = zipUnpack(payload, len);
+        if (!payload) {
+            ESB_LOGW("MQTT: cannot decompress message on %s\n", topic);
+            return;
+        }
+    }
+
+    if (mqttTopicIs(mqttPingTopic(), topic)) {
+        mqPingMs = millis()-mqPing;
+	ESB_LOGI("Ping response in %ums\n", mqPingMs);
+        mqttAlive();
+        mqTimers->start(mqWatchdogTimer, 20*MQ_TIMEOUT);
+    } else if (!mqcliMessage(topic, payload, len, len) &&
+            !fleetMessage(topic, payload, len, len)) {
+        netMessage(topic, payload, len, properties);
     }
 }
 
+static void onMqttMessage(char* topic, char* payload, MqttProps properties,
+    size_t len, size_t index, size_t total)
+{
+    mqttReceive(topic, payload, properties, len, index, total);
+}
+
 void mqttSetTopic(char *topic) {
-    if (mqTopicLen != 0) {
-        char topic[75];
-        strcpy(topic, mqTopic);
-        strcat(topic, "/ping");
-        (void) mqttClient.unsubscribe(topic);
-    }
+    if (mqTopicLen != 0) subsUnsubscribe();
     strncpy(mqTopic, topic, sizeof(mqTopic));
     mqTopic[sizeof(mqTopic)-1] = 0;
     mqTopicLen = strlen(mqTopic);
-    if (mqttClient.connected()) mqttSubPing();
+    topicRebuild();
+    subsResend();
 }
 
 void mqttSetup(ESBConfig &c) {
@@ -71,60 +140,126 @@ void mqttSetup(ESBConfig &c) {
     mqttClient.onConnect(onMqttConnect);
     mqttClient.onDisconnect(onMqttDisconnect);
     mqttClient.onMessage(onMqttMessage);
-    mqPingRx = millis();
+    mqttClient.onSubscribe(subsAck);
+    mqttClient.onPublish(flightAck);
+    mqttAddSubscription(mqttPingTopic(), 0);
+    mqTimers->start(mqWatchdogTimer, 20*MQ_TIMEOUT);
+    mqTimers->start(mqRetryTimer, 0);
 }
 
-void mqttConnect() {
-    if (mqttClient.connected()) {
-        mqttClient.disconnect();
-        delay(100); // give LwIP some time to do something?
-    }
-    // config server and security
-    uint16_t port = (uint16_t)atoi(config->mqtt_port);
-    mqttClient.setServer(config->mqtt_server, port);
+ESBConfig *mqttConfig() { return config; }
+
+// mqttConfigure picks the broker and sets the server, credentials, and base topic from the
+// config.
+void mqttConfigure(ESBConfig &config) {
+    brokerSetup(config);
+    ESBBroker &b = brokerPick();
+    mqttClient.setServer(b.host, b.port);
     mqttClient.setSecure(true);
 
-    char psk[5]; strncpy(psk, config->mqtt_psk, 4); psk[4] = 0;
-    printf("MQTT connecting to %s:%d (%s,%s...)\n",
-            config->mqtt_server, port, config->mqtt_ident, psk);
-    mqttClient.setPsk(config->mqtt_ident, config->mqtt_psk);
+    char psk[5]; strncpy(psk, config.mqtt_psk, 4); psk[4] = 0;
+    ESB_LOGI("MQTT connecting to %s:%d (%s,%s...)\n", b.host, b.port, config.mqtt_ident, psk);
+    mqttClient.setPsk(config.mqtt_ident, config.mqtt_psk);
+    bulkConfigure(config);
     // config base topic
     if (mqTopicLen == 0) {
         char topic[41];
-        strcpy(topic, config->mqtt_ident);
+        strcpy(topic, config.mqtt_ident);
         // replace '-' by '/'
         for (char *dash=strchr(topic, '-'); dash; dash=strchr(dash, '-')) *dash = '/';
         mqttSetTopic(topic);
     }
+}
 
+void mqttConnect() {
+    if (netRemote()) {
+        netPost(NET_CONNECT, 0, NULL, 0);
+        return;
+    }
+    ESB_LATENCY(mqttConnect, 5000);
+    ESB_ALLOC_SCOPE(mqttConnect, false);
+    bulkDisconnect();
+    if (mqttClient.connected()) {
+        mqttClient.disconnect();
+        delay(100); // give LwIP some time to do something?
+    }
+    mqttConfigure(*config);
+    mqConnectStart = millis();
+    mqConnecting = true;
+    mqTimers->start(mqConnectTimer, ESB_BROKER_CONNECT);
     mqttClient.connect();
 }
 
-void mqttLoop() {
-    if (millis() - mqPingRx > 20*MQ_TIMEOUT) {
-        printf("*** No MQTT response in %d seconds - resetting\n",  (millis()-mqPingRx)/1000);
-        ESP.restart();
+static void mqttConnectTimeout(void *) {
+    if (!mqConnecting.exchange(false)) return;
+    ESB_LOGW("MQTT: no connection in %dms\n", ESB_BROKER_CONNECT);
+    brokerFailed();
+    mqttClient.disconnect(true);
+    mqTimers->start(mqRetryTimer, brokerRetryMs());
+}
+
+static void mqttRetry(void *) {
+    if (mqttClient.connected() || mqConnecting) return; // mqttConnectTimeout restarts us
+    if (!WiFi.isConnected()) {
+        mqTimers->start(mqRetryTimer, MQ_WIFI_POLL);
+        return;
     }
-    if (!WiFi.isConnected()) return;
-    if (!mqttClient.connected()) {
-        if (millis() - mqLast > 10000) {
-            mqttConnect();
-            mqLast = millis();
-        }
-    } else if (millis() - mqLast > MQ_TIMEOUT) {
-        //printf("Reconnecting to MQTT\n");
-        mqttConnect();
-        mqLast = millis();
-    } else if (millis() - mqLast > MQ_TIMEOUT/2 && millis() - mqPing > MQ_TIMEOUT/2) {
-        char topic[41+6];
-        strcpy(topic, mqTopic);
-        strcat(topic, "/ping");
-        char payload[32];
-        int l = snprintf(payload, sizeof(payload), "%lu", millis());
-        mqttClient.publish(topic, 0, false, payload, l);
-        printf("MQTT: ping sent to %s\n", topic);
-        mqPing = millis();
+    mqttConnect();
+    mqTimers->start(mqRetryTimer, MQ_RETRY);
+}
+
+static void mqttKeepalive(void *) {
+    ESB_ALLOC_SCOPE(keepalive, true);
+    if (!mqttClient.connected()) return;
+    char payload[32];
+    int l = snprintf(payload, sizeof(payload), "%lu", millis());
+    mqttPublish(mqttPingTopic(), 0, false, payload, l);
+    ESB_LOGI("MQTT: ping sent to %s\n", mqttTopicStr(mqttPingTopic()));
+    mqPing = millis();
+    mqTimers->start(mqKeepaliveTimer, MQ_TIMEOUT/2);
+}
+
+static void mqttSilence(void *) {
+    if (!mqttClient.connected() || !WiFi.isConnected()) return;
+    ESB_LOGW("MQTT: no response in %ds, reconnecting\n", MQ_TIMEOUT/1000);
+    brokerFailed(); // maybe another broker does better
+    mqttConnect();
+    mqTimers->start(mqSilenceTimer, MQ_TIMEOUT);
+}
+
+static void mqttWatchdog(void *) {
+    ESB_LOGE("*** No MQTT response in %d seconds - resetting\n", 20*MQ_TIMEOUT/1000);
+    monSnapshot("mqtt watchdog");
+    esbLogFlush();
+    ESP.restart();
+}
+
+// mqttMoveTimers hands the MQTT timers over to another wheel, i.e. to the network task.
+void mqttMoveTimers(ESBTimers &timers) {
+    ESBTimer *all[] = { &mqRetryTimer, &mqKeepaliveTimer, &mqSilenceTimer, &mqWatchdogTimer,
+        &mqConnectTimer, &flightTimer, &bulkRetryTimer, &brokerProbeTimer };
+    ESBTimers *old = mqTimers;
+    mqTimers = &timers;
+    for (ESBTimer *t : all) {
+        if (!t->active()) continue;
+        int32_t left = t->_expires - millis();
+        old->stop(*t);
+        timers.start(*t, left > 0 ? left : 0);
     }
-    return;
 }
 
+PROF_DEF(mqttLoop);
+
+void mqttLoop() {
+    latLoop();
+    PROF(mqttLoop);
+    ESB_LATENCY(mqttLoop, 10000);
+    esbTimers.run();
+    netLoop();
+    monLoop();
+    allocLoop();
+    if (!WiFi.isConnected()) return;
+    mqcliLoop();
+    fleetLoop();
+    traceLoop();
+}
@@ -5,11 +5,30 @@
 typedef struct AsyncMqttClientMessageProperties MqttProps;
 
 extern AsyncMqttClient mqttClient;
-extern char mqTopic[]; // main topic prefix for pub&sub, init'd as mqIdent with sub - with /
+extern char mqTopic[65]; // main topic prefix for pub&sub, init'd as mqIdent with sub - with /
 extern int mqTopicLen; // strlen(mqTopic)
 
 struct ESBConfig;
 extern void mqttSetup(ESBConfig &config);
 extern void mqttConnect(); // useful if config changed
+// mqttConfigure sets the server, credentials, and base topic without connecting.
+extern void mqttConfigure(ESBConfig &config);
+// mqttConfig returns the config passed to mqttSetup, NULL before.
+extern ESBConfig *mqttConfig();
+// mqttLoop runs the library's timers and background work, call it from loop(), which can then
+// sleep until there's more to do using esbTimers.wait().
 extern void mqttLoop();
 extern void mqttSetTopic(char *);
+// mqttReceive is the MQTT client's message callback, it reassembles messages that arrive in
+// pieces, decompresses them, and dispatches them. Tests call it to inject messages.
+extern void mqttReceive(const char *topic, const char *payload, MqttProps props, size_t len,
+        size_t index, size_t total);
+// mqttMoveTimers runs the MQTT timers on another wheel from now on, see netStart.
+class ESBTimers;
+extern void mqttMoveTimers(ESBTimers &timers);
+extern ESBTimers *mqTimers; // wheel running the MQTT timers, esbTimers or netTimers
+
+// remote command line on <mqTopic>/cli/in and <mqTopic>/cli/out, see mqcli.cpp
+extern void mqttEnableCLI(bool enable);
+extern bool mqcliMessage(const char *topic, const char *payload, size_t len, size_t total);
+extern void mqcliLoop();
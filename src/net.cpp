@@ -0,0 +1,235 @@
+// ESP32 Secure Base - network task
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+
+// inbound mailbox message types
+#define IN_MESSAGE    1 // arg: qos | dup<<2 | retain<<3, a: topic, b: payload
+#define IN_CONNECTION 2 // arg: connected | sessionPresent<<1
+#define IN_READY      3 // a: uint32_t ms
+
+TaskHandle_t netTask = NULL;
+ESBTimers netTimers;
+
+static ESBMailbox netOutbox(ESB_NET_OUTBOX); // requests to the esb_net task
+static ESBMailbox netInbox(ESB_NET_INBOX);   // messages and events to the application
+static ESBMailbox netParked(ESB_NET_PARKED); // QoS 1/2 publishes waiting for the window
+static ESBMessageFn netMessageFn = NULL;
+static ESBConnectionFn netConnectionFn = NULL;
+static ESBReadyFn netReadyFn = NULL;
+static SemaphoreHandle_t netMutex = NULL; // see ESBNetLock
+
+// message being reassembled by netMessage, the pieces of a message arrive in order and the
+// pieces of different messages don't interleave
+static char netMsgBuf[ESB_NET_MSG_MAX];
+static size_t netMsgLen; // bytes received so far
+
+ESBNetLock::ESBNetLock() {
+    if (netMutex) xSemaphoreTakeRecursive(netMutex, portMAX_DELAY);
+}
+
+ESBNetLock::~ESBNetLock() {
+    if (netMutex) xSemaphoreGiveRecursive(netMutex);
+}
+
+//===== network side
+
+// netRequest performs a request. A QoS 1/2 publish that doesn't fit into the in-flight window
+// is parked, as are the ones following it so they go out in order.
+static void netRequest(ESBMail *m) {
+    ESB_ALLOC_SCOPE(netRequest, true);
+    switch (m->type) {
+    case NET_PUBLISH:
+        if (m->arg & NET_PUB_BULK) {
+            bulkPublish(m->a(), m->arg & 3, m->arg & 4, m->b(), m->blen);
+            break;
+        }
+        if ((m->arg & 3) && (netParked.get() || flightFull(m->a(), m->blen))) {
+            netParked.post(m->type, m->arg, m->a(), m->alen, m->b(), m->blen);
+            break;
+        }
+        flightPublish(m->a(), m->arg & 3, m->arg & 4, m->b(), m->blen);
+        break;
+    case NET_SUBSCRIBE: {
+        ESB_ALLOC_NET();
+        mqttClient.subscribe(m->a(), m->arg);
+        break;
+    }
+    case NET_UNSUBSCRIBE: {
+        ESB_ALLOC_NET();
+        mqttClient.unsubscribe(m->a());
+        break;
+    }
+    case NET_CONNECT:
+        mqttConnect();
+        break;
+    case NET_SUBSCRIPTIONS:
+        subsSend();
+        break;
+    case NET_BULK:
+        if (m->arg) bulkConnect();
+        else bulkDisconnect();
+        break;
+    case NET_OTA: {
+        ESB_ALLOC_SCOPE(ota, false);
+        ESBOTA::begin(m->a(), m->alen);
+        break;
+    }
+    }
+}
+
+static void netRun(void *) {
+    uint32_t dropped = 0;
+    while (true) {
+        {
+            ESB_NET_LOCK();
+            netTimers.run();
+            // the parked publishes go first, flightAck wakes us up when the window opens
+            while (ESBMail *m = netParked.get()) {
+                if (flightFull(m->a(), m->blen)) break;
+                flightPublish(m->a(), m->arg & 3, m->arg & 4, m->b(), m->blen);
+                netParked.done(m);
+            }
+            while (ESBMail *m = netOutbox.get()) {
+                netRequest(m);
+                netOutbox.done(m);
+            }
+        }
+        uint32_t d = netOutbox.dropped() + netParked.dropped();
+        if (d != dropped) {
+            ESB_LOGW("NET: %u requests dropped\n", d-dropped);
+            dropped = d;
+        }
+        netTimers.wait();
+    }
+}
+
+bool netStart(int core) {
+    if (netTask) return true;
+    if (!netOutbox.begin() || !netParked.begin()) return false;
+    if (!netMutex) netMutex = xSemaphoreCreateRecursiveMutex();
+    if (!netMutex) return false;
+    if (xTaskCreatePinnedToCore(netRun, "esb_net", 4096, NULL, ESB_NET_PRIO, &netTask, core)
+            != pdPASS) {
+        return false;
+    }
+    mqttMoveTimers(netTimers);
+    ESB_LOGI("NET: network task running on core %d\n", core);
+    return true;
+}
+
+bool netPost(uint8_t type, uint8_t arg, const void *a, size_t alen, const void *b, size_t blen) {
+    return netOutbox.post(type, arg, a, alen, b, blen);
+}
+
+//===== outbound calls
+
+bool mqttPublish(const char *topic, uint8_t qos, bool retain, const char *payload, size_t len) {
+    if (!mqttClient.connected()) return false;
+    if (netRemote()) return netPost(NET_PUBLISH, qos | retain<<2, topic, strlen(topic), payload, len);
+    return flightPublish(topic, qos, retain, payload, len);
+}
+
+bool mqttSubscribe(const char *topic, uint8_t qos) {
+    if (!mqttClient.connected()) return false;
+    if (netRemote()) return netPost(NET_SUBSCRIBE, qos, topic, strlen(topic));
+    ESB_ALLOC_NET();
+    return mqttClient.subscribe(topic, qos) != 0;
+}
+
+bool mqttUnsubscribe(const char *topic) {
+    if (!mqttClient.connected()) return false;
+    if (netRemote()) return netPost(NET_UNSUBSCRIBE, 0, topic, strlen(topic));
+    ESB_ALLOC_NET();
+    return mqttClient.unsubscribe(topic) != 0;
+}
+
+bool mqttPublish(ESBTopic topic, uint8_t qos, bool retain, const char *payload, size_t len) {
+    ESBTopicStr s(topic);
+    if (!s.str || !*s.str) return false;
+    if (mqttBulk() && mqttTopicBulk(topic)) return bulkPublish(s.str, qos, retain, payload, len);
+    return mqttPublish(s.str, qos, retain, payload, len);
+}
+
+bool mqttSubscribe(ESBTopic topic, uint8_t qos) {
+    ESBTopicStr s(topic);
+    return s.str && *s.str && mqttSubscribe(s.str, qos);
+}
+
+bool mqttUnsubscribe(ESBTopic topic) {
+    ESBTopicStr s(topic);
+    return s.str && *s.str && mqttUnsubscribe(s.str);
+}
+
+//===== inbound messages and events
+
+void mqttOnMessage(ESBMessageFn fn) {
+    netInbox.begin();
+    netMessageFn = fn;
+}
+
+void mqttOnConnection(ESBConnectionFn fn) {
+    netInbox.begin();
+    netConnectionFn = fn;
+}
+
+void mqttOnReady(ESBReadyFn fn) {
+    netInbox.begin();
+    netReadyFn = fn;
+}
+
+// netReassemble runs in the AsyncTCP task, which hands over messages larger than its buffer in
+// pieces, these are reassembled in netMsgBuf.
+const char *netReassemble(const char *topic, const char *payload, size_t len, size_t index,
+        size_t total)
+{
+    if (len == total) return payload;
+    if (total > sizeof(netMsgBuf)) {
+        if (index == 0) ESB_LOGW("NET: message on %s too long (%d bytes)\n", topic, total);
+        return NULL;
+    }
+    if (index == 0) netMsgLen = 0;
+    if (index != netMsgLen) return NULL; // lost the start of the message
+    memcpy(netMsgBuf+index, payload, len);
+    netMsgLen += len;
+    return netMsgLen < total ? NULL : netMsgBuf;
+}
+
+// netMessage queues a complete received message for the application.
+void netMessage(const char *topic, const char *payload, size_t len, MqttProps props) {
+    if (!netMessageFn) return;
+    uint8_t arg = props.qos | props.dup<<2 | props.retain<<3;
+    netInbox.post(IN_MESSAGE, arg, topic, strlen(topic), payload, len);
+}
+
+void netConnection(bool connected, bool sessionPresent) {
+    if (netConnectionFn) netInbox.post(IN_CONNECTION, connected | sessionPresent<<1, NULL, 0);
+}
+
+void netReady(uint32_t ms) {
+    if (netReadyFn) netInbox.post(IN_READY, 0, &ms, sizeof(ms));
+}
+
+void netLoop() {
+    static uint32_t dropped = 0;
+    while (ESBMail *m = netInbox.get()) {
+        if (m->type == IN_MESSAGE && netMessageFn) {
+            MqttProps props;
+            props.qos = m->arg & 3;
+            props.dup = (m->arg & 4) != 0;
+            props.retain = (m->arg & 8) != 0;
+            netMessageFn(m->a(), m->b(), m->blen, props);
+        } else if (m->type == IN_CONNECTION && netConnectionFn) {
+            netConnectionFn(m->arg & 1, (m->arg & 2) != 0);
+        } else if (m->type == IN_READY && netReadyFn) {
+            uint32_t ms;
+            memcpy(&ms, m->a(), sizeof(ms));
+            netReadyFn(ms);
+        }
+        netInbox.done(m);
+    }
+    if (netInbox.dropped() != dropped) {
+        ESB_LOGW("NET: %u messages to the application dropped\n", netInbox.dropped()-dropped);
+        dropped = netInbox.dropped();
+    }
+}
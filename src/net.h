@@ -0,0 +1,111 @@
+// ESP32 Secure Base - network task
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// By default the MQTT and OTA callbacks run in the AsyncTCP task while mqttLoop, the CLI, and
+// the application run in other tasks, and all of them call into the MQTT client. netStart()
+// changes this: the esb_net task, pinned to the network core, takes over the MQTT timers and
+// makes all the MQTT client calls, and the rest of the system talks to it through lock-free
+// mailboxes (see mbox.h):
+// - mqttPublish, mqttSubscribe, mqttUnsubscribe, mqttConnect, and ESBOTA::begin called from
+//   another task post a request to the esb_net task and return right away,
+// - received messages and connection changes are posted to the application, mqttLoop passes them
+//   to the handlers registered with mqttOnMessage and mqttOnConnection.
+// The network side then never waits for the application, so CPU-heavy code can run on the other
+// core. The AsyncTCP task still runs the MQTT clients' callbacks and can preempt esb_net, so
+// esb_net makes its client calls and runs its timers holding the net lock, which the library's
+// MQTT callbacks take as well (ESB_NET_LOCK): a publish from esb_net never interleaves with a
+// callback handling the same client. Build AsyncTCP with
+// -DCONFIG_ASYNC_TCP_RUNNING_CORE=ESB_NET_CORE to keep the network work on one core.
+// Without netStart the functions below call the MQTT client directly and the handlers are
+// still called from mqttLoop.
+
+#include <Arduino.h>
+
+#ifndef ESB_NET_CORE
+#define ESB_NET_CORE 0     // core running WiFi and LwIP
+#endif
+#ifndef ESB_NET_PRIO
+#define ESB_NET_PRIO 3     // same as the AsyncTCP task
+#endif
+#ifndef ESB_NET_OUTBOX
+#define ESB_NET_OUTBOX 8192 // bytes of requests queued for the esb_net task
+#endif
+#ifndef ESB_NET_PARKED
+#define ESB_NET_PARKED 4096 // bytes of QoS 1/2 publishes waiting for the in-flight window
+#endif
+#ifndef ESB_NET_INBOX
+#define ESB_NET_INBOX 4096  // bytes of messages and events queued for the application
+#endif
+#ifndef ESB_NET_MSG_MAX
+#define ESB_NET_MSG_MAX 2048 // max size of a message that arrives in pieces and is reassembled
+#endif
+
+// netStart starts the esb_net task on core and moves the MQTT timers to it, call it in setup()
+// after mqttSetup(). Returns false if out of memory.
+extern bool netStart(int core = ESB_NET_CORE);
+// netTask is the esb_net task, NULL if netStart hasn't been called.
+extern TaskHandle_t netTask;
+// netTimers is the timer wheel run by the esb_net task.
+extern ESBTimers netTimers;
+
+// ESBNetLock holds the recursive net lock for the rest of the scope once netStart has been
+// called, it's a no-op before.
+class ESBNetLock {
+public:
+    ESBNetLock();
+    ~ESBNetLock();
+};
+#define ESB_NET_LOCK() ESBNetLock esbNetLock_
+
+// netRemote returns true if calls into the MQTT client have to be posted to the esb_net task.
+static inline bool netRemote() {
+    return netTask && xTaskGetCurrentTaskHandle() != netTask;
+}
+// netPost queues a request for the esb_net task, returns false if the outbox is full.
+extern bool netPost(uint8_t type, uint8_t arg, const void *a, size_t alen,
+        const void *b = NULL, size_t blen = 0);
+#define NET_PUBLISH     1 // arg: qos | retain<<2 | NET_PUB_BULK, a: topic, b: payload
+#define NET_SUBSCRIBE   2 // arg: qos, a: topic
+#define NET_UNSUBSCRIBE 3 // a: topic
+#define NET_CONNECT     4 // (re)connect with the current config
+#define NET_OTA         5 // a: ESBOTA payload
+#define NET_SUBSCRIPTIONS 6 // send the pending subscriptions, see subs.h
+#define NET_BULK        7 // arg: 1 to connect the bulk session, 0 to disconnect it, see bulk.h
+#define NET_PUB_BULK    8 // NET_PUBLISH on the bulk session
+
+// mqttPublish, mqttSubscribe, and mqttUnsubscribe return false if the request could not be
+// queued or sent, or, for mqttPublish at QoS 1 or 2 outside the esb_net task, if the in-flight
+// window is full (see flight.h).
+extern bool mqttPublish(const char *topic, uint8_t qos, bool retain,
+        const char *payload, size_t len);
+extern bool mqttSubscribe(const char *topic, uint8_t qos);
+extern bool mqttUnsubscribe(const char *topic);
+
+// ESBMessageFn receives a complete message, messages that arrive in pieces are reassembled up to
+// ESB_NET_MSG_MAX bytes, larger ones and ones that don't fit into the inbox are dropped.
+typedef void (*ESBMessageFn)(const char *topic, const char *payload, size_t len, MqttProps props);
+// ESBConnectionFn is told when the MQTT connection comes up or goes down.
+typedef void (*ESBConnectionFn)(bool connected, bool sessionPresent);
+
+// ESBReadyFn is told when all subscriptions of a new connection are confirmed (see subs.h), ms
+// is the time since the connection came up.
+typedef void (*ESBReadyFn)(uint32_t ms);
+
+// mqttOnMessage, mqttOnConnection, and mqttOnReady register the application's handlers, which
+// mqttLoop calls.
+extern void mqttOnMessage(ESBMessageFn fn);
+extern void mqttOnConnection(ESBConnectionFn fn);
+extern void mqttOnReady(ESBReadyFn fn);
+// netLoop passes the messages and events from the network side to the handlers, mqttLoop calls
+// it.
+extern void netLoop();
+// netReassemble collects the pieces of a received message, it returns the complete message, the
+// payload itself if it came in one piece, or NULL while pieces are missing or if it's longer
+// than ESB_NET_MSG_MAX.
+extern const char *netReassemble(const char *topic, const char *payload, size_t len,
+        size_t index, size_t total);
+// netMessage, netConnection, and netReady are called by the MQTT callbacks to queue a complete
+// message or an event for the application.
+extern void netMessage(const char *topic, const char *payload, size_t len, MqttProps props);
+extern void netConnection(bool connected, bool sessionPresent);
+extern void netReady(uint32_t ms);
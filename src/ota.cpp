@@ -5,6 +5,13 @@
 
 #include <Update.h>
 #include "ota.h"
+#include "log.h"
+#include "prof.h"
+#include "lat.h"
+#include "mqtt.h"
+#include "timer.h"
+#include "net.h"
+#include "bundle.h"
 
 #define LED_OTA 19 // ez-sbc board
 #define LED_ON   0
@@ -13,6 +20,7 @@
 long ESBOTA::contentLength;
 bool ESBOTA::isValidContentType;
 AsyncClient *ESBOTA::client = 0;
+static AsyncClient otaClient; // reused for every fetch
 bool ESBOTA::gotHeader;
 char ESBOTA::buf[128];
 char *ESBOTA::host;
@@ -20,15 +28,24 @@ int ESBOTA::port;
 char *ESBOTA::uri;
 char ESBOTA::md5[34];
 uint32_t ESBOTA::start;
+int ESBOTA::progress;
+long ESBOTA::received;
+bool ESBOTA::started;
+bool ESBOTA::isBundle;
 
-// begin the OTA process, the payload should contain <URL>|<md5>.
+// begin the OTA process, the payload should contain <URL>|<md5>. When the network task runs the
+// OTA is started there so the fetch and its callbacks stay on the network side.
 void ESBOTA::begin(char *payload, size_t len) {
     if (len > 128) return;
+    if (netRemote()) {
+        netPost(NET_OTA, 0, payload, len);
+        return;
+    }
     char *md5 = strchr(payload, '|');
     if (!md5 || (md5-payload) >= 128) return;
     *md5++ = 0;
     char mm[33]; strncpy(mm, md5, 32); mm[32] = 0; // md5 string is not null-terminated
-    printf("OTA message: fetch %s MD5=%s\n", payload, mm);
+    ESB_LOGI("OTA message: fetch %s MD5=%s\n", payload, mm);
     begin(payload, md5);
 }
 
@@ -40,15 +57,15 @@ void ESBOTA::begin(char *url, char *md5_) {
             client->stop();
             client = 0;
         }
-        printf("OTA: Fetch in progress, not starting new one\n");
+        ESB_LOGW("OTA: Fetch in progress, not starting new one\n");
         return;
     }
     if (strlen(url) > 127) {
-        printf("OTA: URL %s too long\n", url);
+        ESB_LOGE("OTA: URL %s too long\n", url);
         return;
     }
     if (strncmp(url, "http://", 7) != 0) {
-        printf("OTA: URL must start with http:// (%s)\n", url);
+        ESB_LOGE("OTA: URL must start with http:// (%s)\n", url);
         return;
     }
     // save hostname for HTTP request
@@ -57,7 +74,7 @@ void ESBOTA::begin(char *url, char *md5_) {
     // split off URI
     uri = strchr(host, '/');
     if (!uri) {
-        printf("OTA: Can't find start of URI\n");
+        ESB_LOGE("OTA: Can't find start of URI\n");
         return;
     }
     *uri = 0; uri++;
@@ -72,10 +89,10 @@ void ESBOTA::begin(char *url, char *md5_) {
     strncpy(md5, md5_, 32);
     md5[32] = 0;
 
-    printf("OTA: Connecting to %s port %d\n", host, port);
+    ESB_LOGI("OTA: Connecting to %s port %d\n", host, port);
     start = millis();
 
-    client = new AsyncClient();
+    client = &otaClient;
     client->onConnect(connected);
     client->onDisconnect(disconnected);
     //client->onAck(acked);
@@ -86,22 +103,17 @@ void ESBOTA::begin(char *url, char *md5_) {
 
     // Start connection
     if (!client->connect(host, port)) {
-        printf("OTA: Failed to initiate connection.\n");
-        delete client;
+        ESB_LOGE("OTA: Failed to initiate connection.\n");
+        client = 0;
         return;
     }
 }
 
-// Utility to extract header value from headers
-String ESBOTA::getHeaderValue(String header, String headerName) {
-    return header.substring(strlen(headerName.c_str()));
-}
-
 // TCP connected, send HTTP request.
 void ESBOTA::connected(void *obj, AsyncClient *cli) {
-    printf("OTA: connected, fetching %s\n", uri);
+    ESB_LOGI("OTA: connected, fetching %s\n", uri);
     if (cli->space() < 512) {
-        printf("OTA: not enough space in TX buffer: %d\n", cli->space());
+        ESB_LOGE("OTA: not enough space in TX buffer: %d\n", cli->space());
         cli->stop(); return;
     }
     char buf[256];
@@ -110,7 +122,7 @@ void ESBOTA::connected(void *obj, AsyncClient *cli) {
             uri, host);
     int l = cli->write(buf, len);
     if (l != len) {
-        printf("OTA: only wrote %d out of %d\n", l, len);
+        ESB_LOGE("OTA: only wrote %d out of %d\n", l, len);
         cli->stop(); return;
     }
     buf[0] = 0;
@@ -122,14 +134,16 @@ void ESBOTA::connected(void *obj, AsyncClient *cli) {
 
 // TCP disconnected, abort any ongoing OTA.
 void ESBOTA::disconnected(void *obj, AsyncClient *cli) {
-    printf("OTA: disconnected\n");
+    ESB_LOGI("OTA: disconnected\n");
     if (Update.isRunning()) Update.abort();
+    bundleAbort();
     //if (client) delete client;
     client = 0;
 }
 
 void ESBOTA::timedout(void *obj, AsyncClient *cli, uint32_t time) {
-    printf("OTA: timed-out\n");
+    ESB_LOGW("OTA: timed-out\n");
+    cli->stop(); // the client gets reused
     client = 0;
 }
 
@@ -140,7 +154,7 @@ void ESBOTA::acked(void *obj, AsyncClient *cli, size_t len, uint32_t time) {
 #endif
 
 void ESBOTA::errored(void *obj, AsyncClient *cli, int8_t error) {
-    printf("OTA: errored: %d (%s)\n", error, cli->errorToString(error));
+    ESB_LOGE("OTA: errored: %d (%s)\n", error, cli->errorToString(error));
 }
 
 // got HTTP request header, verify it.
@@ -148,19 +162,19 @@ void ESBOTA::onHeader(AsyncClient *cli) {
     int bufLen = strlen(buf);
     if (strncmp(buf, "HTTP/1.1", 8) == 0) {
         if (bufLen < 12 || strncmp(buf+9, "200", 3) != 0) {
-            printf("OTA: did not get 200 status code: %s\n", buf);
+            ESB_LOGE("OTA: did not get 200 status code: %s\n", buf);
             cli->stop();
         }
     } else if (strncmp(buf, "Content-Length: ", 16) == 0) {
         contentLength = atol(buf+16);
         if (contentLength < 1024 || contentLength > 8*1024*1024) {
-            printf("OTA: invalid Content-Length: %ld\n", contentLength);
+            ESB_LOGE("OTA: invalid Content-Length: %ld\n", contentLength);
             cli->stop();
             contentLength = 0;
         }
     } else if (strncmp(buf, "Content-Type: ", 14) == 0) {
         if (strcmp(buf+14, "application/octet-stream") != 0) {
-            printf("OTA: invalid Content-Type: %s\n", buf+14);
+            ESB_LOGE("OTA: invalid Content-Type: %s\n", buf+14);
             cli->stop();
         } else {
             isValidContentType = true;
@@ -168,8 +182,12 @@ void ESBOTA::onHeader(AsyncClient *cli) {
     }
 }
 
+PROF_DEF(otaData);
+
 // got HTTP content, add to update.
 void ESBOTA::onData(void *obj, AsyncClient *cli, void *d, size_t len) {
+    PROF(otaData);
+    ESB_LATENCY(otaData, 20000);
     char *data = (char *)d;
     //printf("OTA: got data (%d)\n", len);
     if (!gotHeader) {
@@ -182,7 +200,7 @@ void ESBOTA::onData(void *obj, AsyncClient *cli, void *d, size_t len) {
                 if (bufLen == 0 || (bufLen == 1 && buf[0] == '\r')) {
                     // end of headers
                     if (contentLength == 0) {
-                        printf("OTA: Content-Length header missing\n");
+                        ESB_LOGE("OTA: Content-Length header missing\n");
                         cli->stop();
                         return;
                     }
@@ -197,7 +215,7 @@ void ESBOTA::onData(void *obj, AsyncClient *cli, void *d, size_t len) {
                 bufLen = 0;
             } else if (data[i] == 0) {
                 // should not find null character
-                printf("OTA: got null character in HTTP response headers\n");
+                ESB_LOGE("OTA: got null character in HTTP response headers\n");
                 cli->stop();
                 return;
             } else {
@@ -209,70 +227,101 @@ void ESBOTA::onData(void *obj, AsyncClient *cli, void *d, size_t len) {
         // check whether we popped out fo the loop due to oversize header
         if (bufLen == 128) {
             buf[127] = 0;
-            printf("OTA: got too long a header line: %s\n", buf);
+            ESB_LOGE("OTA: got too long a header line: %s\n", buf);
             cli->stop();
             return;
         }
         buf[bufLen] = 0;
         if (!gotHeader && i == len) return;
-        if (!gotHeader) printf("OTA: whooops???\n");
-        if (contentLength == 0) { printf("OTA: ignoring...\n"); return; }
+        if (!gotHeader) ESB_LOGW("OTA: whooops???\n");
+        if (contentLength == 0) { ESB_LOGW("OTA: ignoring...\n"); return; }
         if (!isValidContentType) { contentLength = 0; return; }
-        // start update
-        if (Update.isRunning()) Update.abort();
-        bool canBegin = Update.begin(contentLength);
-        if (!canBegin) {
-            printf("OTA: not enough space to perform OTA\n");
-            cli->stop();
-            return;
-        }
-        Update.setMD5(md5);
-        printf("OTA: started flashing, length=%ld md5=%s\n", contentLength, md5);
-        if (i < len) {
-            size_t w = Update.write((uint8_t*)(data+i), len-i);
-            if (w != len-i) {
-                printf("OTA: write failed, wrote %d expected %d\n", w, len-i);
+        started = false;
+        received = 0;
+        progress = 0;
+        if (i < len) write(cli, (uint8_t*)(data+i), len-i);
+        return;
+    }
+    // plain data
+    if (contentLength == 0) { ESB_LOGD("OTA: ignoring...\n"); return; }
+    write(cli, (uint8_t*)data, len);
+}
+
+// write passes content to Update or, if the first byte says it's a bundle, to bundleWrite.
+void ESBOTA::write(AsyncClient *cli, uint8_t *data, size_t len) {
+    if (!started) {
+        started = true;
+        isBundle = bundleIs(data[0]);
+        if (isBundle) {
+            bundleBegin(contentLength, md5);
+        } else {
+            // start update
+            if (Update.isRunning()) Update.abort();
+            bool canBegin = Update.begin(contentLength);
+            if (!canBegin) {
+                ESB_LOGE("OTA: not enough space to perform OTA\n");
                 contentLength = 0;
                 cli->stop();
+                return;
             }
+            Update.setMD5(md5);
         }
-        return;
+        ESB_LOGI("OTA: started flashing %s, length=%ld md5=%s\n", isBundle ? "bundle" : "app",
+                contentLength, md5);
     }
-    // plain data
-    if (contentLength == 0) { printf("OTA: ignoring...\n"); return; }
-    size_t w = Update.write((uint8_t*)data, len);
-    if (w != len) {
-        printf("OTA: write failed, wrote %d expected %d\n", w, len);
-        contentLength = 0;
-        cli->stop();
+    if (isBundle) {
+        if (!bundleWrite(data, len)) {
+            finish(cli, false);
+            return;
+        }
     } else {
-        Serial.print('~');
+        size_t w = Update.write(data, len);
+        if (w != len) {
+            ESB_LOGE("OTA: write failed, wrote %d expected %d\n", w, len);
+            contentLength = 0;
+            cli->stop();
+            return;
+        }
+    }
+    received += len;
+    if (received*10/contentLength != progress) {
+        progress = received*10/contentLength;
+        ESB_LOGD("OTA: %d%%\n", progress*10);
     }
-    if (Update.isFinished()) {
-        if (Update.end()) {
+    if (isBundle && bundleDone()) {
+        finish(cli, true);
+    } else if (!isBundle && Update.isFinished()) {
+        bool ok = Update.end();
+        if (!ok) ESB_LOGE("OTA: error %d\n", Update.getError());
+        finish(cli, ok);
+    }
+}
+
+// finish reboots into the new firmware or signals the failure.
+void ESBOTA::finish(AsyncClient *cli, bool ok) {
+    if (ok) {
 #if LED_OTA
-	    pinMode(LED_OTA, OUTPUT);
-	    digitalWrite(LED_OTA, LED_ON);
+        pinMode(LED_OTA, OUTPUT);
+        digitalWrite(LED_OTA, LED_ON);
 #endif
-            printf("\nOTA: successful! Took %.1fs. Rebooting.\n", (millis()-start)/1000.0);
+        ESB_LOGI("OTA: successful! Took %.1fs. Rebooting.\n", (millis()-start)/1000.0);
 #if LED_OTA
-	    delay(500);
-	    digitalWrite(LED_OTA, 1-LED_ON);
+        delay(500);
+        digitalWrite(LED_OTA, 1-LED_ON);
 #endif
-            ESP.restart();
-        } else {
-            printf("\nOTA: error %d\n", Update.getError());
-            contentLength = 0;
-            cli->stop();
+        esbLogFlush();
+        ESP.restart();
+    } else {
+        contentLength = 0;
+        cli->stop();
 #if LED_OTA
-	    pinMode(LED_OTA, OUTPUT);
-	    for (int i=0; i<10; i++) {
-		digitalWrite(LED_OTA, LED_ON);
-		delay(100);
-		digitalWrite(LED_OTA, 1-LED_ON);
-		delay(100);
-	    }
-#endif
+        pinMode(LED_OTA, OUTPUT);
+        for (int i=0; i<10; i++) {
+            digitalWrite(LED_OTA, LED_ON);
+            delay(100);
+            digitalWrite(LED_OTA, 1-LED_ON);
+            delay(100);
         }
+#endif
     }
 }
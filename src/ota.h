@@ -6,7 +6,8 @@
 class ESBOTA {
 public:
 
-    // begin the OTA process, the payload should contain <URL>|<md5>.
+    // begin the OTA process, the payload should contain <URL>|<md5>. The URL may point to an
+    // app image or to a bundle of several images, see bundle.h.
     static void begin(char *payload, size_t len);
     // begin the OTA process by downloading url and checking the md5.
     static void begin(char *url, char *md5);
@@ -25,9 +26,10 @@ public:
     static char *uri;
     static char md5[34];
     static uint32_t start;
-
-    // Utility to extract header value from headers
-    static String getHeaderValue(String header, String headerName);
+    static int progress; // last progress logged, in 10% steps
+    static long received;
+    static bool started;  // got the first byte of the content
+    static bool isBundle; // content is a bundle, see bundle.h
 
     static void connected(void *obj, AsyncClient *cli);
     static void disconnected(void *obj, AsyncClient *cli);
@@ -36,4 +38,6 @@ public:
     static void onHeader(AsyncClient *cli);
     static void onData(void *obj, AsyncClient *cli, void *d, size_t len);
     static void timedout(void *obj, AsyncClient *cli, uint32_t time);
+    static void write(AsyncClient *cli, uint8_t *data, size_t len);
+    static void finish(AsyncClient *cli, bool ok);
 };
@@ -0,0 +1,89 @@
+// ESP32 Secure Base - background configuration portal
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+
+static ESBConfig *portalConfig = NULL;
+static TaskHandle_t volatile portalTask = NULL; // runs the portal while it's up
+static volatile bool portalQuit = false;        // asks portalTask to stop the portal
+static uint32_t portalOfflineMs;
+
+static void portalStart(void *);
+static void portalStop(void *);
+static void portalReconnect(void *) { mqttConnect(); }
+static ESBTimer portalStartTimer(portalStart); // runs while the station is offline
+static ESBTimer portalStopTimer(portalStop);   // runs after the station connected
+static ESBTimer portalReconnectTimer(portalReconnect); // applies saved MQTT settings
+
+bool portalActive() { return portalTask != NULL; }
+
+// portalRun is the portal's task. It runs the wifi manager, which blocks for seconds while it
+// tries credentials the user saved, so it doesn't hold up the timers in the loop task. It applies
+// saved MQTT settings by reconnecting from the loop task, which owns the MQTT client, and
+// deallocates the portal when asked to stop.
+static void portalRun(void *) {
+    ESBWifiConfig *wifi = new ESBWifiConfig(*portalConfig);
+    wifi->startPortal();
+    while (!portalQuit) {
+        wifi->loop();
+        if (wifi->saved) {
+            wifi->saved = false;
+            ESB_LOGI("PORTAL: config saved\n");
+            esbTimers.start(portalReconnectTimer, 0);
+        }
+        vTaskDelay(pdMS_TO_TICKS(ESB_PORTAL_POLL));
+    }
+    wifi->stopPortal();
+    delete wifi;
+    portalTask = NULL;
+    // the station may have dropped again while the portal was stopping
+    if (!WiFi.isConnected()) esbTimers.start(portalStartTimer, portalOfflineMs);
+    vTaskDelete(NULL);
+}
+
+static void portalStart(void *) {
+    if (portalTask || WiFi.isConnected()) return;
+    ESB_LOGI("PORTAL: offline for %us, starting config portal\n", portalOfflineMs/1000);
+    portalQuit = false;
+    TaskHandle_t task;
+    if (xTaskCreate(portalRun, "esb_portal", 4096, NULL, tskIDLE_PRIORITY+1, &task) != pdPASS) {
+        ESB_LOGE("PORTAL: cannot create task\n");
+        return;
+    }
+    portalTask = task;
+}
+
+// portalStop asks the portal's task to stop, it does so within ESB_PORTAL_POLL ms or once the
+// credentials it's trying have connected or failed.
+static void portalStop(void *) {
+    if (!portalTask || !WiFi.isConnected()) return;
+    ESB_LOGI("PORTAL: connected to %s, stopping config portal\n", WiFi.SSID().c_str());
+    portalQuit = true;
+}
+
+// portalEvent runs in the WiFi event task, it only starts and stops timers.
+static void portalEvent(WiFiEvent_t event) {
+    switch (event) {
+    case SYSTEM_EVENT_STA_GOT_IP:
+        esbTimers.stop(portalStartTimer);
+        if (portalTask) esbTimers.start(portalStopTimer, ESB_PORTAL_LINGER);
+        break;
+    case SYSTEM_EVENT_STA_DISCONNECTED:
+        // this repeats while the station retries, the offline time counts from the first one
+        esbTimers.stop(portalStopTimer);
+        if (!portalTask && !portalStartTimer.active()) {
+            esbTimers.start(portalStartTimer, portalOfflineMs);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void portalEnable(ESBConfig &config, uint32_t offlineSec) {
+    portalOfflineMs = offlineSec * 1000;
+    if (!portalConfig) WiFi.onEvent(portalEvent);
+    portalConfig = &config;
+    // the station may not have produced an event yet, e.g. right after WiFi.begin() in setup()
+    if (!WiFi.isConnected() && !portalTask) esbTimers.start(portalStartTimer, portalOfflineMs);
+}
@@ -0,0 +1,31 @@
+// ESP32 Secure Base - background configuration portal
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// portalEnable turns the configuration portal into a background service for systems that must
+// operate with or without WiFi: setup() returns right away and the application keeps running
+// while the device is unconfigured or its AP is gone. The portal is started by a timer once the
+// station has been offline for offlineSec and is stopped and deallocated ESB_PORTAL_LINGER ms
+// after it connects, which leaves the browser time to show the result of a save. It starts again
+// the next time the station stays offline for offlineSec. Values saved in the portal are written
+// to the config and MQTT reconnects with them. WiFi events start and stop timers in esbTimers,
+// so loop() only needs to call mqttLoop() and esbTimers.wait(), and the portal itself runs in
+// its own task because the wifi manager blocks while it tries the credentials the user saved.
+
+#include <Arduino.h>
+
+#ifndef ESB_PORTAL_OFFLINE
+#define ESB_PORTAL_OFFLINE 60  // default seconds offline before the portal starts
+#endif
+#ifndef ESB_PORTAL_LINGER
+#define ESB_PORTAL_LINGER 10000 // ms the portal stays up after the station connects
+#endif
+#ifndef ESB_PORTAL_POLL
+#define ESB_PORTAL_POLL 20     // ms between runs of the portal's DNS server and scanner
+#endif
+
+struct ESBConfig;
+// portalEnable starts the service, offlineSec=0 brings the portal up right away if the station
+// isn't connected. It must be called after config.read().
+extern void portalEnable(ESBConfig &config, uint32_t offlineSec = ESB_PORTAL_OFFLINE);
+// portalActive returns true while the portal is up.
+extern bool portalActive();
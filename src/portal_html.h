@@ -0,0 +1,65 @@
+// ESP32 Secure Base - pre-compressed config portal pages
+// Generated by tools/gen_portal.py from portal/*, do not edit.
+
+// index.html: 1873 bytes, 923 gzip'ed
+#define PORTAL_INDEX_ETAG "\"61ec29e2f1d867b4\""
+static const uint8_t portal_index_gz[] PROGMEM = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x7d, 0x55, 0x5b, 0x8f, 0xe2, 0x36,
+    0x14, 0x7e, 0xe7, 0x57, 0xb8, 0x59, 0xad, 0x00, 0x69, 0x12, 0x6e, 0x33, 0xa8, 0xcd, 0x05, 0xa9,
+    0x3b, 0x3b, 0x95, 0x46, 0x55, 0xb5, 0x54, 0x8c, 0x54, 0x55, 0x55, 0x1f, 0x9c, 0xf8, 0x84, 0xb8,
+    0x38, 0x76, 0x6a, 0x3b, 0x19, 0x28, 0xe2, 0xbf, 0xef, 0x71, 0x02, 0x0c, 0xb0, 0x9d, 0x7d, 0x40,
+    0xb1, 0x3f, 0xfb, 0xf8, 0xfb, 0xce, 0x95, 0xf8, 0x87, 0xcf, 0x5f, 0x1e, 0x5f, 0xfe, 0x5c, 0x3e,
+    0x91, 0xc2, 0x96, 0x62, 0xd1, 0x8b, 0xdd, 0x87, 0x08, 0x2a, 0xd7, 0x89, 0x07, 0xd2, 0x5b, 0xc4,
+    0x05, 0x50, 0x86, 0x70, 0x09, 0x96, 0x12, 0x49, 0x4b, 0x48, 0xbc, 0x86, 0xc3, 0x6b, 0xa5, 0xb4,
+    0xf5, 0x48, 0xa6, 0xa4, 0x05, 0x69, 0x13, 0xef, 0x95, 0x33, 0x5b, 0x24, 0x0c, 0x1a, 0x9e, 0x81,
+    0xdf, 0x6e, 0xee, 0xb8, 0xe4, 0x96, 0x53, 0xe1, 0x9b, 0x8c, 0x0a, 0x48, 0x26, 0x77, 0xb5, 0x01,
+    0xdd, 0x6e, 0x68, 0x8a, 0x7b, 0xa9, 0x3c, 0x7c, 0xd4, 0x72, 0x2b, 0x60, 0xf1, 0xb4, 0x5a, 0xce,
+    0xa6, 0x64, 0x05, 0x59, 0xad, 0x81, 0x7c, 0xa2, 0x06, 0xe2, 0x51, 0x77, 0xd0, 0x8b, 0x8d, 0xdd,
+    0xb9, 0x6f, 0xaa, 0xd8, 0x6e, 0x6f, 0x61, 0x6b, 0x7d, 0x2a, 0xf8, 0x5a, 0x86, 0x19, 0x92, 0x82,
+    0x8e, 0x72, 0xa4, 0xf7, 0x73, 0x5a, 0x72, 0xb1, 0x0b, 0x1b, 0xd0, 0x8c, 0x4a, 0x7a, 0x67, 0xa8,
+    0x34, 0x3e, 0x52, 0xf1, 0xfc, 0xd0, 0x63, 0xbc, 0x09, 0xb2, 0x4b, 0x3b, 0x01, 0xb9, 0x8d, 0x18,
+    0x37, 0x95, 0xa0, 0xbb, 0x90, 0x4b, 0xc1, 0x25, 0xf8, 0xa9, 0x50, 0xd9, 0x26, 0x2a, 0xb9, 0xec,
+    0x74, 0x87, 0xd3, 0xf9, 0xb8, 0xda, 0x1e, 0x7a, 0x5c, 0x56, 0xb5, 0xdd, 0x77, 0xd0, 0x4f, 0x0f,
+    0x1f, 0xa3, 0x8a, 0x32, 0xc6, 0xe5, 0x3a, 0x7c, 0xa8, 0xb6, 0x1d, 0xaf, 0xe1, 0xff, 0x41, 0x38,
+    0x81, 0x32, 0x2a, 0xa9, 0x5e, 0xa3, 0x75, 0xaa, 0xac, 0x55, 0x65, 0x38, 0x75, 0xc6, 0x69, 0x8d,
+    0x6b, 0xb9, 0x4f, 0x95, 0x66, 0xa0, 0xc3, 0x71, 0xd4, 0x2d, 0x7c, 0x4d, 0x19, 0xaf, 0x4d, 0x18,
+    0xcc, 0x34, 0x9a, 0xa5, 0x34, 0xdb, 0xac, 0xb5, 0xaa, 0x25, 0x0b, 0x3f, 0x4c, 0x72, 0x3a, 0x83,
+    0x2c, 0xca, 0x94, 0x50, 0x3a, 0xfc, 0x90, 0xe7, 0x79, 0xd4, 0x4a, 0x2b, 0x80, 0xaf, 0x0b, 0x1b,
+    0x4e, 0x83, 0x7b, 0x67, 0x70, 0xc1, 0x1a, 0x4c, 0x1d, 0xd0, 0x89, 0x9b, 0x8c, 0xc7, 0x1f, 0x0f,
+    0x3d, 0x53, 0x51, 0xb9, 0x7f, 0xbb, 0x11, 0xfc, 0x88, 0xe7, 0xc7, 0xe7, 0xe6, 0xf3, 0xf9, 0xa1,
+    0x17, 0x8f, 0x8e, 0xa1, 0x8c, 0x47, 0x6d, 0x42, 0x63, 0x17, 0xd2, 0x45, 0x8c, 0x11, 0x22, 0x99,
+    0xa0, 0xc6, 0x24, 0x5e, 0xe6, 0x12, 0x52, 0x4c, 0x09, 0x67, 0x89, 0xe7, 0xf2, 0xec, 0xfd, 0x5f,
+    0x5e, 0x8a, 0x29, 0x5e, 0xca, 0x95, 0x2e, 0x09, 0xd6, 0x43, 0xa1, 0xf0, 0xea, 0x1a, 0xb0, 0x0e,
+    0x68, 0x66, 0xb9, 0x92, 0xae, 0x0c, 0x72, 0x6e, 0x68, 0x03, 0xed, 0x53, 0xb3, 0xc5, 0x1f, 0xfc,
+    0x17, 0x4e, 0x24, 0xd8, 0x57, 0xa5, 0x37, 0x68, 0x3b, 0x43, 0xb4, 0x0d, 0x6b, 0xcb, 0x61, 0xbc,
+    0x63, 0x39, 0xe1, 0xa2, 0xa4, 0x5b, 0x01, 0x72, 0x8d, 0x25, 0xe4, 0xcd, 0xa6, 0x1e, 0xc1, 0xf4,
+    0x64, 0x50, 0x28, 0x81, 0x31, 0x4b, 0xbc, 0xd5, 0xea, 0xf9, 0xb3, 0x47, 0x04, 0x37, 0x58, 0x66,
+    0xf8, 0x96, 0xc1, 0x92, 0x64, 0xd4, 0x52, 0x07, 0x74, 0x5a, 0x3b, 0x6c, 0x74, 0x02, 0xaf, 0x48,
+    0xaa, 0x13, 0x49, 0x75, 0x45, 0x32, 0xbf, 0xf7, 0x88, 0xdd, 0x55, 0x0e, 0x47, 0xdf, 0x51, 0x1e,
+    0xbb, 0x21, 0x3d, 0xc3, 0x9d, 0x23, 0x8f, 0x4a, 0xe6, 0x7c, 0x5d, 0x6b, 0xea, 0xdc, 0x44, 0x6f,
+    0x33, 0x30, 0x86, 0x54, 0x8a, 0x4b, 0xfb, 0x8d, 0x5b, 0xb4, 0xf2, 0x9d, 0xf1, 0x89, 0xf7, 0xbc,
+    0xbd, 0x60, 0x9f, 0xcc, 0x6f, 0xd8, 0x7e, 0x5e, 0x92, 0x37, 0xc2, 0xd8, 0xa5, 0x72, 0x71, 0xc9,
+    0x71, 0x3e, 0xc4, 0x24, 0xba, 0xb3, 0x56, 0xd2, 0x6f, 0xbf, 0xbf, 0xbc, 0x10, 0xac, 0x73, 0xac,
+    0xfb, 0x6f, 0x34, 0x94, 0xff, 0x5a, 0xeb, 0x77, 0x67, 0x27, 0x1d, 0x57, 0xd0, 0x85, 0x96, 0xfb,
+    0xf1, 0x8d, 0x96, 0x42, 0x19, 0xdb, 0xa5, 0xbf, 0x13, 0xd2, 0xd9, 0x90, 0x13, 0x4c, 0x94, 0x26,
+    0xcf, 0x4b, 0x82, 0xcd, 0xa0, 0x51, 0xdf, 0x59, 0xd0, 0x0d, 0x77, 0x37, 0x1d, 0x2e, 0x98, 0x3b,
+    0xe0, 0x82, 0xf7, 0xe1, 0x36, 0xe0, 0xee, 0xc2, 0x35, 0xa5, 0x83, 0xde, 0x23, 0xe0, 0x0c, 0x27,
+    0xc0, 0x15, 0xc3, 0x11, 0xf9, 0x9e, 0x6b, 0x6e, 0x02, 0x8d, 0xda, 0x7b, 0xdc, 0xee, 0x4e, 0x64,
+    0x57, 0x20, 0xc1, 0xd2, 0x26, 0xcb, 0xd5, 0xaf, 0xef, 0xfa, 0x65, 0x36, 0xd7, 0x6e, 0xb9, 0xfd,
+    0xf7, 0x28, 0x2b, 0x0d, 0xbe, 0x29, 0xa8, 0x06, 0x46, 0x36, 0x70, 0xe6, 0xbc, 0x46, 0x43, 0x82,
+    0x5d, 0x56, 0xc0, 0x96, 0x30, 0xbe, 0xe6, 0xf6, 0x2d, 0xa6, 0xa9, 0x5e, 0x74, 0xbf, 0x76, 0x98,
+    0x1c, 0xeb, 0xd5, 0xd4, 0x69, 0xc9, 0x31, 0x52, 0xae, 0xcb, 0xe2, 0x51, 0x77, 0xe4, 0x9a, 0xda,
+    0xf5, 0xa4, 0xfb, 0x62, 0x43, 0xbb, 0xb1, 0x99, 0x69, 0x5e, 0x61, 0x27, 0xe4, 0x60, 0xb3, 0x62,
+    0xd0, 0x1f, 0x81, 0x49, 0x47, 0x0d, 0x15, 0x35, 0x98, 0xfe, 0x30, 0xb0, 0x05, 0xc8, 0x41, 0x5e,
+    0xcb, 0xb6, 0x67, 0x07, 0x7a, 0xb8, 0xd7, 0x60, 0x6b, 0x2d, 0x89, 0x0e, 0xfe, 0x31, 0x08, 0x0c,
+    0x0f, 0xb7, 0x57, 0x9a, 0xe1, 0xbe, 0x87, 0xef, 0x0f, 0x1a, 0xaa, 0xc9, 0x86, 0x70, 0x49, 0x9a,
+    0x20, 0xe7, 0x20, 0x98, 0x19, 0xee, 0x1d, 0x04, 0x09, 0x53, 0x59, 0x5d, 0x62, 0x04, 0x03, 0x1c,
+    0x06, 0x4f, 0x02, 0xdc, 0xf2, 0xd3, 0xee, 0x99, 0x0d, 0x36, 0xc3, 0x88, 0xe7, 0x03, 0x18, 0x42,
+    0xd0, 0x92, 0x27, 0x27, 0xbb, 0xbf, 0x36, 0x7f, 0xe3, 0x70, 0x7e, 0xc7, 0xa8, 0xef, 0xe2, 0xeb,
+    0x64, 0xe2, 0xd8, 0x7e, 0x3c, 0xfe, 0xbf, 0x34, 0x81, 0x03, 0xa3, 0x9e, 0xa3, 0x13, 0xc9, 0xfb,
+    0x96, 0x38, 0x0a, 0xfa, 0x43, 0xbc, 0x16, 0xb8, 0x55, 0x80, 0x9a, 0x9f, 0x28, 0xfa, 0x7f, 0x76,
+    0x44, 0x76, 0x82, 0xd5, 0xdb, 0x0b, 0x99, 0x06, 0x6a, 0xe1, 0xf8, 0xc8, 0xa0, 0xaf, 0x2a, 0x77,
+    0x0f, 0x9f, 0x50, 0x47, 0xc5, 0x32, 0x12, 0x01, 0xad, 0x2a, 0x90, 0xec, 0xb1, 0xe0, 0x82, 0x0d,
+    0x14, 0x46, 0x27, 0xea, 0xb9, 0x1f, 0xa6, 0xe9, 0x18, 0x64, 0x4c, 0x43, 0x3b, 0x4b, 0x47, 0xdd,
+    0x1f, 0xe8, 0x57, 0x73, 0x24, 0x5d, 0xf9, 0x51, 0x07, 0x00, 0x00,
+};
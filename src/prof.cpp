@@ -0,0 +1,79 @@
+// ESP32 Secure Base - profiling of code sections
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+
+#ifndef ESB_NO_PROF
+
+ESBProf *ESBProf::_first = NULL;
+
+void ESBProf::record(uint32_t cycles, int core) {
+    ESBProfStats &s = _core[core];
+    s.count++;
+    s.total += cycles;
+    if (cycles > s.max) s.max = cycles;
+    int b = cycles ? 32 - __builtin_clz(cycles) - ESB_PROF_MIN : 0; // 32-clz = log2+1
+    if (b < 0) b = 0;
+    if (b >= ESB_PROF_BUCKETS) b = ESB_PROF_BUCKETS-1;
+    s.hist[b]++;
+}
+
+// printTime prints a duration given in cycles with a unit that keeps it short.
+static void printTime(uint64_t cycles, uint32_t mhz) {
+    uint64_t us = cycles / mhz;
+    if (us < 10000) printf(" %6lluus", us);
+    else printf(" %6llums", us/1000);
+}
+
+void ESBProf::list() {
+    uint32_t mhz = getCpuFrequencyMhz();
+    printf("== Profile:          count    avg      max     total\n");
+    for (ESBProf *p=_first; p; p=p->_next) {
+        // sum up the per-core stats
+        ESBProfStats s = {};
+        for (int c=0; c<portNUM_PROCESSORS; c++) {
+            s.count += p->_core[c].count;
+            s.total += p->_core[c].total;
+            if (p->_core[c].max > s.max) s.max = p->_core[c].max;
+            for (int b=0; b<ESB_PROF_BUCKETS; b++) s.hist[b] += p->_core[c].hist[b];
+        }
+        printf("  %-16s %7u", p->_name, s.count);
+        printTime(s.count ? s.total/s.count : 0, mhz);
+        printTime(s.max, mhz);
+        printTime(s.total, mhz);
+        if (p->_migrated) printf(" (%u migrated)", p->_migrated);
+        printf("\n   ");
+        // histogram, labeled by the upper bound of each bucket
+        for (int b=0; b<ESB_PROF_BUCKETS; b++) {
+            if (s.hist[b] == 0) continue;
+            bool last = b == ESB_PROF_BUCKETS-1;
+            uint32_t us = (1u << (b + ESB_PROF_MIN - last)) / mhz;
+            printf(" %s", last ? ">=" : "<");
+            if (us < 1000) printf("%uus:%u", us, s.hist[b]);
+            else printf("%ums:%u", us/1000, s.hist[b]);
+        }
+        printf("\n");
+    }
+}
+
+void ESBProf::reset() {
+    for (ESBProf *p=_first; p; p=p->_next) {
+        memset(p->_core, 0, sizeof(p->_core));
+        p->_migrated = 0;
+    }
+}
+
+static void cmdDebugProf(ESBArgs &args) {
+    const char *arg = args.str("");
+    if (strcmp(arg, "reset") == 0) {
+        ESBProf::reset();
+        printf("DEBUG: profile reset\n");
+    } else if (*arg == 0) {
+        ESBProf::list();
+    } else {
+        printf("Usage: debug prof [reset]\n");
+    }
+}
+ESB_CMD(debug, prof, cmdDebugProf, "[reset]");
+
+#endif
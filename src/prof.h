@@ -0,0 +1,77 @@
+// ESP32 Secure Base - profiling of code sections
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// PROF(name) at the top of a block measures how long the rest of the block takes using the
+// CPU cycle counter (CCOUNT). The probe is defined at namespace scope with PROF_DEF(name), like
+// DV(), so it registers itself before any task runs and is listed before its first use:
+//   PROF_DEF(mqttLoop);
+//   void mqttLoop() {
+//       PROF(mqttLoop);
+// Each probe keeps count, total, max, and a log2 histogram per core so the two cores never write
+// the same counters. A task preempted by another running the same probe on the same core can
+// lose an update, the stats are meant as a profile, not as an exact count. A section that
+// migrates to the other core is not recorded since the cycle counters of the two cores are
+// independent.
+// "debug prof" lists the probes, "debug prof reset" clears them.
+// Defining ESB_NO_PROF compiles all probes out.
+
+#include <Arduino.h>
+
+#define ESB_PROF_BUCKETS 20 // histogram buckets: <2^9 cycles, <2^10, ..., >=2^27
+#define ESB_PROF_MIN 9      // log2 of the upper bound of the first bucket
+
+struct ESBProfStats {
+    uint32_t count;
+    uint32_t max;      // cycles
+    uint64_t total;    // cycles
+    uint32_t hist[ESB_PROF_BUCKETS];
+};
+
+class ESBProf {
+public:
+    const char   *_name;
+    ESBProf      *_next;
+    uint32_t     _migrated; // sections that moved to the other core and were not recorded
+    ESBProfStats _core[portNUM_PROCESSORS];
+
+    static ESBProf *_first;
+
+    ESBProf(const char *name) : _name(name), _migrated(0) {
+        memset(_core, 0, sizeof(_core));
+        _next = _first;
+        _first = this;
+    }
+
+    void record(uint32_t cycles, int core);
+
+    static void list();
+    static void reset();
+};
+
+class ESBProfScope {
+public:
+    ESBProf  &_prof;
+    uint32_t _t0;
+    int      _core;
+
+    ESBProfScope(ESBProf &prof)
+      : _prof(prof)
+      , _core(xPortGetCoreID())
+    {
+        _t0 = ESP.getCycleCount(); // last so the constructor is not measured
+    }
+
+    ~ESBProfScope() {
+        uint32_t t1 = ESP.getCycleCount();
+        if (xPortGetCoreID() == _core) _prof.record(t1-_t0, _core);
+        else _prof._migrated++;
+    }
+};
+
+#ifndef ESB_NO_PROF
+#define PROF_DEF(name) static ESBProf esbProf_ ## name(#name)
+#define PROF(name) ESBProfScope esbProfScope_ ## name(esbProf_ ## name)
+#else
+#define PROF_DEF(name)
+#define PROF(name)
+#endif
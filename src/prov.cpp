@@ -0,0 +1,49 @@
+// ESP32 Secure Base - factory provisioning
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+#include <esp_partition.h>
+
+static const ESBProv *prov = NULL;
+static bool provChecked = false;
+
+const ESBProv *provGet() {
+    if (provChecked) return prov;
+    provChecked = true;
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+            (esp_partition_subtype_t)ESB_PROV_SUBTYPE, NULL);
+    if (!part) return NULL;
+    const void *ptr;
+    spi_flash_mmap_handle_t handle; // never unmapped
+    if (esp_partition_mmap(part, 0, part->size, SPI_FLASH_MMAP_DATA, &ptr, &handle) != ESP_OK) {
+        ESB_LOGE("PROV: cannot map partition %s\n", part->label);
+        return NULL;
+    }
+    const ESBProv *p = (const ESBProv *)ptr;
+    if (p->magic != ESB_PROV_MAGIC) {
+        spi_flash_munmap(handle); // erased, not provisioned
+        return NULL;
+    }
+    if (p->version != ESB_PROV_VERSION || p->hdrSize != sizeof(ESBProv) ||
+            p->caLen > part->size - sizeof(ESBProv)) {
+        ESB_LOGE("PROV: unsupported blob (version %d, header %d bytes)\n", p->version,
+                p->hdrSize);
+        spi_flash_munmap(handle);
+        return NULL;
+    }
+    size_t off = offsetof(ESBProv, version);
+    if (provCrc((const uint8_t *)p + off, sizeof(ESBProv) + p->caLen - off) != p->crc) {
+        ESB_LOGE("PROV: blob is corrupt (CRC mismatch)\n");
+        spi_flash_munmap(handle);
+        return NULL;
+    }
+    ESB_LOGI("PROV: provisioned as %s\n", p->mqtt_ident);
+    prov = p;
+    return prov;
+}
+
+const uint8_t *provCA(size_t &len) {
+    const ESBProv *p = provGet();
+    len = p ? p->caLen : 0;
+    return len ? (const uint8_t *)p + p->hdrSize : NULL;
+}
@@ -0,0 +1,56 @@
+// ESP32 Secure Base - factory provisioning
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// Instead of each device making up a random PSK on first boot, which then has to be copied off
+// the serial console into the broker config, tools/mkprov generates the credentials of a whole
+// batch of devices up-front: one blob per device plus the broker's psk_file with all of them.
+// The blob is flashed into a small data partition (subtype ESB_PROV_SUBTYPE, see
+// partitions.csv) and ESBConfig::read maps it with esp_partition_mmap and reads the fields
+// straight from flash, there is nothing to parse and nothing is allocated. The ident and psk of
+// the blob take precedence over config.json on every boot, so a device can't be talked out of
+// its provisioned identity by the portal or a config push. The brokers are only defaults for a
+// config that has none, so the CLI, the portal, and fleet pushes can move the device elsewhere.
+// This header is shared with tools/mkprov.cpp and must only use standard C types.
+//
+// Layout: an ESBProv header followed by caLen bytes of CA data (PEM with a terminating NUL or
+// DER) for applications that talk to TLS servers with certificates. The crc covers everything
+// after the crc field.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ESB_PROV_MAGIC   0x56525045 // "EPRV"
+#define ESB_PROV_VERSION 1
+#define ESB_PROV_SUBTYPE 0x40       // custom data partition subtype
+#define ESB_PROV_SIZE    0x1000     // size of the partition in partitions.csv
+
+// The field sizes match ESBConfig's.
+struct ESBProv {
+    uint32_t magic;
+    uint32_t crc;         // CRC-32 (zlib's) of the bytes following this field
+    uint16_t version;
+    uint16_t hdrSize;     // sizeof(ESBProv), the CA data starts here
+    uint32_t caLen;
+    char     mqtt_ident[41];
+    char     mqtt_psk[41];
+    char     mqtt_server[41];
+    char     mqtt_port[6];
+    char     mqtt_alt[81];
+};
+static_assert(sizeof(ESBProv) == 228, "ESBProv layout must be the same on the host and device");
+
+// provCrc computes the CRC-32 used by zlib, bit by bit as it runs once per boot.
+static inline uint32_t provCrc(const uint8_t *data, size_t len) {
+    uint32_t crc = 0xffffffff;
+    while (len--) {
+        crc ^= *data++;
+        for (int i=0; i<8; i++) crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+// provGet returns the blob in the provisioning partition, or NULL if there is no partition or
+// it doesn't hold a valid blob. The mapping is kept so the pointer remains valid.
+extern const ESBProv *provGet();
+// provCA returns the CA data in the blob and sets len, NULL if there is none.
+extern const uint8_t *provCA(size_t &len);
@@ -0,0 +1,263 @@
+// ESP32 Secure Base - publish-and-sleep profile
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+#include <esp_attr.h>
+#include <esp_sleep.h>
+#include <esp_wifi.h>
+
+#define SLEEP_MAGIC 0x45534253 // "ESBS"
+
+// message flags
+#define MSG_RETAIN 1
+#define MSG_SENT   2 // published in an earlier wake, retransmit with dup
+#define MSG_ACKED  4 // PUBACK received, removed before going to sleep
+
+// SleepMsg is a queued message, it is followed by the topic suffix and the payload and padded
+// to a multiple of 4 bytes.
+struct SleepMsg {
+    uint16_t id;    // MQTT packet id
+    uint8_t  flags;
+    uint8_t  tlen;  // length of the topic suffix
+    uint16_t plen;  // length of the payload
+    uint16_t size;  // bytes used in pending[]
+
+    char *topic() { return (char *)(this+1); }
+    char *payload() { return topic()+tlen; }
+};
+
+struct SleepState {
+    uint32_t magic;
+    uint32_t wakes;
+    // network parameters cached from the last successful connection, valid if channel != 0
+    uint8_t  channel;
+    uint8_t  bssid[6];
+    uint32_t ip, gw, mask, dns;
+    // MQTT session
+    uint16_t nextId;
+    uint16_t pendingLen;
+    uint8_t  pending[ESB_SLEEP_PENDING];
+    // stats of the previous wake, reported in this one
+    uint32_t awakeMs, wifiMs, mqttMs;
+    bool     fast;  // the cached network parameters worked
+};
+
+static RTC_DATA_ATTR SleepState sleepState;
+static TaskHandle_t sleepTask = NULL;
+static volatile bool sleepConnected = false;
+// guards the message flags and the queue layout, sleepOnPublish runs in the AsyncTCP task
+static portMUX_TYPE sleepMux = portMUX_INITIALIZER_UNLOCKED;
+
+// sleepInit clears the state after power-up or when the layout changed.
+static void sleepInit() {
+    if (sleepState.magic == SLEEP_MAGIC) return;
+    memset(&sleepState, 0, sizeof(sleepState));
+    sleepState.magic = SLEEP_MAGIC;
+    sleepState.nextId = 1;
+}
+
+uint32_t sleepWakes() {
+    sleepInit();
+    return sleepState.wakes;
+}
+
+bool sleepPublish(const char *suffix, const char *payload, size_t len, bool retain) {
+    sleepInit();
+    SleepState &s = sleepState;
+    size_t tlen = strlen(suffix);
+    size_t size = (sizeof(SleepMsg) + tlen + len + 3) & ~3;
+    if (tlen > 255 || s.pendingLen + size > ESB_SLEEP_PENDING) {
+        ESB_LOGW("SLEEP: no space for message on %s (%d bytes)\n", suffix, len);
+        return false;
+    }
+    SleepMsg *m = (SleepMsg *)(s.pending + s.pendingLen);
+    m->id = s.nextId++;
+    if (s.nextId == 0) s.nextId = 1;
+    m->flags = retain ? MSG_RETAIN : 0;
+    m->tlen = tlen;
+    m->plen = len;
+    m->size = size;
+    memcpy(m->topic(), suffix, tlen);
+    memcpy(m->payload(), payload, len);
+    s.pendingLen += size;
+    return true;
+}
+
+//===== waiting for the network
+
+// sleepWait blocks until done() returns true or the deadline passes. The MQTT callbacks notify
+// the task, WiFi is polled.
+static bool sleepWait(bool (*done)(), uint32_t deadline) {
+    while (!done()) {
+        int32_t left = deadline - millis();
+        if (left <= 0) return false;
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(left < 10 ? left : 10));
+    }
+    return true;
+}
+
+static bool sleepWiFiUp() { return WiFi.isConnected(); }
+static bool sleepMqttUp() { return sleepConnected; }
+static bool sleepMqttDown() { return !sleepConnected; }
+
+static bool sleepAllAcked() {
+    bool acked = true;
+    portENTER_CRITICAL(&sleepMux);
+    for (uint16_t off=0; off < sleepState.pendingLen && acked; ) {
+        SleepMsg *m = (SleepMsg *)(sleepState.pending + off);
+        acked = m->flags & MSG_ACKED;
+        off += m->size;
+    }
+    portEXIT_CRITICAL(&sleepMux);
+    return acked;
+}
+
+//===== WiFi
+
+static bool sleepWiFi(uint32_t deadline) {
+    SleepState &s = sleepState;
+    WiFi.persistent(false);
+    WiFi.mode(WIFI_STA);
+    s.fast = false;
+    if (s.channel) {
+        // skip the scan and DHCP using what worked last time
+        wifi_config_t conf;
+        esp_wifi_get_config(WIFI_IF_STA, &conf);
+        WiFi.config(IPAddress(s.ip), IPAddress(s.gw), IPAddress(s.mask), IPAddress(s.dns));
+        WiFi.begin((char *)conf.sta.ssid, (char *)conf.sta.password, s.channel, s.bssid);
+        uint32_t fast = millis() + ESB_SLEEP_FAST_MS;
+        if (sleepWait(sleepWiFiUp, (int32_t)(fast-deadline) < 0 ? fast : deadline)) {
+            s.fast = true;
+            return true;
+        }
+        ESB_LOGW("SLEEP: cached WiFi parameters failed, scanning\n");
+        s.channel = 0;
+        WiFi.disconnect();
+        WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));
+    }
+    WiFi.begin();
+    if (!sleepWait(sleepWiFiUp, deadline)) return false;
+    s.channel = WiFi.channel();
+    memcpy(s.bssid, WiFi.BSSID(), sizeof(s.bssid));
+    s.ip = WiFi.localIP();
+    s.gw = WiFi.gatewayIP();
+    s.mask = WiFi.subnetMask();
+    s.dns = WiFi.dnsIP();
+    return true;
+}
+
+//===== MQTT
+
+static void sleepOnConnect(bool sessionPresent) {
+    sleepConnected = true;
+    xTaskNotifyGive(sleepTask);
+}
+
+static void sleepOnDisconnect(AsyncMqttClientDisconnectReason reason) {
+    sleepConnected = false;
+    xTaskNotifyGive(sleepTask);
+}
+
+// sleepOnPublish runs in the AsyncTCP task, it only flags the message, sleepRun removes it.
+static void sleepOnPublish(uint16_t id) {
+    portENTER_CRITICAL(&sleepMux);
+    for (uint16_t off=0; off < sleepState.pendingLen; ) {
+        SleepMsg *m = (SleepMsg *)(sleepState.pending + off);
+        if (m->id == id) m->flags |= MSG_ACKED;
+        off += m->size;
+    }
+    portEXIT_CRITICAL(&sleepMux);
+    xTaskNotifyGive(sleepTask);
+}
+
+// sleepCompact removes the acknowledged messages from the queue.
+static void sleepCompact() {
+    SleepState &s = sleepState;
+    portENTER_CRITICAL(&sleepMux);
+    uint16_t to = 0;
+    for (uint16_t off=0; off < s.pendingLen; ) {
+        SleepMsg *m = (SleepMsg *)(s.pending + off);
+        uint16_t size = m->size;
+        if (!(m->flags & MSG_ACKED)) {
+            if (to != off) memmove(s.pending+to, m, size);
+            to += size;
+        }
+        off += size;
+    }
+    s.pendingLen = to;
+    portEXIT_CRITICAL(&sleepMux);
+}
+
+// sleepMqtt publishes the queued messages, returns true if all got acknowledged.
+static bool sleepMqtt(ESBConfig &config, uint32_t deadline) {
+    SleepState &s = sleepState;
+    mqttClient.onConnect(sleepOnConnect);
+    mqttClient.onDisconnect(sleepOnDisconnect);
+    mqttClient.onPublish(sleepOnPublish);
+    // the broker keeps the session, so messages in flight when we slept are not lost
+    mqttClient.setCleanSession(false);
+    mqttConfigure(config);
+    mqttClient.connect();
+    if (!sleepWait(sleepMqttUp, deadline)) {
+        // scan next time in case the cached address is what's wrong
+        s.channel = 0;
+        return false;
+    }
+
+    for (uint16_t off=0; off < s.pendingLen; ) {
+        SleepMsg *m = (SleepMsg *)(s.pending + off);
+        char topic[sizeof(mqTopic)+256];
+        memcpy(topic, mqTopic, mqTopicLen);
+        memcpy(topic+mqTopicLen, m->topic(), m->tlen);
+        topic[mqTopicLen+m->tlen] = 0;
+        // flag it first, the PUBACK may come back before publish() returns
+        portENTER_CRITICAL(&sleepMux);
+        bool dup = m->flags & MSG_SENT;
+        m->flags |= MSG_SENT;
+        portEXIT_CRITICAL(&sleepMux);
+        mqttClient.publish(topic, 1, m->flags & MSG_RETAIN, m->payload(), m->plen, dup, m->id);
+        off += m->size;
+    }
+    bool ok = sleepWait(sleepAllAcked, deadline);
+    sleepCompact();
+
+    mqttClient.disconnect();
+    uint32_t bye = millis() + 100;
+    sleepWait(sleepMqttDown, (int32_t)(bye-deadline) < 0 ? bye : deadline);
+    return ok;
+}
+
+//===== sleep
+
+void sleepRun(ESBConfig &config, uint32_t sleepSec) {
+    sleepInit();
+    SleepState &s = sleepState;
+    sleepTask = xTaskGetCurrentTaskHandle();
+    if (s.awakeMs) {
+        char msg[128];
+        int len = snprintf(msg, sizeof(msg),
+                "{\"wake\":%u,\"awake_ms\":%u,\"wifi_ms\":%u,\"mqtt_ms\":%u,\"fast\":%s}",
+                s.wakes, s.awakeMs, s.wifiMs, s.mqttMs, s.fast ? "true" : "false");
+        sleepPublish("/awake", msg, len);
+        s.awakeMs = 0;
+    }
+
+    uint32_t deadline = millis() + ESB_SLEEP_TIMEOUT;
+    uint32_t t0 = millis();
+    bool ok = sleepWiFi(deadline);
+    s.wifiMs = millis() - t0;
+    s.mqttMs = 0;
+    if (ok) {
+        t0 = millis();
+        sleepMqtt(config, deadline);
+        s.mqttMs = millis() - t0;
+    }
+
+    s.wakes++;
+    s.awakeMs = millis();
+    ESB_LOGI("SLEEP: awake %ums (wifi %ums, mqtt %ums), %d bytes pending, sleeping %us\n",
+            s.awakeMs, s.wifiMs, s.mqttMs, s.pendingLen, sleepSec);
+    esbLogFlush();
+    esp_sleep_enable_timer_wakeup((uint64_t)sleepSec * 1000000);
+    esp_deep_sleep_start();
+}
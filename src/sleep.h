@@ -0,0 +1,37 @@
+// ESP32 Secure Base - publish-and-sleep profile
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// For battery powered devices that wake up, publish a few messages, and go back to deep sleep.
+// Instead of mqttSetup() and the always-on machinery (keep-alive pings, reconnect timers, CLI)
+// the application calls sleepPublish() for each message and then sleepRun(), which does the
+// minimum: connect to WiFi using the channel, BSSID, and IP address cached from the previous
+// wake (skipping the scan and DHCP), connect to MQTT with a persistent session, publish at QoS 1,
+// wait for the PUBACKs, and enter deep sleep.
+// The state that needs to survive deep sleep lives in RTC memory: the cached network parameters,
+// the next packet id, and the messages that haven't been acknowledged yet, which are
+// retransmitted with the dup flag and their original packet id on the next wake. The time spent
+// awake, and how much of it went to WiFi and MQTT, is published on <mqTopic>/awake in the
+// following wake.
+
+#include <Arduino.h>
+
+#ifndef ESB_SLEEP_PENDING
+#define ESB_SLEEP_PENDING 1024  // bytes of RTC memory for unacknowledged messages
+#endif
+#ifndef ESB_SLEEP_TIMEOUT
+#define ESB_SLEEP_TIMEOUT 10000 // ms sleepRun tries before giving up and sleeping anyway
+#endif
+#ifndef ESB_SLEEP_FAST_MS
+#define ESB_SLEEP_FAST_MS 3000  // ms the cached WiFi parameters get before a full scan
+#endif
+
+// sleepPublish queues a message to be published at QoS 1 by sleepRun on <mqTopic><suffix>, e.g.
+// suffix="/temp". Returns false if the RTC memory is full.
+extern bool sleepPublish(const char *suffix, const char *payload, size_t len, bool retain = false);
+
+// sleepRun connects, publishes the queued messages, and enters deep sleep for sleepSec seconds.
+// It does not return.
+extern void sleepRun(ESBConfig &config, uint32_t sleepSec);
+
+// sleepWakes returns the number of times the device went through sleepRun since power-up.
+extern uint32_t sleepWakes();
@@ -0,0 +1,203 @@
+// ESP32 Secure Base - persistent subscriptions
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+
+// subscription states on the current connection
+#define SUB_FREE    0 // unused table entry
+#define SUB_IDLE    1 // not sent yet
+#define SUB_SENDING 2 // subscribe() in progress, the SUBACK may come back before it returns
+#define SUB_PENDING 3 // waiting for the SUBACK
+#define SUB_DONE    4 // confirmed
+#define SUB_FAILED  5 // rejected by the broker
+
+#define SUBS_EARLY 4 // SUBACKs remembered that overtook the return from subscribe()
+
+struct Sub {
+    ESBTopic topic;
+    uint8_t  qos;
+    uint8_t  state;
+    uint16_t packetId;
+};
+
+static Sub subs[ESB_SUBS_MAX];
+static portMUX_TYPE subsMux = portMUX_INITIALIZER_UNLOCKED;
+static volatile bool subsReady = false;
+static volatile bool subsFailed = false;
+static uint32_t subsConnectMs; // when the connection came up
+static struct { uint16_t packetId; uint8_t qos; } subsEarly[SUBS_EARLY];
+static uint8_t subsEarlyNext = 0;
+
+bool mqttReady() { return subsReady; }
+bool mqttSubsFailed() { return subsFailed; }
+
+// subsCheckReady declares the session ready once every subscription is confirmed, it must be
+// called with subsMux held and returns true if the session just became ready.
+static bool subsCheckReady() {
+    if (subsReady || !mqttClient.connected()) return false;
+    for (int i=0; i<ESB_SUBS_MAX; i++) {
+        if (subs[i].state != SUB_FREE && subs[i].state != SUB_DONE) return false;
+    }
+    subsReady = true;
+    return true;
+}
+
+// subsAcked records the SUBACK for s, called with subsMux held.
+static void subsAcked(Sub &s, uint8_t qos) {
+    if (qos == 0x80) {
+        s.state = SUB_FAILED;
+        subsFailed = true;
+    } else {
+        s.state = SUB_DONE;
+    }
+}
+
+static void subsNowReady() {
+    uint32_t ms = millis() - subsConnectMs;
+    ESB_LOGI("MQTT: ready, subscriptions confirmed in %ums\n", ms);
+    netReady(ms);
+}
+
+void subsSend() {
+    ESB_ALLOC_NET();
+    for (int i=0; i<ESB_SUBS_MAX; i++) {
+        Sub &s = subs[i];
+        portENTER_CRITICAL(&subsMux);
+        bool send = s.state == SUB_IDLE;
+        if (send) {
+            s.state = SUB_SENDING;
+            s.packetId = 0;
+        }
+        portEXIT_CRITICAL(&subsMux);
+        if (!send) continue;
+
+        ESBTopicStr topic(s.topic);
+        uint16_t id = topic.str && *topic.str ? mqttClient.subscribe(topic.str, s.qos) : 0;
+
+        bool rejected = false;
+        portENTER_CRITICAL(&subsMux);
+        if (s.state == SUB_SENDING) {
+            s.state = id ? SUB_PENDING : SUB_IDLE;
+            s.packetId = id;
+            for (int j=0; id && j<SUBS_EARLY; j++) {
+                if (subsEarly[j].packetId == id) {
+                    subsEarly[j].packetId = 0;
+                    subsAcked(s, subsEarly[j].qos);
+                    rejected = s.state == SUB_FAILED;
+                    break;
+                }
+            }
+        }
+        portEXIT_CRITICAL(&subsMux);
+        if (!id) ESB_LOGW("MQTT: cannot subscribe to %s\n", topic.str ? topic.str : "?");
+        if (rejected) ESB_LOGE("MQTT: subscription to %s rejected\n", topic.str);
+    }
+    portENTER_CRITICAL(&subsMux);
+    bool ready = subsCheckReady();
+    portEXIT_CRITICAL(&subsMux);
+    if (ready) subsNowReady();
+}
+
+// subsPost runs subsSend where the MQTT client may be called.
+static void subsPost() {
+    if (netRemote()) netPost(NET_SUBSCRIPTIONS, 0, NULL, 0);
+    else subsSend();
+}
+
+void subsAck(uint16_t packetId, uint8_t qos) {
+    ESB_NET_LOCK();
+    int found = -1;
+    portENTER_CRITICAL(&subsMux);
+    for (int i=0; i<ESB_SUBS_MAX && found < 0; i++) {
+        if (subs[i].state == SUB_PENDING && subs[i].packetId == packetId) found = i;
+    }
+    if (found >= 0) {
+        subsAcked(subs[found], qos);
+    } else {
+        // the SUBACK overtook the return from subscribe(), subsSend picks it up
+        subsEarly[subsEarlyNext].packetId = packetId;
+        subsEarly[subsEarlyNext].qos = qos;
+        subsEarlyNext = (subsEarlyNext+1) % SUBS_EARLY;
+    }
+    bool ready = subsCheckReady();
+    portEXIT_CRITICAL(&subsMux);
+    if (found >= 0 && qos == 0x80) {
+        ESB_LOGE("MQTT: subscription to %s rejected\n", mqttTopicStr(subs[found].topic));
+    }
+    if (ready) subsNowReady();
+}
+
+// subsReset marks all subscriptions as not sent on the current connection.
+static void subsReset() {
+    portENTER_CRITICAL(&subsMux);
+    subsReady = false;
+    subsFailed = false;
+    for (int i=0; i<ESB_SUBS_MAX; i++) {
+        if (subs[i].state != SUB_FREE) subs[i].state = SUB_IDLE;
+    }
+    for (int i=0; i<SUBS_EARLY; i++) subsEarly[i].packetId = 0;
+    portEXIT_CRITICAL(&subsMux);
+}
+
+// subsConnected runs in the connect callback, which may call the MQTT client.
+void subsConnected() {
+    subsConnectMs = millis();
+    subsReset();
+    subsSend();
+}
+
+void subsDisconnected() {
+    subsReady = false;
+}
+
+void subsResend() {
+    subsReset();
+    if (mqttClient.connected()) subsPost();
+}
+
+void subsUnsubscribe() {
+    for (int i=0; i<ESB_SUBS_MAX; i++) {
+        if (subs[i].state != SUB_FREE) (void) mqttUnsubscribe(subs[i].topic);
+    }
+}
+
+bool mqttAddSubscription(ESBTopic topic, uint8_t qos) {
+    if (topic == ESB_TOPIC_NONE) return false;
+    int free = -1;
+    portENTER_CRITICAL(&subsMux);
+    for (int i=0; i<ESB_SUBS_MAX; i++) {
+        if (subs[i].state == SUB_FREE) {
+            if (free < 0) free = i;
+        } else if (subs[i].topic == topic) {
+            portEXIT_CRITICAL(&subsMux);
+            return true;
+        }
+    }
+    if (free >= 0) {
+        subs[free].topic = topic;
+        subs[free].qos = qos;
+        subs[free].state = SUB_IDLE;
+    }
+    portEXIT_CRITICAL(&subsMux);
+    if (free < 0) {
+        ESB_LOGE("MQTT: no space for subscription to %s\n", mqttTopicStr(topic));
+        return false;
+    }
+    if (mqttClient.connected()) subsPost();
+    return true;
+}
+
+void mqttRemoveSubscription(ESBTopic topic) {
+    bool found = false, ready = false;
+    portENTER_CRITICAL(&subsMux);
+    for (int i=0; i<ESB_SUBS_MAX; i++) {
+        if (subs[i].state != SUB_FREE && subs[i].topic == topic) {
+            subs[i].state = SUB_FREE;
+            found = true;
+        }
+    }
+    if (found) ready = subsCheckReady();
+    portEXIT_CRITICAL(&subsMux);
+    if (found) (void) mqttUnsubscribe(topic);
+    if (ready) subsNowReady();
+}
@@ -0,0 +1,44 @@
+// ESP32 Secure Base - persistent subscriptions
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// The library keeps a table of the topics to be subscribed to, its own (ping, CLI) and the
+// application's. When the connection comes up all of them are sent right away, back-to-back,
+// from the connect callback itself, which holds the net lock (see net.h), so they don't race
+// with the application's callbacks or the esb_net task and don't wait for each other's SUBACK.
+// The SUBACKs are tracked and once every subscription is confirmed the session is "ready":
+// mqttReady() returns true and the handler registered with mqttOnReady runs from mqttLoop. If
+// the broker rejects a subscription the session doesn't become ready, the rejection is logged
+// and mqttSubsFailed() returns true until the next connection. Applications register their
+// topics once in setup() with mqttAddSubscription instead of subscribing in a connect callback.
+
+#include <Arduino.h>
+
+#ifndef ESB_SUBS_MAX
+#define ESB_SUBS_MAX 16 // max number of subscriptions
+#endif
+
+// mqttAddSubscription adds topic to the table, subscribing right away if connected. Returns
+// false if the table is full.
+extern bool mqttAddSubscription(ESBTopic topic, uint8_t qos);
+// mqttRemoveSubscription removes topic from the table and unsubscribes if connected.
+extern void mqttRemoveSubscription(ESBTopic topic);
+
+// mqttReady returns true once all subscriptions of the current connection are confirmed, see
+// also mqttOnReady in net.h.
+extern bool mqttReady();
+// mqttSubsFailed returns true if the broker rejected a subscription of the current connection.
+extern bool mqttSubsFailed();
+
+// subsConnected and subsDisconnected are called by the MQTT connection callbacks.
+extern void subsConnected();
+extern void subsDisconnected();
+// subsAck records a SUBACK, it's the MQTT client's onSubscribe callback.
+extern void subsAck(uint16_t packetId, uint8_t qos);
+// subsUnsubscribe unsubscribes from all topics and subsResend subscribes again, mqttSetTopic
+// calls them around changing the topic prefix.
+extern void subsUnsubscribe();
+extern void subsResend();
+// subsSend sends the subscriptions that haven't been sent on this connection, it must run where
+// the MQTT client may be called, subsResend and mqttAddSubscription post it to the esb_net task
+// if necessary.
+extern void subsSend();
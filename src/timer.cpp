@@ -0,0 +1,161 @@
+// ESP32 Secure Base - timer wheel
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+
+ESBTimers esbTimers;
+
+// one lock for all wheels, it's only held for a few list operations at a time
+static portMUX_TYPE timerMux = portMUX_INITIALIZER_UNLOCKED;
+
+#define SLOT_MASK (ESB_TIMER_SLOTS-1)
+
+// rotr rotates the bitmap right so bit n ends up at bit 0.
+static inline uint64_t rotr(uint64_t bits, int n) {
+    n &= 63;
+    return n ? (bits >> n) | (bits << (64-n)) : bits;
+}
+
+ESBTimers::ESBTimers() : _now(0), _waiter(NULL) {
+    memset(_slots, 0, sizeof(_slots));
+    memset(_used, 0, sizeof(_used));
+}
+
+// insert puts t into the slot for its expiry relative to _now. A timer that expires at _now goes
+// into the level 0 slot about to be processed, which is what cascading relies on.
+void ESBTimers::insert(ESBTimer &t) {
+    uint32_t delta = t._expires - _now;
+    uint32_t at = t._expires;
+    int level = 0;
+    while (level < ESB_TIMER_LEVELS-1 && delta >= 1u << (ESB_TIMER_BITS*(level+1))) level++;
+    if (delta >= 1u << (ESB_TIMER_BITS*ESB_TIMER_LEVELS)) {
+        // beyond the top level: park in the furthest slot, it gets re-inserted when cascaded
+        at = _now + (1u << (ESB_TIMER_BITS*ESB_TIMER_LEVELS)) - 1;
+    }
+    int slot = (at >> (ESB_TIMER_BITS*level)) & SLOT_MASK;
+    ESBTimer **head = &_slots[level][slot];
+    t._next = *head;
+    if (t._next) t._next->_pprev = &t._next;
+    t._pprev = head;
+    *head = &t;
+    t._level = level;
+    t._slot = slot;
+    _used[level] |= 1ULL << slot;
+}
+
+void ESBTimers::unlink(ESBTimer &t) {
+    *t._pprev = t._next;
+    if (t._next) t._next->_pprev = t._pprev;
+    t._pprev = NULL;
+    t._next = NULL;
+    if (!_slots[t._level][t._slot]) _used[t._level] &= ~(1ULL << t._slot);
+}
+
+// nextDelta returns the number of ticks from _now to the next tick at which a timer expires or
+// a non-empty slot of a higher level cascades.
+uint32_t ESBTimers::nextDelta() {
+    uint32_t best = ESB_TIMER_IDLE;
+    for (int level=0; level<ESB_TIMER_LEVELS; level++) {
+        if (!_used[level]) continue;
+        int shift = ESB_TIMER_BITS*level;
+        uint32_t cur = _now >> shift;
+        // slots after the current one come first, the current one itself is a full turn away
+        uint32_t offset = __builtin_ctzll(rotr(_used[level], (cur & SLOT_MASK) + 1)) + 1;
+        uint32_t delta = ((cur + offset) << shift) - _now;
+        if (delta < best) best = delta;
+    }
+    return best;
+}
+
+void ESBTimers::start(ESBTimer &t, uint32_t delay, uint32_t period) {
+    portENTER_CRITICAL(&timerMux);
+    if (t._pprev) unlink(t);
+    t._expires = millis() + delay;
+    // the tick at _now has been processed already
+    if ((int32_t)(t._expires - _now) <= 0) t._expires = _now + 1;
+    t._period = period;
+    insert(t);
+    portEXIT_CRITICAL(&timerMux);
+    wake();
+}
+
+void ESBTimers::stop(ESBTimer &t) {
+    portENTER_CRITICAL(&timerMux);
+    if (t._pprev) unlink(t);
+    portEXIT_CRITICAL(&timerMux);
+}
+
+void ESBTimers::run() {
+    uint32_t target = millis();
+    portENTER_CRITICAL(&timerMux);
+    while (_now != target) {
+        uint32_t delta = nextDelta();
+        if (delta > target - _now) {
+            _now = target; // nothing happens in-between
+            break;
+        }
+        _now += delta;
+
+        // cascade the slots whose turn has come, top level first so timers trickle down
+        for (int level=ESB_TIMER_LEVELS-1; level>0; level--) {
+            int shift = ESB_TIMER_BITS*level;
+            if (_now & ((1u << shift) - 1)) continue;
+            int slot = (_now >> shift) & SLOT_MASK;
+            ESBTimer *t = _slots[level][slot];
+            _slots[level][slot] = NULL;
+            _used[level] &= ~(1ULL << slot);
+            while (t) {
+                ESBTimer *next = t->_next;
+                insert(*t);
+                t = next;
+            }
+        }
+
+        // fire the timers in the level 0 slot, the lock is released while a callback runs
+        int slot = _now & SLOT_MASK;
+        while (ESBTimer *t = _slots[0][slot]) {
+            unlink(*t);
+            if (t->_period) {
+                // skip the periods missed if run() wasn't called for a while
+                t->_expires += t->_period;
+                if ((int32_t)(t->_expires - target) <= 0)
+                    t->_expires += ((target - t->_expires) / t->_period + 1) * t->_period;
+                insert(*t);
+            }
+            ESBTimerFn fn = t->_fn;
+            void *arg = t->_arg;
+            portEXIT_CRITICAL(&timerMux);
+            fn(arg);
+            portENTER_CRITICAL(&timerMux);
+        }
+    }
+    portEXIT_CRITICAL(&timerMux);
+}
+
+uint32_t ESBTimers::next() {
+    portENTER_CRITICAL(&timerMux);
+    uint32_t delta = nextDelta();
+    uint32_t at = _now + delta;
+    portEXIT_CRITICAL(&timerMux);
+    if (delta == ESB_TIMER_IDLE) return ESB_TIMER_IDLE;
+    int32_t ms = at - millis();
+    return ms > 0 ? ms : 0;
+}
+
+void ESBTimers::wait(uint32_t maxMs) {
+    // register as waiter first so a timer started meanwhile leaves a notification
+    _waiter = xTaskGetCurrentTaskHandle();
+    uint32_t ms = next();
+    if (ms > maxMs) ms = maxMs;
+    if (ms > 0) {
+        uint32_t t0 = micros();
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(ms));
+        latIdle(micros() - t0);
+    }
+    _waiter = NULL;
+}
+
+void ESBTimers::wake() {
+    TaskHandle_t w = _waiter;
+    if (w && w != xTaskGetCurrentTaskHandle()) xTaskNotifyGive(w);
+}
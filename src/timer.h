@@ -0,0 +1,72 @@
+// ESP32 Secure Base - timer wheel
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// ESBTimers is a hierarchical timer wheel with millisecond ticks for one-shot and periodic
+// callbacks. Each of the 4 levels has 64 slots covering 64 times the span of the level below,
+// so a timer is inserted into the slot of the level matching how far out it expires and is
+// cascaded to the level below when that level wraps around to it. A bitmap of the non-empty
+// slots of each level tells where the next expiry or cascade is without scanning, so starting,
+// stopping, and finding the next deadline are O(1), and run() skips over idle stretches
+// directly rather than tick by tick.
+// Timers may be started and stopped from any task, the callbacks run in the task that calls
+// run(). esbTimers is run by mqttLoop and loop() can call esbTimers.wait() to sleep until the
+// next deadline instead of polling millis().
+
+#include <Arduino.h>
+
+#define ESB_TIMER_BITS 6                     // log2 of the number of slots per level
+#define ESB_TIMER_SLOTS (1<<ESB_TIMER_BITS)
+#define ESB_TIMER_LEVELS 4                   // 64^4ms = 4.6 hours, longer timers cascade again
+#define ESB_TIMER_IDLE 0x7fffffff            // next() when no timer is running
+
+typedef void (*ESBTimerFn)(void *arg);
+
+class ESBTimer {
+public:
+    ESBTimer(ESBTimerFn fn, void *arg = NULL)
+      : _fn(fn), _arg(arg), _next(NULL), _pprev(NULL)
+    {}
+
+    bool active() { return _pprev != NULL; }
+
+//private:
+    ESBTimerFn _fn;
+    void       *_arg;
+    uint32_t   _expires; // millis() when the timer fires
+    uint32_t   _period;  // 0 for one-shot timers
+    ESBTimer   *_next;   // next timer in the same slot
+    ESBTimer   **_pprev; // pointer to this timer in the slot list, NULL if not running
+    uint8_t    _level;
+    uint8_t    _slot;
+};
+
+class ESBTimers {
+public:
+    ESBTimers();
+
+    // start (re)starts timer t to fire in delay ms and then every period ms unless period is 0.
+    void start(ESBTimer &t, uint32_t delay, uint32_t period = 0);
+    void stop(ESBTimer &t);
+
+    // run calls the callbacks of all timers that have expired.
+    void run();
+    // next returns the number of ms until run() has something to do, ESB_TIMER_IDLE if nothing.
+    uint32_t next();
+    // wait blocks the calling task until the next deadline, a timer is started by another task,
+    // wake() is called, or maxMs elapse, whichever comes first.
+    void wait(uint32_t maxMs = 1000);
+    // wake ends a wait(), e.g. when another task has queued work for the waiting task.
+    void wake();
+
+//private:
+    ESBTimer *_slots[ESB_TIMER_LEVELS][ESB_TIMER_SLOTS];
+    uint64_t _used[ESB_TIMER_LEVELS]; // bitmap of non-empty slots
+    uint32_t _now;                    // last tick processed by run()
+    volatile TaskHandle_t _waiter;    // task blocked in wait()
+
+    void insert(ESBTimer &t);
+    void unlink(ESBTimer &t);
+    uint32_t nextDelta();
+};
+
+extern ESBTimers esbTimers;
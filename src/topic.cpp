@@ -0,0 +1,127 @@
+// ESP32 Secure Base - interned MQTT topics
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+#include <atomic>
+
+static const char *topicSuffix[ESB_TOPIC_MAX];
+static uint16_t topicOff[2][ESB_TOPIC_MAX];  // offset of each topic in each arena
+static char topicArena[2][ESB_TOPIC_ARENA];  // the last byte stays 0 for topics that don't fit
+static uint16_t topicUsed[2];
+static bool topicBulk[ESB_TOPIC_MAX];        // telemetry topics for the bulk session
+static bool topicAbs[ESB_TOPIC_MAX];         // full topics, not below mqTopic
+static std::atomic<uint8_t> topicCur(0);     // arena in use
+static std::atomic<uint8_t> topicNum(0);     // number of registered topics
+static std::atomic<uint16_t> topicUsers[2];  // ESBTopicStr holding each arena
+static portMUX_TYPE topicMux = portMUX_INITIALIZER_UNLOCKED;
+
+// topicAdd appends topic t to arena a, returns false if it doesn't fit.
+static bool topicAdd(int a, int t) {
+    int plen = topicAbs[t] ? 0 : mqTopicLen;
+    uint16_t len = plen + strlen(topicSuffix[t]) + 1;
+    if (topicUsed[a] + len > ESB_TOPIC_ARENA-1) {
+        topicOff[a][t] = ESB_TOPIC_ARENA-1;
+        return false;
+    }
+    char *s = topicArena[a] + topicUsed[a];
+    memcpy(s, mqTopic, plen);
+    strcpy(s+plen, topicSuffix[t]);
+    topicOff[a][t] = topicUsed[a];
+    topicUsed[a] += len;
+    return true;
+}
+
+static ESBTopic topicRegister(const char *suffix, bool bulk, bool abs) {
+    ESBTopic t = ESB_TOPIC_NONE;
+    portENTER_CRITICAL(&topicMux);
+    int n = topicNum.load(std::memory_order_relaxed);
+    for (int i=0; i<n; i++) {
+        if (topicAbs[i] == abs && strcmp(topicSuffix[i], suffix) == 0) {
+            portEXIT_CRITICAL(&topicMux);
+            return (ESBTopic)i;
+        }
+    }
+    if (n < ESB_TOPIC_MAX) {
+        topicSuffix[n] = suffix;
+        topicBulk[n] = bulk;
+        topicAbs[n] = abs;
+        if (topicAdd(topicCur.load(std::memory_order_relaxed), n)) {
+            topicNum.store(n+1, std::memory_order_release);
+            t = (ESBTopic)n;
+        }
+    }
+    portEXIT_CRITICAL(&topicMux);
+    if (t == ESB_TOPIC_NONE) {
+        ESB_LOGE("MQTT: no space for topic %s%s\n", abs ? "" : mqTopic, suffix);
+    }
+    return t;
+}
+
+ESBTopic mqttTopic(const char *suffix, bool bulk) {
+    return topicRegister(suffix, bulk, false);
+}
+
+ESBTopic mqttTopicAbs(const char *topic) {
+    return topicRegister(topic, false, true);
+}
+
+const char *mqttTopicStr(ESBTopic t) {
+    uint8_t i = (uint8_t)t;
+    if (i >= topicNum.load(std::memory_order_acquire)) return NULL;
+    int a = topicCur.load(std::memory_order_acquire);
+    return topicArena[a] + topicOff[a][i];
+}
+
+// ESBTopicStr counts itself as a user of the current arena. If a rebuild switched arenas in the
+// meantime it backs off and tries the new one: a rebuild only checks the users before it starts
+// writing and a late user must not read what it writes.
+ESBTopicStr::ESBTopicStr(ESBTopic t)
+  : str(NULL)
+  , _arena(0)
+{
+    uint8_t i = (uint8_t)t;
+    if (i >= topicNum.load(std::memory_order_acquire)) return;
+    for (;;) {
+        int a = topicCur.load();
+        topicUsers[a]++;
+        if (topicCur.load() == a) {
+            _arena = a;
+            str = topicArena[a] + topicOff[a][i];
+            return;
+        }
+        topicUsers[a]--;
+    }
+}
+
+ESBTopicStr::~ESBTopicStr() {
+    if (str) topicUsers[_arena]--;
+}
+
+bool mqttTopicIs(ESBTopic t, const char *topic) {
+    ESBTopicStr s(t);
+    return s.str && strcmp(s.str, topic) == 0;
+}
+
+bool mqttTopicBulk(ESBTopic t) {
+    return (uint8_t)t < ESB_TOPIC_MAX && topicBulk[(uint8_t)t];
+}
+
+void topicRebuild() {
+    int dropped = 0;
+    int a;
+    for (;;) {
+        portENTER_CRITICAL(&topicMux);
+        a = 1 - topicCur.load(std::memory_order_relaxed);
+        if (topicUsers[a].load() == 0) break;
+        portEXIT_CRITICAL(&topicMux);
+        vTaskDelay(1); // a task still uses a topic from before the previous rebuild
+    }
+    int n = topicNum.load(std::memory_order_relaxed);
+    topicUsed[a] = 0;
+    for (int i=0; i<n; i++) {
+        if (!topicAdd(a, i)) dropped++;
+    }
+    topicCur.store(a, std::memory_order_release);
+    portEXIT_CRITICAL(&topicMux);
+    if (dropped) ESB_LOGE("MQTT: no space for %d topics below %s\n", dropped, mqTopic);
+}
@@ -0,0 +1,67 @@
+// ESP32 Secure Base - interned MQTT topics
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// mqttTopic("/suffix") registers a topic below mqTopic once and returns a small handle, the full
+// "<mqTopic>/suffix" string is kept in an arena and passed to the MQTT client as-is, so
+// publishing doesn't build topic strings into stack buffers. mqttSetTopic rebuilds the arena
+// when the prefix changes. The arena is double-buffered: the new strings are built in the
+// inactive half, which then becomes current, so a task publishing while the prefix changes sees
+// either the old or the new topic. A task that uses a topic string holds it with ESBTopicStr,
+// which counts the users of each half, and a rebuild waits until nobody uses the half it's about
+// to overwrite, so back-to-back prefix changes can't pull a string out from under a publish.
+
+#include <Arduino.h>
+
+#ifndef ESB_TOPIC_MAX
+#define ESB_TOPIC_MAX 32     // max number of registered topics
+#endif
+#ifndef ESB_TOPIC_ARENA
+#define ESB_TOPIC_ARENA 1024 // bytes for the full topic strings (times two)
+#endif
+
+// ESBTopic is a distinct type so an integer doesn't silently pass for a handle.
+enum class ESBTopic : uint8_t { None = 0xff };
+#define ESB_TOPIC_NONE ESBTopic::None // returned when the table or the arena is full
+
+// mqttTopic returns the handle for <mqTopic><suffix>, registering the suffix the first time.
+// The suffix string must remain allocated, e.g. a string literal. Bulk topics, i.e. telemetry,
+// are published on the bulk session if it is enabled (see bulk.h), the class is set by the first
+// registration.
+extern ESBTopic mqttTopic(const char *suffix, bool bulk = false);
+// mqttTopicAbs returns the handle for a topic that is not below mqTopic, e.g. one shared by all
+// devices. The string must remain allocated.
+extern ESBTopic mqttTopicAbs(const char *topic);
+// mqttTopicOnce returns the handle cached in t, registering the suffix until that succeeds, so
+// a function-local static doesn't keep ESB_TOPIC_NONE forever:
+//   static ESBTopic topic = ESB_TOPIC_NONE;
+//   return mqttTopicOnce(topic, "/ping");
+static inline ESBTopic mqttTopicOnce(ESBTopic &t, const char *suffix, bool bulk = false) {
+    if (t == ESB_TOPIC_NONE) t = mqttTopic(suffix, bulk);
+    return t;
+}
+// mqttTopicBulk returns true if t is a bulk topic.
+extern bool mqttTopicBulk(ESBTopic t);
+// mqttTopicStr returns the full topic, NULL for ESB_TOPIC_NONE. The string may be overwritten by
+// the second prefix change after the call, use it right away, e.g. in a log message, or hold it
+// with ESBTopicStr.
+extern const char *mqttTopicStr(ESBTopic t);
+// mqttTopicIs returns true if topic is the full topic of t.
+extern bool mqttTopicIs(ESBTopic t, const char *topic);
+
+// ESBTopicStr holds the full topic of t in str, NULL for ESB_TOPIC_NONE, until it goes out of
+// scope.
+class ESBTopicStr {
+public:
+    ESBTopicStr(ESBTopic t);
+    ~ESBTopicStr();
+
+    const char *str;
+//private:
+    uint8_t _arena;
+};
+// topicRebuild recomputes all topics after mqTopic changed, called by mqttSetTopic.
+extern void topicRebuild();
+
+extern bool mqttPublish(ESBTopic topic, uint8_t qos, bool retain, const char *payload, size_t len);
+extern bool mqttSubscribe(ESBTopic topic, uint8_t qos);
+extern bool mqttUnsubscribe(ESBTopic topic);
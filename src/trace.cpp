@@ -0,0 +1,268 @@
+// ESP32 Secure Base - periodic sampling of debug variables
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+
+#define TRACE_MSG 1024     // max size of a trace message
+#define TRACE_FLUSH 5000   // max ms a sample waits before it is published
+#define TRACE_NAME 48      // max length of a variable name including index
+
+ESBTrace ESBTrace::traces[ESB_TRACE_MAX];
+esp_timer_handle_t ESBTrace::timer = NULL;
+static bool traceTimerOn = false; // the timer runs while something is traced
+
+// traceMux guards the settings of the slots against the timer, traceLock serializes start and
+// stop from the CLI with traceLoop, which consumes the sample buffers
+static portMUX_TYPE traceMux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t traceLock = NULL;
+
+// TraceLock holds traceLock for the rest of the scope, it's a no-op before the first start.
+struct TraceLock {
+    TraceLock() { if (traceLock) xSemaphoreTakeRecursive(traceLock, portMAX_DELAY); }
+    ~TraceLock() { if (traceLock) xSemaphoreGiveRecursive(traceLock); }
+};
+
+//===== sampling, runs in the esp_timer task
+
+void ESBTrace::sample() {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= ESB_TRACE_SAMPLES) {
+        dropped++;
+        return;
+    }
+    uint32_t i = h & (ESB_TRACE_SAMPLES-1);
+    at[i] = millis();
+    if (var->_type == ESB_VAR_FLOAT && var->_size == 4) {
+        float f = var->readFloat(ix);
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        val[i] = bits;
+    } else if (var->_type == ESB_VAR_FLOAT) {
+        double d = var->readFloat(ix);
+        memcpy(&val[i], &d, sizeof(d));
+    } else {
+        val[i] = (uint64_t)var->readInt(ix);
+    }
+    head.store(h+1, std::memory_order_release);
+}
+
+void ESBTrace::tick(void *) {
+    portENTER_CRITICAL(&traceMux);
+    for (int i=0; i<ESB_TRACE_MAX; i++) {
+        ESBTrace &t = traces[i];
+        if (t.period == 0 || --t.countdown > 0) continue;
+        t.countdown = t.period;
+        t.sample();
+    }
+    portEXIT_CRITICAL(&traceMux);
+}
+
+//===== control
+
+bool ESBTrace::start(ESBVar *var, int ix, uint32_t periodMs) {
+    if (var->_type == ESB_VAR_STR) return false;
+    uint32_t ticks = (periodMs + ESB_TRACE_TICK/2) / ESB_TRACE_TICK;
+    if (ticks < 1) ticks = 1;
+    if (ticks > 0xffff) ticks = 0xffff;
+    if (!traceLock) traceLock = xSemaphoreCreateRecursiveMutex();
+    if (!traceLock) return false;
+    TraceLock lock;
+    stop(var, ix);
+    // find a free slot, the sample buffers of a slot are kept once allocated
+    ESBTrace *t = NULL;
+    for (int i=0; i<ESB_TRACE_MAX && !t; i++) {
+        if (traces[i].var == NULL) t = &traces[i];
+    }
+    if (!t) return false;
+    ESB_ALLOC_SCOPE(traceStart, false);
+    if (!t->at) t->at = (uint32_t *)malloc(ESB_TRACE_SAMPLES*sizeof(uint32_t));
+    if (!t->val) t->val = (uint64_t *)malloc(ESB_TRACE_SAMPLES*sizeof(uint64_t));
+    if (!t->at || !t->val) return false;
+    if (!timer) {
+        esp_timer_create_args_t args = {};
+        args.callback = tick;
+        args.name = "esb_trace";
+        if (esp_timer_create(&args, &timer) != ESP_OK) return false;
+    }
+    portENTER_CRITICAL(&traceMux);
+    t->var = var;
+    t->ix = ix;
+    t->dropped = 0;
+    t->tail.store(t->head.load());
+    t->countdown = 1;
+    t->period = ticks;
+    portEXIT_CRITICAL(&traceMux);
+    if (!traceTimerOn) {
+        esp_timer_start_periodic(timer, ESB_TRACE_TICK*1000);
+        traceTimerOn = true;
+    }
+    return true;
+}
+
+// stop stops the trace and, once nothing is traced, the timer.
+void ESBTrace::stop(ESBVar *var, int ix) {
+    TraceLock lock;
+    bool active = false;
+    portENTER_CRITICAL(&traceMux);
+    for (int i=0; i<ESB_TRACE_MAX; i++) {
+        ESBTrace &t = traces[i];
+        if (t.var == var && t.ix == ix) {
+            t.period = 0;
+            t.var = NULL; // samples not yet published are discarded
+        }
+        active = active || t.var;
+    }
+    portEXIT_CRITICAL(&traceMux);
+    if (!active && traceTimerOn) {
+        esp_timer_stop(timer);
+        traceTimerOn = false;
+    }
+}
+
+void ESBTrace::list() {
+    TraceLock lock;
+    printf("== Traces:\n");
+    for (int i=0; i<ESB_TRACE_MAX; i++) {
+        ESBTrace &t = traces[i];
+        if (!t.var) continue;
+        printf("  %s", t.var->_name);
+        if (t.var->_count > 1) printf("[%d]", t.ix);
+        printf(" every %dms, %u buffered, %u dropped\n", t.period*ESB_TRACE_TICK,
+                t.head.load()-t.tail.load(), t.dropped);
+    }
+}
+
+//===== encoding and publishing
+
+static int putVarint(uint8_t *buf, uint64_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    buf[n++] = v;
+    return n;
+}
+
+// encode appends a block with as many buffered samples as fit into buf and consumes them.
+// A block ends early at a gap in the timestamps, i.e. when samples were dropped. Returns the
+// length of the block, 0 if buf is too small for even one sample.
+int ESBTrace::encode(uint8_t *buf, int size) {
+    ESBVar *v = var;
+    if (!v) return 0;
+    char name[TRACE_NAME];
+    int nameLen;
+    if (v->_count > 1) nameLen = snprintf(name, sizeof(name), "%s[%d]", v->_name, ix);
+    else nameLen = snprintf(name, sizeof(name), "%s", v->_name);
+    if (nameLen >= (int)sizeof(name)) nameLen = sizeof(name)-1;
+    if (size < nameLen+2+2*5+2+10) return 0;
+
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    uint32_t h = head.load(std::memory_order_acquire);
+    uint32_t periodMs = period*ESB_TRACE_TICK;
+    uint32_t t0 = at[t & (ESB_TRACE_SAMPLES-1)];
+
+    // header
+    int len = 0;
+    buf[len++] = nameLen;
+    memcpy(buf+len, name, nameLen);
+    len += nameLen;
+    uint8_t log2size = 0;
+    while ((1 << log2size) < v->_size) log2size++;
+    buf[len++] = v->_type<<4 | log2size;
+    len += putVarint(buf+len, periodMs);
+    len += putVarint(buf+len, t0);
+    int countAt = len;
+    len += 2;
+
+    // samples
+    bool isFloat = v->_type == ESB_VAR_FLOAT;
+    uint64_t prev = 0;
+    uint32_t n = 0;
+    for (; t != h && n < 0xffff && len+10 <= size; t++, n++) {
+        uint32_t i = t & (ESB_TRACE_SAMPLES-1);
+        if (n > 0 && (int32_t)(at[i] - (t0 + n*periodMs)) > (int32_t)periodMs/2) break;
+        uint64_t x = val[i];
+        if (isFloat) {
+            len += putVarint(buf+len, x ^ prev);
+        } else {
+            int64_t d = (int64_t)(x - prev);
+            len += putVarint(buf+len, ((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+        }
+        prev = x;
+    }
+    buf[countAt] = n & 0xff;
+    buf[countAt+1] = n >> 8;
+    tail.store(t, std::memory_order_release);
+    return len;
+}
+
+static uint8_t traceMsg[TRACE_MSG];
+
+static void tracePublish(int len) {
+    static ESBTopic topic = ESB_TOPIC_NONE;
+    mqttPublish(mqttTopicOnce(topic, "/trace", true), 0, false, (const char *)traceMsg, len);
+}
+
+// traceLoop publishes the samples of all traces as soon as one of them has a half-full ring or
+// holds a sample older than TRACE_FLUSH, so messages carry many samples of several variables.
+void traceLoop() {
+    if (!ESBTrace::timer || !mqttClient.connected()) return;
+    TraceLock lock;
+    bool due = false;
+    for (int i=0; i<ESB_TRACE_MAX && !due; i++) {
+        ESBTrace &t = ESBTrace::traces[i];
+        if (!t.var) continue;
+        uint32_t tail = t.tail.load();
+        uint32_t n = t.head.load() - tail;
+        due = n >= ESB_TRACE_SAMPLES/2 ||
+            (n > 0 && millis() - t.at[tail & (ESB_TRACE_SAMPLES-1)] > TRACE_FLUSH);
+    }
+    if (!due) return;
+
+    int len = 0;
+    for (int i=0; i<ESB_TRACE_MAX; i++) {
+        ESBTrace &t = ESBTrace::traces[i];
+        if (!t.var) continue;
+        while (t.head.load() != t.tail.load()) {
+            int l = t.encode(traceMsg+len, sizeof(traceMsg)-len);
+            if (l == 0 && len == 0) break;
+            if (l == 0) {
+                tracePublish(len);
+                len = 0;
+            }
+            len += l;
+        }
+    }
+    if (len > 0) tracePublish(len);
+}
+
+//===== debug command
+
+static void cmdDebugTrace(ESBArgs &args) {
+    const char *name = args.str();
+    if (!name) {
+        ESBTrace::list();
+        return;
+    }
+    uint32_t period;
+    if (!args.u32(period)) {
+        printf("Usage: debug trace <variable>[[<index>]] <period-ms>\n");
+        return;
+    }
+    int ix;
+    ESBVar *var = ESBVar::find(name, ix);
+    if (!var) {
+        printf("DEBUG: variable '%s' not found\n", name);
+        return;
+    }
+    if (ix < 0) ix = 0;
+    if (period == 0) {
+        ESBTrace::stop(var, ix);
+    } else if (!ESBTrace::start(var, ix, period)) {
+        printf("DEBUG: cannot trace '%s'\n", name);
+        return;
+    }
+    ESBTrace::list();
+}
+ESB_CMD(debug, trace, cmdDebugTrace, "[<variable>[[<index>]] <period-ms>]");
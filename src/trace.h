@@ -0,0 +1,61 @@
+// ESP32 Secure Base - periodic sampling of debug variables
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// Any variable registered with DV() can be traced: a timer samples it at a fixed period into a
+// per-variable ring buffer and mqttLoop publishes the samples in batches on <mqTopic>/trace.
+// Tracing is controlled with "debug trace <var>[[<index>]] <period-ms>" (period 0 stops it),
+// the timer only runs while at least one variable is traced.
+//
+// A trace message is a sequence of blocks, each holding a run of evenly spaced samples:
+//   u8 name length, name (with [index] for array elements)
+//   u8 type: ESBVarType<<4 | log2(element size)
+//   varint period in ms, varint millis() timestamp of the first sample, u16 (LE) sample count
+//   samples: integers are zig-zag varints of the delta to the previous sample, floats are
+//   varints of their raw bits XOR'ed with the previous sample's bits; the first sample of a
+//   block is relative to zero, so each block decodes on its own.
+// Varints are little-endian base-128 with the high bit set on all but the last byte.
+// tools/trace_decode.py decodes the messages.
+
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <atomic>
+
+#ifndef ESB_TRACE_MAX
+#define ESB_TRACE_MAX 8       // max number of variables traced concurrently
+#endif
+#ifndef ESB_TRACE_SAMPLES
+#define ESB_TRACE_SAMPLES 64  // samples buffered per variable, power of two
+#endif
+#define ESB_TRACE_TICK 10     // sampling timer resolution in milliseconds
+
+class ESBVar;
+
+class ESBTrace {
+public:
+    ESBVar   *var;      // variable being sampled, NULL if the slot is free
+    int16_t  ix;        // array element being sampled
+    uint16_t period;    // sampling period in ticks
+    uint16_t countdown; // ticks until the next sample
+    std::atomic<uint32_t> head; // number of samples taken, written by the timer only
+    std::atomic<uint32_t> tail; // number of samples published, written by traceLoop only
+    uint32_t dropped;   // samples dropped because the ring was full
+    uint32_t *at;       // millis() of each sample
+    uint64_t *val;      // raw value of each sample
+
+    static ESBTrace traces[ESB_TRACE_MAX];
+    static esp_timer_handle_t timer;
+
+    // start starts tracing element ix of var every periodMs milliseconds, replacing any
+    // existing trace of the same element. Returns false if no slot or memory is available.
+    static bool start(ESBVar *var, int ix, uint32_t periodMs);
+    static void stop(ESBVar *var, int ix);
+    static void list();
+
+//private:
+    static void tick(void *);
+    void sample();
+    int encode(uint8_t *buf, int size);
+};
+
+// traceLoop publishes buffered samples, it is called from mqttLoop.
+extern void traceLoop();
@@ -0,0 +1,306 @@
+// ESP32 Secure Base - variable registry for debugging
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+
+ESBVar *ESBVar::_first = NULL;
+uint16_t ESBVar::_num = 0;
+std::atomic<ESBVarIndex *> ESBVar::_index(NULL);
+uint16_t ESBVar::_indexNum = 0;
+static portMUX_TYPE varMux = portMUX_INITIALIZER_UNLOCKED;
+
+//===== reading and writing values
+
+// read64 reads a 64-bit value, which the CPU accesses as two 32-bit halves. A std::atomic is
+// loaded with the lock that all its accesses take, a plain value is copied with interrupts off,
+// so no task on this core can update it half-way.
+static uint64_t read64(const void *p, bool atomic) {
+    if (atomic) return ((const std::atomic<uint64_t> *)p)->load();
+    portENTER_CRITICAL(&varMux);
+    uint64_t v = *(const volatile uint64_t *)p;
+    portEXIT_CRITICAL(&varMux);
+    return v;
+}
+
+// write64 is the counterpart of read64.
+static void write64(void *p, uint64_t v, bool atomic) {
+    if (atomic) {
+        ((std::atomic<uint64_t> *)p)->store(v);
+        return;
+    }
+    portENTER_CRITICAL(&varMux);
+    *(volatile uint64_t *)p = v;
+    portEXIT_CRITICAL(&varMux);
+}
+
+int64_t ESBVar::readInt(int ix) {
+    void *p = elem(ix);
+    switch (_type) {
+    case ESB_VAR_FLOAT:
+        return (int64_t)readFloat(ix);
+    case ESB_VAR_STR:
+        return 0;
+    case ESB_VAR_INT:
+        switch (_size) {
+        case 1: return *(volatile int8_t *)p;
+        case 2: return *(volatile int16_t *)p;
+        case 4: return *(volatile int32_t *)p;
+        case 8: return (int64_t)read64(p, _flags & ESB_VAR_ATOMIC);
+        }
+        return 0;
+    default:
+        switch (_size) {
+        case 1: return *(volatile uint8_t *)p;
+        case 2: return *(volatile uint16_t *)p;
+        case 4: return *(volatile uint32_t *)p;
+        case 8: return (int64_t)read64(p, _flags & ESB_VAR_ATOMIC);
+        }
+        return 0;
+    }
+}
+
+double ESBVar::readFloat(int ix) {
+    void *p = elem(ix);
+    if (_type == ESB_VAR_FLOAT) {
+        if (_size == 4) return *(volatile float *)p;
+        if (_size != 8) return 0;
+        uint64_t v = read64(p, _flags & ESB_VAR_ATOMIC);
+        double d;
+        memcpy(&d, &v, sizeof(d));
+        return d;
+    }
+    if (_type == ESB_VAR_UINT && _size == 8) return (double)(uint64_t)readInt(ix);
+    return (double)readInt(ix);
+}
+
+// formatElem prints one element into buf, returns the number of chars printed.
+static int formatElem(ESBVar *v, char *buf, int size, int ix) {
+    switch (v->_type) {
+    case ESB_VAR_BOOL:
+        return snprintf(buf, size, "%s", v->readInt(ix) ? "true" : "false");
+    case ESB_VAR_FLOAT:
+        return snprintf(buf, size, v->_size == 4 ? "%.7g" : "%.15g", v->readFloat(ix));
+    case ESB_VAR_STR:
+        return snprintf(buf, size, "\"%.*s\"", v->_size, (const char *)v->_ref);
+    case ESB_VAR_INT:
+        return snprintf(buf, size, "%lld", v->readInt(ix));
+    default: {
+        uint64_t val = (uint64_t)v->readInt(ix);
+        return snprintf(buf, size, "%llu/0x%llx", val, val);
+        }
+    }
+}
+
+void ESBVar::format(char *buf, int size, int ix) {
+    if (ix >= 0 || _count == 1) {
+        formatElem(this, buf, size, ix < 0 ? 0 : ix);
+        return;
+    }
+    int len = snprintf(buf, size, "[");
+    for (int i=0; i<_count && len < size-1; i++) {
+        if (len > size-20) { len += snprintf(buf+len, size-len, "..."); break; }
+        if (i > 0) len += snprintf(buf+len, size-len, ", ");
+        if (len < size-1) len += formatElem(this, buf+len, size-len, i);
+    }
+    if (len < size-1) snprintf(buf+len, size-len, "]");
+}
+
+bool ESBVar::write(const char *str, int ix) {
+    if (ix < 0 || ix >= _count) return false;
+    void *p = elem(ix);
+    char *end;
+    switch (_type) {
+    case ESB_VAR_STR:
+        strncpy((char *)_ref, str, _size-1);
+        ((char *)_ref)[_size-1] = 0;
+        return true;
+    case ESB_VAR_BOOL: {
+        bool b;
+        if (strcmp(str, "1") == 0 || strcmp(str, "true") == 0 || strcmp(str, "on") == 0) b = true;
+        else if (strcmp(str, "0") == 0 || strcmp(str, "false") == 0 || strcmp(str, "off") == 0) b = false;
+        else return false;
+        *(bool *)p = b;
+        return true;
+        }
+    case ESB_VAR_FLOAT: {
+        double d = strtod(str, &end);
+        if (*str == 0 || *end != 0) return false;
+        if (_size == 4) {
+            *(float *)p = d;
+        } else {
+            uint64_t v;
+            memcpy(&v, &d, sizeof(v));
+            write64(p, v, _flags & ESB_VAR_ATOMIC);
+        }
+        return true;
+        }
+    case ESB_VAR_INT: {
+        int64_t val = strtoll(str, &end, 0);
+        if (*str == 0 || *end != 0) return false;
+        if (_size < 8 && (val < -(1LL << (8*_size-1)) || val >= (1LL << (8*_size-1)))) return false;
+        switch (_size) {
+        case 1: *(int8_t *)p = val; break;
+        case 2: *(int16_t *)p = val; break;
+        case 4: *(int32_t *)p = val; break;
+        case 8: write64(p, val, _flags & ESB_VAR_ATOMIC); break;
+        default: return false;
+        }
+        return true;
+        }
+    default: {
+        if (strchr(str, '-')) return false;
+        uint64_t val = strtoull(str, &end, 0);
+        if (*str == 0 || *end != 0) return false;
+        if (_size < 8 && val >= (1ULL << (8*_size))) return false;
+        switch (_size) {
+        case 1: *(uint8_t *)p = val; break;
+        case 2: *(uint16_t *)p = val; break;
+        case 4: *(uint32_t *)p = val; break;
+        case 8: write64(p, val, _flags & ESB_VAR_ATOMIC); break;
+        default: return false;
+        }
+        return true;
+        }
+    }
+}
+
+//===== listing and lookup
+
+// typeName returns a short name for the type of v, such as u32 or f64.
+static const char *typeName(ESBVar *v, char *buf) {
+    switch (v->_type) {
+    case ESB_VAR_BOOL: return "bool";
+    case ESB_VAR_STR: return "str";
+    case ESB_VAR_FLOAT: sprintf(buf, "f%d", v->_size*8); break;
+    case ESB_VAR_INT: sprintf(buf, "i%d", v->_size*8); break;
+    default: sprintf(buf, "u%d", v->_size*8); break;
+    }
+    if (v->_count > 1) sprintf(buf+strlen(buf), "[%d]", v->_count);
+    return buf;
+}
+
+void ESBVar::list() {
+    printf("== Variables:\n");
+    char val[100], type[12];
+    for (ESBVar *v=_first; v; v=v->_next) {
+        v->format(val, sizeof(val));
+        printf("  %s %s%s%s = %s\n", v->_name, typeName(v, type),
+                v->_flags & ESB_VAR_COUNTER ? " counter" : "",
+                v->_flags & ESB_VAR_WRITABLE ? " writable" : "", val);
+    }
+}
+
+// buildIndex builds a new hash index, it's called the first time a variable is looked up and
+// again if variables get registered later, e.g. by a function-local static DV(). The new index
+// replaces the old one in a single store and the old one is left allocated, a lookup running
+// concurrently in another task may still be reading it.
+void ESBVar::buildIndex() {
+    ESB_ALLOC_SCOPE(varIndex, false);
+    uint16_t num = _num;
+    uint16_t len = 16;
+    while (len < 2*num) len *= 2;
+    ESBVarIndex *index = (ESBVarIndex *)calloc(1, sizeof(ESBVarIndex) + len*sizeof(ESBVar *));
+    if (!index) return;
+    index->len = len;
+    // insert in list order so the most recently registered of duplicate names is found
+    for (ESBVar *v=_first; v; v=v->_next) {
+        uint32_t ix = esbHash(v->_name);
+        while (index->slot()[ix & (len-1)]) ix++;
+        index->slot()[ix & (len-1)] = v;
+    }
+    _index.store(index, std::memory_order_release);
+    _indexNum = num;
+}
+
+ESBVar *ESBVar::find(const char *name) {
+    if (_indexNum != _num) buildIndex();
+    ESBVarIndex *index = _index.load(std::memory_order_acquire);
+    if (!index || _indexNum != _num) {
+        // out of memory for the index or it's being rebuilt, search the list
+        for (ESBVar *v = _first; v; v = v->_next) {
+            if (strcmp(v->_name, name) == 0) return v;
+        }
+        return NULL;
+    }
+    uint32_t ix = esbHash(name);
+    for (ESBVar *v; (v = index->slot()[ix & (index->len-1)]) != NULL; ix++) {
+        if (strcmp(v->_name, name) == 0) return v;
+    }
+    return NULL;
+}
+
+ESBVar *ESBVar::find(const char *arg, int &ix) {
+    ix = -1;
+    const char *br = strchr(arg, '[');
+    if (!br) return ESBVar::find(arg);
+    char name[48];
+    int len = br-arg;
+    if (len >= (int)sizeof(name)) return NULL;
+    memcpy(name, arg, len);
+    name[len] = 0;
+    ix = atoi(br+1);
+    ESBVar *v = ESBVar::find(name);
+    return v && ix >= 0 && ix < v->_count ? v : NULL;
+}
+
+//===== debug commands
+
+static void cmdDebugList(ESBArgs &args) {
+    ESBVar::list();
+}
+ESB_CMD(debug, list, cmdDebugList, "");
+
+// showVar prints the value of the variable called name.
+static void showVar(const char *name) {
+    int ix;
+    ESBVar *var = ESBVar::find(name, ix);
+    if (!var) {
+        printf("DEBUG: variable '%s' not found\n", name);
+        return;
+    }
+    char val[200];
+    var->format(val, sizeof(val), ix);
+    printf("  %s: %s\n", name, val);
+}
+
+static void cmdDebugShow(ESBArgs &args) {
+    const char *name = args.str("");
+    if (strlen(name) == 0) {
+        printf("DEBUG show: variable name required\n");
+        return;
+    }
+    showVar(name);
+}
+ESB_CMD(debug, show, cmdDebugShow, "<variable>[[<index>]]");
+
+static void cmdDebugSet(ESBArgs &args) {
+    const char *name = args.str();
+    const char *value = args.str();
+    if (!name || !value) {
+        printf("Usage: debug set <variable>[[<index>]] <value>\n");
+        return;
+    }
+    int ix;
+    ESBVar *var = ESBVar::find(name, ix);
+    if (!var) {
+        printf("DEBUG: variable '%s' not found\n", name);
+    } else if (!(var->_flags & ESB_VAR_WRITABLE)) {
+        printf("DEBUG: variable '%s' is not writable\n", name);
+    } else if (!var->write(value, ix < 0 ? 0 : ix)) {
+        printf("DEBUG: invalid value '%s' for '%s'\n", value, name);
+    } else {
+        showVar(name);
+    }
+}
+ESB_CMD(debug, set, cmdDebugSet, "<variable>[[<index>]] <value>");
+
+// debug <variable> is a short-hand for debug show <variable>
+static void cmdDebugVar(ESBArgs &args) {
+    const char *name = args.str();
+    if (!name) {
+        ESBCmd::help("debug");
+        return;
+    }
+    showVar(name);
+}
+ESB_CMD(debug, , cmdDebugVar, "<variable>[[<index>]]");
@@ -0,0 +1,129 @@
+// ESP32 Secure Base - variable registry for debugging
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// Variables are registered statically using DV(v), DVC(v), or DVW(v) and can then be listed,
+// shown, and (if writable) set using the debug command. The type of the variable is captured
+// at compile time: signed and unsigned integers of 1 to 8 bytes, float, double, bool, char
+// arrays (shown as strings), and fixed-size arrays of any of these. A 64-bit variable that is
+// updated by another task or core should be a std::atomic, it's then read with a single atomic
+// load and can't be seen half-written.
+// Lookups by name go through a hash index that is built on first use after static init.
+
+#include <Arduino.h>
+#include <atomic>
+#include <type_traits>
+
+enum ESBVarType : uint8_t {
+    ESB_VAR_INT,
+    ESB_VAR_UINT,
+    ESB_VAR_FLOAT, // float or double, depending on size
+    ESB_VAR_BOOL,
+    ESB_VAR_STR,   // char array holding a null-terminated string
+};
+
+// flags
+#define ESB_VAR_COUNTER  1 // monotonically increasing counter, as opposed to a gauge
+#define ESB_VAR_WRITABLE 2 // tunable that can be changed using debug set
+#define ESB_VAR_ATOMIC   4 // std::atomic, read and written with atomic operations
+
+// esbVarBase strips std::atomic off a variable's type.
+template<typename T> struct esbVarBase {
+    typedef T type;
+    static constexpr uint8_t flags = 0;
+};
+template<typename T> struct esbVarBase<std::atomic<T>> {
+    typedef T type;
+    static constexpr uint8_t flags = ESB_VAR_ATOMIC;
+};
+
+template<typename T> constexpr ESBVarType esbVarType() {
+    typedef typename std::remove_cv<typename esbVarBase<T>::type>::type U;
+    return std::is_same<U, bool>::value ? ESB_VAR_BOOL :
+        std::is_floating_point<U>::value ? ESB_VAR_FLOAT :
+        std::is_signed<U>::value || std::is_enum<U>::value ? ESB_VAR_INT : ESB_VAR_UINT;
+}
+
+// ESBVarIndex is the hash index, open addressing, it's followed by len slots, a power of two.
+class ESBVar;
+struct ESBVarIndex {
+    uint32_t len;
+
+    ESBVar **slot() { return (ESBVar **)(this+1); }
+};
+
+class ESBVar {
+public:
+    const char *_name;
+    void       *_ref;
+    ESBVar     *_next;
+    uint16_t   _size;  // size of one element (of the whole string for ESB_VAR_STR)
+    ESBVarType _type;
+    uint8_t    _flags;
+    uint16_t   _count; // number of elements, 1 unless it's an array
+
+    static ESBVar *_first;
+    static uint16_t _num;      // number of registered variables
+    // hash index, replaced when variables are added and never freed so a lookup in another task
+    // can keep using the old one
+    static std::atomic<ESBVarIndex *> _index;
+    static uint16_t _indexNum; // number of variables in index
+
+    ESBVar(const char *name, void *ref, int size, ESBVarType type = ESB_VAR_UINT, int count = 1,
+            uint8_t flags = 0)
+      : _name(name)
+      , _ref(ref)
+      , _size(size)
+      , _type(type)
+      , _flags(flags)
+      , _count(count)
+    {
+        _next = _first;
+        _first = this;
+        _num++;
+    }
+
+    template<typename T>
+    ESBVar(const char *name, T &ref, int flags = 0)
+      : ESBVar(name, (void *)&ref, sizeof(T), esbVarType<T>(), 1, flags | esbVarBase<T>::flags)
+    {}
+
+    template<typename T, size_t N>
+    ESBVar(const char *name, T (&ref)[N], int flags = 0)
+      : ESBVar(name, (void *)ref, sizeof(T),
+              std::is_same<typename std::remove_cv<T>::type, char>::value ? ESB_VAR_STR
+                  : esbVarType<T>(),
+              std::is_same<typename std::remove_cv<T>::type, char>::value ? 1 : N,
+              flags | esbVarBase<T>::flags)
+    {
+        if (_type == ESB_VAR_STR) _size = N;
+    }
+
+    static void list();
+
+    static ESBVar *find(const char *name);
+    // find looks up a variable given as name or name[index], for a plain name ix is set to -1.
+    static ESBVar *find(const char *arg, int &ix);
+
+    // readInt returns element ix as integer, floats are truncated. A 64-bit value is read
+    // tear-free if it's a std::atomic or only updated on the calling task's core.
+    int64_t readInt(int ix = 0);
+    // readFloat returns element ix as double.
+    double readFloat(int ix = 0);
+    // read returns the value truncated to 32 bits (backwards compatibility).
+    uint32_t read() { return (uint32_t)readInt(); }
+
+    // format prints element ix (all elements if ix<0) into buf.
+    void format(char *buf, int size, int ix = -1);
+    // write parses str and stores it into element ix, returns false if str is not valid for the
+    // type. It does not check the writable flag.
+    bool write(const char *str, int ix = 0);
+
+//private:
+    static void buildIndex();
+    void *elem(int ix) { return (uint8_t *)_ref + ix*_size; }
+};
+
+// DV registers a variable (a gauge), DVC a counter, and DVW a writable tunable.
+#define DV(v) static ESBVar __ ## v(#v, v)
+#define DVC(v) static ESBVar __ ## v(#v, v, ESB_VAR_COUNTER)
+#define DVW(v) static ESBVar __ ## v(#v, v, ESB_VAR_WRITABLE)
@@ -0,0 +1,158 @@
+// ESP32 Secure Base - payload compression
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+
+#include <ESPSecureBase.h>
+#include <atomic>
+
+#define ZIP_HASH_BITS 9
+#define ZIP_CHAIN 16        // max matches tried per position
+#define ZIP_MAXLEN (63+3)
+
+// ZipBufs holds the hash tables and buffers, about 11KB, allocated by mqttEnableZip so an
+// application that doesn't compress doesn't pay for them.
+struct ZipBufs {
+    uint16_t head[1<<ZIP_HASH_BITS]; // last position+1 with a given hash, 0 if none
+    uint16_t prev[ESB_ZIP_WINDOW];   // previous position+1 with the same hash
+    uint8_t  tx[ESB_ZIP_BUF];
+    char     rx[ESB_ZIP_BUF+1];
+};
+static ZipBufs *zip = NULL;
+
+static volatile bool zipOn = false;
+static std::atomic<bool> zipBusy(false);   // zip->tx and the hash tables are in use
+
+static inline uint32_t zipHash(const uint8_t *p) {
+    return ((p[0]<<16 | p[1]<<8 | p[2]) * 2654435761u) >> (32-ZIP_HASH_BITS);
+}
+
+size_t esbZip(const uint8_t *in, size_t len, uint8_t *out, size_t size) {
+    if (!zip || len > 0xffff || size < ESB_ZIP_HDR) return 0;
+    uint16_t *zipHead = zip->head, *zipPrev = zip->prev;
+    memset(zipHead, 0, sizeof(zip->head));
+    size_t o = ESB_ZIP_HDR, flagAt = 0;
+    int bit = 8;
+    for (size_t i=0; i < len; ) {
+        if (bit == 8) {
+            if (o >= size) return 0;
+            flagAt = o++;
+            out[flagAt] = 0;
+            bit = 0;
+        }
+        // find the longest match in the window
+        size_t bestLen = 0, bestDist = 0;
+        if (i+3 <= len) {
+            size_t max = len-i < ZIP_MAXLEN ? len-i : ZIP_MAXLEN;
+            int chain = ZIP_CHAIN;
+            uint32_t p = zipHead[zipHash(in+i)];
+            for (; p && chain--; p = zipPrev[(p-1) & (ESB_ZIP_WINDOW-1)]) {
+                size_t c = p-1, dist = i-c;
+                if (dist > ESB_ZIP_WINDOW) break;
+                size_t l = 0;
+                while (l < max && in[c+l] == in[i+l]) l++;
+                if (l > bestLen) {
+                    bestLen = l;
+                    bestDist = dist;
+                    if (l == max) break;
+                }
+            }
+        }
+        size_t n;
+        if (bestLen >= 3) {
+            if (o+2 > size) return 0;
+            uint16_t v = (bestDist-1) << 6 | (bestLen-3);
+            out[o++] = v >> 8;
+            out[o++] = v & 0xff;
+            n = bestLen;
+        } else {
+            if (o+1 > size) return 0;
+            out[o++] = in[i];
+            out[flagAt] |= 1 << bit;
+            n = 1;
+        }
+        bit++;
+        // hash the positions covered
+        for (; n > 0; n--, i++) {
+            if (i+3 > len) continue;
+            uint32_t h = zipHash(in+i);
+            zipPrev[i & (ESB_ZIP_WINDOW-1)] = zipHead[h];
+            zipHead[h] = i+1;
+        }
+    }
+    size_t clen = o - ESB_ZIP_HDR;
+    out[0] = 0;
+    out[1] = 'Z';
+    out[2] = len & 0xff;
+    out[3] = len >> 8;
+    out[4] = clen & 0xff;
+    out[5] = clen >> 8;
+    return o;
+}
+
+size_t esbUnzip(const uint8_t *in, size_t len, uint8_t *out, size_t size) {
+    if (!esbZipped((const char *)in, len)) return 0;
+    size_t olen = in[2] | in[3]<<8;
+    size_t end = ESB_ZIP_HDR + (in[4] | in[5]<<8);
+    if (end > len || olen > size) return 0;
+    size_t i = ESB_ZIP_HDR, o = 0;
+    while (o < olen) {
+        if (i >= end) return 0;
+        uint8_t flags = in[i++];
+        for (int bit=0; bit < 8 && o < olen; bit++) {
+            if (flags & (1 << bit)) {
+                if (i >= end) return 0;
+                out[o++] = in[i++];
+            } else {
+                if (i+2 > end) return 0;
+                uint16_t v = in[i] << 8 | in[i+1];
+                i += 2;
+                size_t dist = (v >> 6) + 1, l = (v & 63) + 3;
+                if (dist > o || o+l > olen) return 0;
+                for (; l > 0; l--, o++) out[o] = out[o-dist];
+            }
+        }
+    }
+    return olen;
+}
+
+void mqttEnableZip(bool enable) {
+    if (enable && !zip) {
+        // kept once allocated, another task may be using it
+        ESB_ALLOC_SCOPE(zip, false);
+        zip = (ZipBufs *)malloc(sizeof(ZipBufs));
+        if (!zip) {
+            ESB_LOGE("ZIP: out of memory, compression stays off\n");
+            return;
+        }
+    }
+    zipOn = enable;
+}
+
+const char *zipPack(const char *payload, size_t &len) {
+    if (!zipOn || len < ESB_ZIP_MIN || zipBusy.exchange(true)) return payload;
+    // it has to come out smaller
+    size_t n = esbZip((const uint8_t *)payload, len, zip->tx,
+            len <= sizeof(zip->tx) ? len-1 : sizeof(zip->tx));
+    if (n == 0) {
+        zipBusy.store(false);
+        return payload;
+    }
+    len = n;
+    return (const char *)zip->tx;
+}
+
+void zipDone(const char *packed) {
+    if (zip && packed == (const char *)zip->tx) zipBusy.store(false);
+}
+
+bool zipReceived(const char *payload, size_t len) {
+    return zipOn && esbZipped(payload, len);
+}
+
+char *zipUnpack(const char *payload, size_t &len) {
+    if (!zip) return NULL;
+    size_t n = esbUnzip((const uint8_t *)payload, len, (uint8_t *)zip->rx, ESB_ZIP_BUF);
+    if (n == 0) return NULL;
+    zip->rx[n] = 0;
+    len = n;
+    return zip->rx;
+}
@@ -0,0 +1,56 @@
+// ESP32 Secure Base - payload compression
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// Large payloads such as CLI output, config dumps, and log batches are repetitive text, with
+// mqttEnableZip(true) those of at least ESB_ZIP_MIN bytes are compressed before they're
+// published, if that makes them smaller, and received messages that carry the header are
+// decompressed, once reassembled if they arrived in pieces (see netReassemble). With compression
+// off received payloads are passed on as they are, even if they happen to start like the header.
+// The tables and buffers, about 11KB, are allocated when compression is first enabled.
+// tools/esbzip.py is the host side codec.
+//
+// Format: a compressed payload starts with a 6-byte header: 0x00 'Z', the uncompressed length
+// and the compressed length (following the header), both 16-bit little-endian. No text payload
+// starts with a NUL byte, binary ones may, which is why only a device that enabled compression
+// decodes it. The lengths make the messages self-delimiting when concatenated, e.g. by
+// mosquitto_sub -N.
+// The data is LZSS with a 1KB window: a flag byte precedes each group of 8 items, LSB first, a 1
+// bit is a literal byte, a 0 bit a 2-byte big-endian match (distance-1)<<6 | (length-3) that
+// copies 3..66 bytes from 1..1024 bytes back.
+
+#include <Arduino.h>
+
+#ifndef ESB_ZIP_MIN
+#define ESB_ZIP_MIN 256   // smallest payload that is compressed
+#endif
+#ifndef ESB_ZIP_BUF
+#define ESB_ZIP_BUF 4096  // max compressed payload published, max decompressed payload received
+#endif
+#define ESB_ZIP_HDR 6
+#define ESB_ZIP_WINDOW 1024
+
+// esbZip compresses len bytes into out, returns the size including the header or 0 if it
+// doesn't fit into size bytes or compression was never enabled. Not reentrant, it uses the
+// shared hash tables.
+extern size_t esbZip(const uint8_t *in, size_t len, uint8_t *out, size_t size);
+// esbUnzip decompresses into out, returns the uncompressed size or 0 if the data is malformed or
+// doesn't fit into size bytes.
+extern size_t esbUnzip(const uint8_t *in, size_t len, uint8_t *out, size_t size);
+// esbZipped returns true if payload starts with the header.
+static inline bool esbZipped(const char *payload, size_t len) {
+    return len >= ESB_ZIP_HDR && payload[0] == 0 && payload[1] == 'Z';
+}
+
+// mqttEnableZip enables compression of published payloads and decompression of received ones.
+extern void mqttEnableZip(bool enable);
+
+// zipPack returns the payload to publish: the compressed one in a static buffer, with len
+// updated, or payload itself if compression is off, doesn't pay, or the buffer is in use by
+// another task. zipDone must be called with the result once it has been sent or copied.
+extern const char *zipPack(const char *payload, size_t &len);
+extern void zipDone(const char *packed);
+// zipReceived returns true if a received payload is to be decompressed.
+extern bool zipReceived(const char *payload, size_t len);
+// zipUnpack returns a received payload decompressed into a static buffer, with len updated, or
+// NULL if it's malformed or too large. It's called in the AsyncTCP task only.
+extern char *zipUnpack(const char *payload, size_t &len);
@@ -0,0 +1,37 @@
+#! /usr/bin/env python3
+# ESP32 Secure Base - configuration push message
+# Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+#
+# Prints a config delta for the retained <topic>/config or fleet topic (see src/fleet.h), the
+# hash is the FNV-1a hash of the delta so publishing the same delta again is a no-op, e.g.:
+#   python3 tools/config_push.py -v 4 mqtt_server=broker2 mqtt_alt="broker3 broker4:8884" |
+#       mosquitto_pub -h broker -t 'esb/fleet/config' -r -q 1 -s
+# The version must be at least the one last applied, devices ignore older ones.
+
+import argparse
+import json
+
+def fnv1a(data):
+    h = 2166136261
+    for b in data:
+        h = ((h ^ b) * 16777619) & 0xffffffff
+    return h
+
+def main():
+    p = argparse.ArgumentParser(description="build a config push message")
+    p.add_argument("-v", "--version", type=int, required=True, help="version of the delta")
+    p.add_argument("fields", nargs="+", metavar="key=value",
+                   help="ap_pass, mqtt_server, mqtt_port, mqtt_alt, mqtt_ident, mqtt_psk")
+    args = p.parse_args()
+    delta = {}
+    for f in args.fields:
+        key, sep, val = f.partition("=")
+        if not sep:
+            p.error("expected key=value: " + f)
+        delta[key] = val
+    content = json.dumps(delta, sort_keys=True, separators=(",", ":")).encode()
+    msg = {"v": args.version, "hash": "%08x" % fnv1a(content), "set": delta}
+    print(json.dumps(msg, separators=(",", ":")))
+
+if __name__ == "__main__":
+    main()
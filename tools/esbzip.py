@@ -0,0 +1,117 @@
+#! /usr/bin/env python3
+# ESP32 Secure Base - payload compression codec
+# Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+#
+# Host side of src/zip.h: compresses and decompresses MQTT payloads in the same format as the
+# device, LZSS with a 1KB window behind a 6-byte header (0x00 'Z', uncompressed and compressed
+# length, 16-bit little-endian). Messages that don't start with the header pass through
+# unchanged, and concatenated messages are split using the lengths in the headers, so output
+# of mosquitto_sub can be piped through it:
+#   mosquitto_sub -h broker -t 'esb/node1/log' -N | python3 tools/esbzip.py -d
+#   python3 tools/esbzip.py <config.json >config.z    # compress, e.g. to publish to a device
+
+import sys
+
+HDR = 6
+WINDOW = 1024
+MINLEN, MAXLEN = 3, 66
+
+def zipped(buf, pos=0):
+    return len(buf) - pos >= HDR and buf[pos] == 0 and buf[pos+1] == ord("Z")
+
+def compress(data):
+    """Returns data compressed with header, raises ValueError if longer than 65535 bytes."""
+    if len(data) > 0xffff:
+        raise ValueError("payload too long")
+    out = bytearray()
+    heads = {}  # 3-byte string -> list of positions
+    flag_at, bit = 0, 8
+    i = 0
+    while i < len(data):
+        if bit == 8:
+            flag_at = len(out)
+            out.append(0)
+            bit = 0
+        best_len, best_dist = 0, 0
+        if i + MINLEN <= len(data):
+            maxl = min(MAXLEN, len(data) - i)
+            for c in reversed(heads.get(bytes(data[i:i+3]), [])[-16:]):
+                if i - c > WINDOW:
+                    break
+                l = 0
+                while l < maxl and data[c+l] == data[i+l]:
+                    l += 1
+                if l > best_len:
+                    best_len, best_dist = l, i - c
+                    if l == maxl:
+                        break
+        if best_len >= MINLEN:
+            v = (best_dist-1) << 6 | (best_len-MINLEN)
+            out += bytes((v >> 8, v & 0xff))
+            n = best_len
+        else:
+            out.append(data[i])
+            out[flag_at] |= 1 << bit
+            n = 1
+        bit += 1
+        for k in range(i, i+n):
+            if k + MINLEN <= len(data):
+                heads.setdefault(bytes(data[k:k+3]), []).append(k)
+        i += n
+    return bytes((0, ord("Z"), len(data) & 0xff, len(data) >> 8, len(out) & 0xff,
+                  len(out) >> 8)) + bytes(out)
+
+def decompress(buf, pos=0):
+    """Decompresses the message at buf[pos:], returns (data, position after the message)."""
+    if not zipped(buf, pos):
+        raise ValueError("not compressed")
+    olen = buf[pos+2] | buf[pos+3] << 8
+    end = pos + HDR + (buf[pos+4] | buf[pos+5] << 8)
+    if end > len(buf):
+        raise ValueError("truncated")
+    out = bytearray()
+    i = pos + HDR
+    while len(out) < olen:
+        flags = buf[i]
+        i += 1
+        for bit in range(8):
+            if len(out) >= olen:
+                break
+            if flags & (1 << bit):
+                out.append(buf[i])
+                i += 1
+            else:
+                v = buf[i] << 8 | buf[i+1]
+                i += 2
+                dist, l = (v >> 6) + 1, (v & 63) + MINLEN
+                if dist > len(out):
+                    raise ValueError("bad distance")
+                for _ in range(l):
+                    out.append(out[-dist])
+    return bytes(out), end
+
+def unzip_all(buf):
+    """Returns buf with every compressed message in it decompressed."""
+    out = bytearray()
+    pos = 0
+    while pos < len(buf):
+        if zipped(buf, pos):
+            data, pos = decompress(buf, pos)
+            out += data
+        else:
+            # plain message, runs up to the next header
+            nxt = buf.find(b"\x00Z", pos+1)
+            nxt = len(buf) if nxt < 0 else nxt
+            out += buf[pos:nxt]
+            pos = nxt
+    return bytes(out)
+
+def main():
+    data = sys.stdin.buffer.read()
+    if len(sys.argv) > 1 and sys.argv[1] == "-d":
+        sys.stdout.buffer.write(unzip_all(data))
+    else:
+        sys.stdout.buffer.write(compress(data))
+
+if __name__ == "__main__":
+    main()
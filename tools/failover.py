@@ -0,0 +1,94 @@
+#! /usr/bin/env python3
+# ESP32 Secure Base - broker failover check
+# Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+#
+# Runs two local mosquitto instances as stand-ins for a preferred and an alternate broker (see
+# src/broker.h) and checks that a device fails over to the alternate when the preferred one goes
+# away and moves back once it returns. Each stand-in has a PSK listener for the device and a
+# plain listener on localhost through which the script watches the device's <topic>/ping
+# messages. Configure the device first, with <ip> the address of this host:
+#   mqtt server <ip> 8883
+#   mqtt alt <ip>:8884
+# then run, with psk.txt holding the device's <ident>:<psk> line (e.g. from tools/mkprov):
+#   python3 tools/failover.py -p psk.txt -t esp/C44F330A9C35
+# The device pings itself after 30 seconds without traffic and probes the preferred broker every
+# ESB_BROKER_PROBE ms, so the whole run takes a few minutes. It exits with 1 if a step failed.
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+CONF = """listener {port}
+psk_hint esb
+psk_file {psk}
+use_identity_as_username true
+listener {local} 127.0.0.1
+allow_anonymous true
+"""
+
+class Broker:
+    def __init__(self, name, port, local, psk, tmp):
+        self.name, self.local, self.proc = name, local, None
+        self.conf = os.path.join(tmp, name + ".conf")
+        with open(self.conf, "w") as f:
+            f.write(CONF.format(port=port, local=local, psk=psk))
+
+    def start(self):
+        self.proc = subprocess.Popen(["mosquitto", "-c", self.conf],
+                                     stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        time.sleep(0.5)
+
+    def stop(self):
+        if self.proc:
+            self.proc.terminate()
+            self.proc.wait()
+            self.proc = None
+
+    def ping(self, topic, timeout):
+        """Returns True if the device publishes a ping on this broker within timeout seconds."""
+        r = subprocess.run(["mosquitto_sub", "-h", "127.0.0.1", "-p", str(self.local),
+                            "-t", topic + "/ping", "-C", "1", "-W", str(timeout)],
+                           stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        return r.returncode == 0
+
+def step(what, ok):
+    print("%-50s %s" % (what, "ok" if ok else "FAILED"))
+    return ok
+
+def main():
+    p = argparse.ArgumentParser(description="check broker failover with two local stand-ins")
+    p.add_argument("-p", "--psk", required=True, help="psk_file with the device's ident:psk")
+    p.add_argument("-t", "--topic", required=True, help="the device's topic prefix")
+    p.add_argument("--ports", default="8883,8884", help="PSK ports of the two stand-ins")
+    p.add_argument("--ping", type=int, default=90, help="seconds to wait for a ping")
+    p.add_argument("--probe", type=int, default=150, help="seconds to wait for the move back")
+    args = p.parse_args()
+    ports = [int(x) for x in args.ports.split(",")]
+
+    with tempfile.TemporaryDirectory() as tmp:
+        psk = os.path.abspath(args.psk)
+        pref = Broker("preferred", ports[0], ports[0] + 10000, psk, tmp)
+        alt = Broker("alternate", ports[1], ports[1] + 10000, psk, tmp)
+        ok = True
+        try:
+            pref.start()
+            alt.start()
+            ok = step("device on the preferred broker", pref.ping(args.topic, args.ping))
+            if ok:
+                pref.stop()
+                ok = step("fails over when the preferred broker stops",
+                          alt.ping(args.topic, args.ping))
+            if ok:
+                pref.start()
+                ok = step("moves back when the preferred broker returns",
+                          pref.ping(args.topic, args.probe))
+        finally:
+            pref.stop()
+            alt.stop()
+    sys.exit(0 if ok else 1)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,58 @@
+# ESP32 Secure Base - portal asset generator
+# Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+#
+# Compresses the static config portal pages in portal/ and turns them into a C header with
+# gzip'ed byte arrays that live in flash, plus an ETag for each page so browsers can cache them.
+# Runs as a platformio extra script (see library.json) and can also be run by hand:
+#   python3 tools/gen_portal.py
+
+import gzip
+import hashlib
+import os
+
+# (source file, C identifier) of each page to be embedded
+PAGES = [
+    ("index.html", "portal_index"),
+]
+
+def generate(top):
+    src_dir = os.path.join(top, "portal")
+    out_path = os.path.join(top, "src", "portal_html.h")
+
+    # skip the work if the header is newer than all the pages
+    srcs = [os.path.join(src_dir, f) for f, _ in PAGES]
+    if not all(os.path.exists(s) for s in srcs):
+        return
+    if os.path.exists(out_path) and \
+            all(os.path.getmtime(s) <= os.path.getmtime(out_path) for s in srcs):
+        return
+
+    lines = [
+        "// ESP32 Secure Base - pre-compressed config portal pages",
+        "// Generated by tools/gen_portal.py from portal/*, do not edit.",
+        "",
+    ]
+    for fname, ident in PAGES:
+        with open(os.path.join(src_dir, fname), "rb") as f:
+            raw = f.read()
+        # mtime=0 makes the output, and thus the ETag, reproducible
+        gz = gzip.compress(raw, compresslevel=9, mtime=0)
+        etag = hashlib.md5(gz).hexdigest()[:16]
+        lines.append("// %s: %d bytes, %d gzip'ed" % (fname, len(raw), len(gz)))
+        lines.append('#define %s_ETAG "\\"%s\\""' % (ident.upper(), etag))
+        lines.append("static const uint8_t %s_gz[] PROGMEM = {" % ident)
+        for i in range(0, len(gz), 16):
+            lines.append("    " + ", ".join("0x%02x" % b for b in gz[i:i+16]) + ",")
+        lines.append("};")
+        lines.append("")
+
+    with open(out_path, "w") as f:
+        f.write("\n".join(lines))
+    print("Generated %s" % out_path)
+
+if __name__ == "__main__":
+    generate(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+else:
+    # running as scons script, which does not set __file__
+    Import("env")
+    generate(os.path.dirname(Dir(".").srcnode().abspath))
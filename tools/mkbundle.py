@@ -0,0 +1,94 @@
+#! /usr/bin/env python3
+# ESP32 Secure Base - OTA bundle builder
+# Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+#
+# Builds an OTA bundle (see src/bundle.h) from an app image and data partition images, e.g.
+#   python3 tools/mkbundle.py -o bundle.bin -a .pio/build/usb/firmware.bin \
+#       -d spiffs=.pio/build/usb/spiffs.bin
+# Data images are named by partition label, the subtype is looked up in the partition table
+# (partitions.csv by default), the app image always goes first so the device verifies it before it
+# touches any data partition. Serve the bundle over HTTP with
+# Content-Type application/octet-stream and publish "<url>|<md5>" to <topic>/ota, the MD5 of the
+# bundle is printed.
+
+import argparse
+import hashlib
+import os
+import struct
+import sys
+
+MAGIC = 0x42425345  # "ESBB"
+VERSION = 1
+MAX_SEGS = 4
+TYPE_APP = 0
+TYPE_DATA = 1
+SUBTYPES = {"fat": 0x81, "spiffs": 0x82}
+PROV_SUBTYPE = 0x40
+
+def data_partitions(path):
+    """returns {label: (subtype, size)} for the data partitions in the table"""
+    parts = {}
+    with open(path) as f:
+        for line in f:
+            cols = [c.strip() for c in line.split("#")[0].split(",")]
+            if len(cols) < 5 or cols[1] != "data":
+                continue
+            sub = SUBTYPES.get(cols[2])
+            if sub is None:
+                try:
+                    sub = int(cols[2], 0)
+                except ValueError:
+                    continue  # nvs, ota, phy: not updatable
+            if sub == PROV_SUBTYPE:
+                continue  # factory provisioning, see src/prov.h
+            parts[cols[0]] = (sub, int(cols[4], 0))
+    return parts
+
+def segment(label, type_, subtype, data):
+    return struct.pack("<16sBBHI16s", label.encode(), type_, subtype, 0, len(data),
+                       hashlib.md5(data).digest())
+
+def main():
+    p = argparse.ArgumentParser(description="build an OTA bundle")
+    p.add_argument("-o", "--output", required=True, help="bundle file to write")
+    p.add_argument("-a", "--app", help="app image, e.g. firmware.bin")
+    p.add_argument("-d", "--data", action="append", default=[], metavar="LABEL=FILE",
+                   help="data partition image, may be repeated")
+    p.add_argument("-t", "--table", default=os.path.join(os.path.dirname(__file__), "..",
+                   "partitions.csv"), help="partition table (default: partitions.csv)")
+    args = p.parse_args()
+
+    parts = data_partitions(args.table)
+    segs, datas = [], []
+    if args.app:
+        data = open(args.app, "rb").read()
+        if not data or data[0] != 0xE9:
+            p.error("%s is not an ESP32 app image" % args.app)
+        segs.append(segment("", TYPE_APP, 0, data))
+        datas.append(data)
+    for d in args.data:
+        label, sep, path = d.partition("=")
+        if not sep:
+            p.error("expected LABEL=FILE: " + d)
+        if label not in parts:
+            p.error("no updatable data partition %s in %s" % (label, args.table))
+        subtype, size = parts[label]
+        data = open(path, "rb").read()
+        if len(data) > size:
+            p.error("%s is %d bytes, partition %s has %d" % (path, len(data), label, size))
+        segs.append(segment(label, TYPE_DATA, subtype, data))
+        datas.append(data)
+    if not segs:
+        p.error("nothing to bundle")
+    if len(segs) > MAX_SEGS:
+        p.error("at most %d images" % MAX_SEGS)
+
+    hdr = struct.pack("<IBBH", MAGIC, VERSION, len(segs), 8 + 40*len(segs))
+    bundle = hdr + b"".join(segs) + b"".join(datas)
+    with open(args.output, "wb") as f:
+        f.write(bundle)
+    print("%s: %d bytes, %d images, md5 %s" %
+          (args.output, len(bundle), len(segs), hashlib.md5(bundle).hexdigest()))
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,226 @@
+// ESP32 Secure Base - provisioning blob generator
+// Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+//
+// mkprov generates the provisioning blobs for a batch of devices (see src/prov.h) and the
+// matching broker credentials. Each device gets a random 128-bit PSK, its blob is written to
+// <dir>/<ident>.bin and an <ident>:<psk> line is appended to <dir>/psk.txt, which is the
+// format of mosquitto's psk_file. Existing blobs are never overwritten, so re-running mkprov
+// for a larger batch only adds the new devices. tools/provision.py flashes the blobs.
+// Build it on the host with:
+//   g++ -O2 -Wall -Isrc -o mkprov tools/mkprov.cpp
+// Example:
+//   ./mkprov -o batch1 -s mqtt.example.com:8883 -a mqtt2.example.com -c ca.pem -p lab- -n 500
+
+#include <prov.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: mkprov -o <dir> -s <host>[:<port>] [-a <alternates>] [-c <ca-file>]\n"
+        "              [-p <ident-prefix>] [-n <count>] [-f <first>] [-i <ident-file>]\n"
+        "  -o  output directory for <ident>.bin and psk.txt\n"
+        "  -s  preferred MQTT broker, the port defaults to 8883\n"
+        "  -a  alternate brokers: \"host[:port] host[:port]...\"\n"
+        "  -c  CA data (PEM or DER) to embed\n"
+        "  -p  ident prefix, followed by a 4-digit serial number (default \"esp-\")\n"
+        "  -n  number of devices (default 1), -f first serial number (default 1)\n"
+        "  -i  file with one ident per line, instead of -p/-n/-f\n");
+    exit(2);
+}
+
+// setField copies a string into a blob field, failing if it doesn't fit.
+static void setField(char *field, size_t size, const char *value, const char *what) {
+    if (strlen(value) >= size) {
+        fprintf(stderr, "mkprov: %s too long (max %zu chars): %s\n", what, size-1, value);
+        exit(1);
+    }
+    strncpy(field, value, size);
+}
+
+// checkPort fails unless the len chars at port are a port number, 1..65535. Entry is the
+// host:port it's part of, for the error message.
+static void checkPort(const char *port, size_t len, const char *entry, size_t entryLen) {
+    char buf[8], *end;
+    unsigned long n = 0;
+    if (len > 0 && len < sizeof(buf) && isdigit((unsigned char)port[0])) {
+        memcpy(buf, port, len);
+        buf[len] = 0;
+        n = strtoul(buf, &end, 10);
+        if (*end) n = 0;
+    }
+    if (n < 1 || n > 65535) {
+        fprintf(stderr, "mkprov: bad port in %.*s, must be 1..65535\n", (int)entryLen, entry);
+        exit(1);
+    }
+}
+
+// randomPsk fills psk with 32 hex digits from the kernel's CSPRNG.
+static void randomPsk(char *psk) {
+    uint8_t key[16];
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, key, sizeof(key)) != sizeof(key)) {
+        perror("mkprov: /dev/urandom");
+        exit(1);
+    }
+    close(fd);
+    for (int i=0; i<16; i++) sprintf(psk+2*i, "%02x", key[i]);
+}
+
+// readFile reads a whole file into a malloc'ed buffer with a NUL appended, so PEM data is a
+// valid C string on the device.
+static uint8_t *readFile(const char *path, size_t &len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "mkprov: %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *buf = (uint8_t *)malloc(len+1);
+    if (!buf || fread(buf, 1, len, f) != len) {
+        fprintf(stderr, "mkprov: cannot read %s\n", path);
+        exit(1);
+    }
+    fclose(f);
+    buf[len++] = 0;
+    return buf;
+}
+
+// writeBlob generates the blob for one device, returns false if it already exists.
+static bool writeBlob(const char *dir, const char *ident, const ESBProv &tmpl,
+        const uint8_t *ca, size_t caLen, FILE *pskFile)
+{
+    size_t size = sizeof(ESBProv) + caLen;
+    uint8_t *blob = (uint8_t *)calloc(1, size);
+    ESBProv *p = (ESBProv *)blob;
+    *p = tmpl;
+    setField(p->mqtt_ident, sizeof(p->mqtt_ident), ident, "ident");
+    randomPsk(p->mqtt_psk);
+    if (caLen) memcpy(blob+sizeof(ESBProv), ca, caLen);
+    size_t off = offsetof(ESBProv, version);
+    p->crc = provCrc(blob+off, size-off);
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s.bin", dir, ident);
+    int fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        free(blob);
+        return false;
+    }
+    if (fd < 0) {
+        fprintf(stderr, "mkprov: %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if (write(fd, blob, size) != (ssize_t)size || close(fd) != 0) {
+        fprintf(stderr, "mkprov: writing %s failed\n", path);
+        unlink(path);
+        exit(1);
+    }
+    fprintf(pskFile, "%s:%s\n", ident, p->mqtt_psk);
+    fflush(pskFile);
+    free(blob);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    const char *dir = NULL, *server = NULL, *alt = "", *caPath = NULL;
+    const char *prefix = "esp-", *identPath = NULL;
+    int count = 1, first = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:s:a:c:p:n:f:i:h")) != -1) {
+        switch (opt) {
+        case 'o': dir = optarg; break;
+        case 's': server = optarg; break;
+        case 'a': alt = optarg; break;
+        case 'c': caPath = optarg; break;
+        case 'p': prefix = optarg; break;
+        case 'n': count = atoi(optarg); break;
+        case 'f': first = atoi(optarg); break;
+        case 'i': identPath = optarg; break;
+        default: usage();
+        }
+    }
+    if (!dir || !server || optind != argc || count < 1) usage();
+
+    // the fields shared by the whole batch
+    ESBProv tmpl;
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.magic = ESB_PROV_MAGIC;
+    tmpl.version = ESB_PROV_VERSION;
+    tmpl.hdrSize = sizeof(ESBProv);
+    char host[256];
+    setField(host, sizeof(host), server, "server");
+    const char *port = "8883";
+    char *colon = strchr(host, ':');
+    if (colon) {
+        *colon = 0;
+        port = colon+1;
+        checkPort(port, strlen(port), server, strlen(server));
+    }
+    for (const char *s = alt; *s; ) { // same syntax as brokerSetup parses
+        size_t len = strcspn(s, " ,");
+        const char *c = (const char *)memchr(s, ':', len);
+        if (c) checkPort(c+1, s+len-(c+1), s, len);
+        s += len;
+        s += strspn(s, " ,");
+    }
+    setField(tmpl.mqtt_server, sizeof(tmpl.mqtt_server), host, "server");
+    setField(tmpl.mqtt_port, sizeof(tmpl.mqtt_port), port, "port");
+    setField(tmpl.mqtt_alt, sizeof(tmpl.mqtt_alt), alt, "alternates");
+
+    uint8_t *ca = NULL;
+    size_t caLen = 0;
+    if (caPath) ca = readFile(caPath, caLen);
+    if (sizeof(ESBProv) + caLen > ESB_PROV_SIZE) {
+        fprintf(stderr, "mkprov: CA data too large, %zu bytes max\n",
+                ESB_PROV_SIZE - sizeof(ESBProv));
+        exit(1);
+    }
+    tmpl.caLen = caLen;
+
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        fprintf(stderr, "mkprov: %s: %s\n", dir, strerror(errno));
+        exit(1);
+    }
+    char pskPath[1024];
+    snprintf(pskPath, sizeof(pskPath), "%s/psk.txt", dir);
+    FILE *pskFile = fopen(pskPath, "a");
+    if (!pskFile) {
+        fprintf(stderr, "mkprov: %s: %s\n", pskPath, strerror(errno));
+        exit(1);
+    }
+    chmod(pskPath, 0600);
+
+    int made = 0, skipped = 0;
+    if (identPath) {
+        FILE *f = fopen(identPath, "r");
+        if (!f) {
+            fprintf(stderr, "mkprov: %s: %s\n", identPath, strerror(errno));
+            exit(1);
+        }
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            line[strcspn(line, " \t\r\n#")] = 0;
+            if (!line[0]) continue;
+            if (writeBlob(dir, line, tmpl, ca, caLen, pskFile)) made++; else skipped++;
+        }
+        fclose(f);
+    } else {
+        for (int i=first; i<first+count; i++) {
+            char ident[64];
+            snprintf(ident, sizeof(ident), "%s%04d", prefix, i);
+            if (writeBlob(dir, ident, tmpl, ca, caLen, pskFile)) made++; else skipped++;
+        }
+    }
+    fclose(pskFile);
+    printf("mkprov: %d blobs written to %s, %d already existed\n", made, dir, skipped);
+    return 0;
+}
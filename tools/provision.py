@@ -0,0 +1,98 @@
+#! /usr/bin/env python3
+# ESP32 Secure Base - batch provisioning
+# Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+#
+# Flashes the blobs generated by tools/mkprov into the provisioning partition of one board after
+# the other, e.g. for a batch of 500:
+#   ./mkprov -o batch1 -s mqtt.example.com -p lab- -n 500
+#   python3 tools/provision.py -p /dev/ttyUSB0 batch1
+# and install batch1/psk.txt as the broker's psk_file. Each board gets the next blob that hasn't
+# been flashed yet, a board that was flashed before gets its blob again. The assignment is
+# recorded by MAC address in <dir>/flashed.csv, which makes the script safe to interrupt and
+# restart. The partition offset is taken from partitions.csv, the board must use that table.
+
+import argparse
+import csv
+import os
+import re
+import subprocess
+import sys
+
+PROV_SUBTYPE = 0x40  # ESB_PROV_SUBTYPE in src/prov.h
+
+def prov_offset(path):
+    with open(path) as f:
+        for line in f:
+            cols = [c.strip() for c in line.split("#")[0].split(",")]
+            if len(cols) >= 5 and cols[1] == "data" and cols[2].startswith("0x") and \
+                    int(cols[2], 0) == PROV_SUBTYPE:
+                return int(cols[3], 0)
+    sys.exit("no provisioning partition (data, 0x%x) in %s" % (PROV_SUBTYPE, path))
+
+def esptool(port, *args):
+    cmd = [sys.executable, "-m", "esptool", "--port", port] + list(args)
+    r = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                       universal_newlines=True)
+    if r.returncode != 0:
+        print(r.stdout)
+        raise RuntimeError("esptool %s failed" % args[0])
+    return r.stdout
+
+def read_mac(port):
+    m = re.search(r"MAC: ([0-9a-f:]{17})", esptool(port, "read_mac"))
+    if not m:
+        raise RuntimeError("cannot read MAC address")
+    return m.group(1)
+
+def main():
+    p = argparse.ArgumentParser(description="flash provisioning blobs into a batch of boards")
+    p.add_argument("-p", "--port", required=True, help="serial port of the board")
+    p.add_argument("-t", "--table", default=os.path.join(os.path.dirname(__file__), "..",
+                   "partitions.csv"), help="partition table (default: partitions.csv)")
+    p.add_argument("-1", "--once", action="store_true", help="flash one board and exit")
+    p.add_argument("dir", help="directory with the blobs generated by mkprov")
+    args = p.parse_args()
+
+    offset = prov_offset(args.table)
+    log = os.path.join(args.dir, "flashed.csv")
+    flashed = {} # mac -> ident
+    if os.path.exists(log):
+        with open(log) as f:
+            flashed = {row[0]: row[1] for row in csv.reader(f) if len(row) == 2}
+    idents = sorted(f[:-4] for f in os.listdir(args.dir) if f.endswith(".bin"))
+
+    while True:
+        if not args.once:
+            try:
+                input("Connect the next board to %s and press enter (^D to quit) " % args.port)
+            except EOFError:
+                print()
+                break
+        try:
+            mac = read_mac(args.port)
+            ident = flashed.get(mac)
+            if ident is None:
+                used = set(flashed.values())
+                free = [i for i in idents if i not in used]
+                if not free:
+                    sys.exit("all %d blobs in %s are used, run mkprov for more" %
+                             (len(idents), args.dir))
+                ident = free[0]
+            blob = os.path.join(args.dir, ident + ".bin")
+            esptool(args.port, "write_flash", "0x%x" % offset, blob)
+        except RuntimeError as e:
+            print("FAILED: %s" % e)
+            if args.once:
+                sys.exit(1)
+            continue
+        if mac not in flashed:
+            flashed[mac] = ident
+            with open(log, "a") as f:
+                csv.writer(f).writerow([mac, ident])
+        print("%s: provisioned as %s (%d of %d blobs used)" %
+              (mac, ident, len(flashed), len(idents)))
+        if args.once:
+            break
+
+if __name__ == "__main__":
+    main()
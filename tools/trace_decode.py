@@ -0,0 +1,78 @@
+#! /usr/bin/env python3
+# ESP32 Secure Base - trace decoder
+# Copyright (c) 2019 Thorsten von Eicken, all rights reserved
+#
+# Decodes the variable traces published on <topic>/trace (see src/trace.h for the format) and
+# prints one "name,millis,value" CSV line per sample. The blocks are self-delimiting, so any
+# number of messages can be decoded from one file, e.g.:
+#   mosquitto_sub -h broker -t 'esb/node1/trace' -N >trace.bin
+#   python3 tools/trace_decode.py trace.bin
+# Without file argument it reads stdin. Compressed messages (see src/zip.h) are decompressed.
+
+import struct
+import sys
+
+import esbzip
+
+# ESBVarType
+INT, UINT, FLOAT, BOOL = 0, 1, 2, 3
+
+def varint(buf, pos):
+    v, shift = 0, 0
+    while True:
+        b = buf[pos]
+        pos += 1
+        v |= (b & 0x7f) << shift
+        shift += 7
+        if b < 0x80:
+            return v, pos
+
+def decode(buf):
+    """Generates (name, millis, value) for each sample in buf."""
+    pos = 0
+    while pos < len(buf):
+        if esbzip.zipped(buf, pos):
+            data, pos = esbzip.decompress(buf, pos)
+            yield from decode(data)
+            continue
+        nlen = buf[pos]
+        name = buf[pos+1:pos+1+nlen].decode(errors="replace")
+        pos += 1+nlen
+        typ, size = buf[pos] >> 4, 1 << (buf[pos] & 0xf)
+        pos += 1
+        period, pos = varint(buf, pos)
+        t0, pos = varint(buf, pos)
+        count = buf[pos] | buf[pos+1] << 8
+        pos += 2
+        prev = 0
+        for i in range(count):
+            code, pos = varint(buf, pos)
+            if typ == FLOAT:
+                prev ^= code
+                if size == 4:
+                    val = struct.unpack("<f", struct.pack("<I", prev))[0]
+                else:
+                    val = struct.unpack("<d", struct.pack("<Q", prev))[0]
+            else:
+                prev = (prev + ((code >> 1) ^ -(code & 1))) & 0xffffffffffffffff
+                val = prev
+                if typ == INT and val >= 1 << 63:
+                    val -= 1 << 64
+                if typ == BOOL:
+                    val = int(val != 0)
+            yield name, (t0 + i*period) & 0xffffffff, val
+
+def main():
+    if len(sys.argv) > 1:
+        bufs = []
+        for fn in sys.argv[1:]:
+            with open(fn, "rb") as f:
+                bufs.append(f.read())
+    else:
+        bufs = [sys.stdin.buffer.read()]
+    for buf in bufs:
+        for name, t, val in decode(buf):
+            print("%s,%d,%s" % (name, t, val))
+
+if __name__ == "__main__":
+    main()